@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "acmatch.h"
+
+typedef struct acmatch_struct {
+    uint8_t cls[256]; /* byte to class, 0 for bytes no pattern contains */
+    int cls_n;
+    int32_t *delta; /* next state for every state and class, states_n * cls_n */
+    int32_t *first; /* lowest pattern ending at each state, -1 if none */
+    int32_t *next_id; /* next pattern ending at the same state, per pattern */
+    /* nearest state reached through failure links that has patterns, 0 if
+     * none, so reporting never walks states without output */
+    int32_t *dict;
+    int32_t *out; /* first state to report from, itself or dict, 0 if none */
+    int states_n;
+    int32_t state;
+} acmatch_t;
+
+acmatch_handle
+acmatch_create(char * const *patterns, int patterns_n)
+{
+    acmatch_t *ac;
+    int used[256] = { 0 };
+    size_t max_states = 1;
+    int32_t *fail;
+    int32_t *queue;
+    int q_head = 0;
+    int q_tail = 0;
+    int n;
+
+    for (int i = 0; i < patterns_n; i++) {
+        const uint8_t *p = (const uint8_t *)patterns[i];
+
+        for (; *p; p++) {
+            used[*p] = 1;
+            max_states++;
+        }
+    }
+
+    if (max_states == 1)
+        return NULL;
+
+    ac = calloc(1, sizeof(acmatch_t));
+
+    /* bytes that are in no pattern all behave the same, so they share class
+     * 0 and the table only needs a column per distinct pattern byte */
+    ac->cls_n = 1;
+    for (int b = 0; b < 256; b++) {
+        if (used[b])
+            ac->cls[b] = ac->cls_n++;
+    }
+    n = ac->cls_n;
+
+    /* 0 doubles as "no edge" while building, nothing ever goes back to the
+     * root through the trie */
+    ac->delta = calloc(max_states * n, sizeof(int32_t));
+    ac->first = malloc(sizeof(int32_t) * max_states);
+    ac->next_id = malloc(sizeof(int32_t) * patterns_n);
+    ac->dict = calloc(max_states, sizeof(int32_t));
+    ac->out = calloc(max_states, sizeof(int32_t));
+    for (size_t i = 0; i < max_states; i++) {
+        ac->first[i] = -1;
+    }
+    ac->states_n = 1;
+
+    /* going backwards leaves each state's pattern list in index order */
+    for (int i = patterns_n - 1; i >= 0; i--) {
+        const uint8_t *p = (const uint8_t *)patterns[i];
+        int32_t s = 0;
+
+        ac->next_id[i] = -1;
+        if (*p == '\0')
+            continue;
+
+        for (; *p; p++) {
+            int32_t *edge = &ac->delta[s * n + ac->cls[*p]];
+
+            if (*edge == 0)
+                *edge = ac->states_n++;
+            s = *edge;
+        }
+
+        ac->next_id[i] = ac->first[s];
+        ac->first[s] = i;
+    }
+
+    fail = calloc(ac->states_n, sizeof(int32_t));
+    queue = malloc(sizeof(int32_t) * ac->states_n);
+
+    /* the root's children fail back to the root, its missing edges already
+     * loop back to it */
+    for (int c = 0; c < n; c++) {
+        int32_t t = ac->delta[c];
+
+        if (t) {
+            ac->out[t] = ac->first[t] >= 0 ? t : 0;
+            queue[q_tail++] = t;
+        }
+    }
+
+    /* breadth first, so a state's failure target is always finished before
+     * the state itself */
+    while (q_head < q_tail) {
+        int32_t s = queue[q_head++];
+        int32_t *row = &ac->delta[s * n];
+        int32_t *fail_row = &ac->delta[fail[s] * n];
+
+        for (int c = 0; c < n; c++) {
+            int32_t t = row[c];
+            int32_t f;
+
+            if (!t) {
+                /* complete the DFA, a missing edge goes where the failure
+                 * state would */
+                row[c] = fail_row[c];
+                continue;
+            }
+
+            f = fail_row[c];
+            fail[t] = f;
+            ac->dict[t] = ac->first[f] >= 0 ? f : ac->dict[f];
+            ac->out[t] = ac->first[t] >= 0 ? t : ac->dict[t];
+            queue[q_tail++] = t;
+        }
+    }
+
+    free(queue);
+    free(fail);
+
+    return ac;
+}
+
+int
+acmatch_feed(acmatch_handle ac, const char *buf, size_t len, acmatch_fn fn, void *arg)
+{
+    const int32_t *delta = ac->delta;
+    const uint8_t *cls = ac->cls;
+    int32_t s = ac->state;
+    int n = ac->cls_n;
+    int hits = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        s = delta[s * n + cls[(uint8_t)buf[i]]];
+
+        if (!ac->out[s])
+            continue;
+
+        for (int32_t m = ac->out[s]; m; m = ac->dict[m]) {
+            for (int32_t id = ac->first[m]; id >= 0; id = ac->next_id[id]) {
+                fn(id, i, arg);
+                hits++;
+            }
+        }
+    }
+
+    ac->state = s;
+
+    return hits;
+}
+
+void
+acmatch_reset(acmatch_handle ac)
+{
+    ac->state = 0;
+}
+
+int
+acmatch_states(acmatch_handle ac)
+{
+    return ac->states_n;
+}
+
+void
+acmatch_destroy(acmatch_handle ac)
+{
+    if (!ac)
+        return;
+
+    free(ac->delta);
+    free(ac->first);
+    free(ac->next_id);
+    free(ac->dict);
+    free(ac->out);
+    free(ac);
+}
@@ -0,0 +1,35 @@
+#ifndef _ACMATCH_H_
+#define _ACMATCH_H_
+
+#include <stdio.h>
+
+/* Aho-Corasick matching of many literal patterns at once. The patterns are
+ * compiled into a DFA over the byte classes that appear in them, so every
+ * input byte costs a single table lookup no matter how many patterns there
+ * are. The match state is kept between feeds, so a pattern split across two
+ * reads is still found. */
+
+typedef struct acmatch_struct * acmatch_handle;
+
+/* called for every match, id is the pattern's index and end the offset of its
+ * last byte in the buffer being fed */
+typedef void (*acmatch_fn)(int id, size_t end, void *arg);
+
+/* Compile the patterns, which are not kept. Empty patterns never match.
+ * Returns NULL if no pattern is usable. */
+acmatch_handle acmatch_create(char * const *patterns, int patterns_n);
+
+/* Run buf through the automaton, calling fn for every match in order.
+ * Patterns ending on the same byte are reported in index order. Returns the
+ * number of matches. */
+int acmatch_feed(acmatch_handle ac, const char *buf, size_t len, acmatch_fn fn, void *arg);
+
+/* Forget any partial match */
+void acmatch_reset(acmatch_handle ac);
+
+/* Number of DFA states */
+int acmatch_states(acmatch_handle ac);
+
+void acmatch_destroy(acmatch_handle ac);
+
+#endif /* _ACMATCH_H_ */
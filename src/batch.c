@@ -0,0 +1,645 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef __MINGW32__
+#  include <glob.h>
+#  include <sys/epoll.h>
+#  include <unistd.h>
+#endif
+
+#include "batch.h"
+#include "bstr.h"
+#include "script.h"
+#include "timer_math.h"
+
+/* longest a worker sleeps without anything to wait on */
+#define BATCH_WAIT_MAX_MS (1000)
+
+/* output read from one port before the others get a turn */
+#define BATCH_READ_MAX (64 * 1024)
+
+typedef struct batch_port_struct {
+    char *path;
+    serial_t ser_fd;
+    FILE *log;
+    script_handle script;
+    int result; /* SCRIPT_RUNNING until the script is done */
+    int read_failed;
+    int ready; /* output came in since the last step */
+    struct timespec due; /* when the script's wait runs out */
+    struct timespec took; /* from the start to the end of the script */
+    char *pending; /* sent by the script but not taken by the port yet */
+    size_t pending_len;
+    int want_write; /* waiting for the port to take pending */
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    int farm; /* name the port in messages */
+    int worker_fd; /* the worker's epoll fd */
+} batch_port_t;
+
+typedef struct batch_worker_struct {
+    pthread_t thread;
+    batch_port_t **ports;
+    int ports_n;
+    const char *ending;
+    struct timespec start;
+} batch_worker_t;
+
+static char **expand_ports(char * const *ports, int ports_n, int *out_n, int *globbed);
+static int open_port(batch_port_t *port, bytenuts_config_t *config, const char *script_path);
+static void close_port(batch_port_t *port);
+static int worker_count(int ports_n);
+static void *worker_thread(void *arg);
+static void step_port(batch_worker_t *w, batch_port_t *port);
+static void wait_ports(batch_worker_t *w, uint32_t wait_ms);
+static void read_port(batch_port_t *port, int woken);
+static void fail_port(batch_port_t *port);
+static int flush_port(batch_port_t *port);
+static void watch_write(batch_port_t *port, int on);
+static int port_send(const char *buf, size_t len, void *arg);
+static void port_log(const char *msg, void *arg);
+static void get_now(struct timespec *ts);
+static const char *result_str(int result);
+static int result_code(int result);
+static void print_table(batch_port_t *ports, int ports_n, const struct timespec *took);
+
+int
+batch_run(bytenuts_config_t *config, const char *script_path, char * const *port_args, int port_args_n)
+{
+    batch_port_t *ports;
+    batch_worker_t *workers;
+    char **paths;
+    int ports_n;
+    int workers_n;
+    int globbed;
+    int farm;
+    struct timespec start, now;
+    int code = BATCH_EXIT_OK;
+
+    get_now(&start);
+
+    paths = expand_ports(port_args, port_args_n, &ports_n, &globbed);
+    if (ports_n == 0) {
+        fprintf(stderr, "bytenuts: no serial ports match\n");
+        free(paths);
+        return BATCH_EXIT_ERROR;
+    }
+
+    /* one port streams its output to stdout or the -l log, a farm writes a
+     * log per port and prints a table at the end */
+    farm = ports_n > 1 || globbed;
+
+    ports = calloc(ports_n, sizeof(batch_port_t));
+    for (int i = 0; i < ports_n; i++) {
+        ports[i].path = paths[i];
+        ports[i].ser_fd = SERIAL_INVALID;
+        ports[i].result = SCRIPT_RUNNING;
+        ports[i].farm = farm;
+
+        if (open_port(&ports[i], config, script_path)) {
+            ports[i].result = SCRIPT_IO_ERROR;
+
+            /* a broken script is broken for every port */
+            if (!ports[i].script) {
+                for (int j = 0; j < ports_n; j++) {
+                    if (j <= i)
+                        close_port(&ports[j]);
+                    free(paths[j]);
+                }
+                free(ports);
+                free(paths);
+                return BATCH_EXIT_ERROR;
+            }
+        }
+    }
+    free(paths);
+
+    workers_n = worker_count(ports_n);
+    workers = calloc(workers_n, sizeof(batch_worker_t));
+    for (int i = 0; i < workers_n; i++) {
+        workers[i].ending = config->no_crlf ? "\n" : "\r\n";
+        workers[i].start = start;
+    }
+
+    /* dealt out in turn so each worker gets a similar share */
+    for (int i = 0; i < ports_n; i++) {
+        batch_worker_t *w = &workers[i % workers_n];
+
+        if (ports[i].result != SCRIPT_RUNNING)
+            continue;
+
+        w->ports = realloc(w->ports, sizeof(batch_port_t *) * (w->ports_n + 1));
+        w->ports[w->ports_n++] = &ports[i];
+    }
+
+    /* the calling thread takes the first share itself */
+    for (int i = 1; i < workers_n; i++) {
+        if (
+            workers[i].ports_n > 0 &&
+            pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i])
+        ) {
+            /* its ports are left running and show up as errors */
+            workers[i].ports_n = 0;
+        }
+    }
+    worker_thread(&workers[0]);
+    for (int i = 1; i < workers_n; i++) {
+        if (workers[i].ports_n > 0)
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    get_now(&now);
+    timer_sub(&now, &start);
+
+    if (farm) {
+        print_table(ports, ports_n, &now);
+    } else {
+        fprintf(
+            stderr, "bytenuts: %s %s after %ld.%03lds (%lluB in, %lluB out)\n",
+            script_path, result_str(ports[0].result),
+            (long)now.tv_sec, now.tv_nsec / 1000000,
+            (unsigned long long)ports[0].rx_bytes, (unsigned long long)ports[0].tx_bytes
+        );
+    }
+
+    /* the worst result is the one reported */
+    for (int i = 0; i < ports_n; i++) {
+        int port_code = result_code(ports[i].result);
+
+        if (port_code > code)
+            code = port_code;
+
+        close_port(&ports[i]);
+        free(ports[i].path);
+    }
+
+    for (int i = 0; i < workers_n; i++) {
+        free(workers[i].ports);
+    }
+    free(workers);
+    free(ports);
+
+    return code;
+}
+
+/* Expand glob patterns in the port list. *globbed is set if any pattern was
+ * used. */
+static char **
+expand_ports(char * const *ports, int ports_n, int *out_n, int *globbed)
+{
+    char **paths = NULL;
+    int n = 0;
+
+    *globbed = 0;
+
+    for (int i = 0; i < ports_n; i++) {
+#ifndef __MINGW32__
+        glob_t g;
+
+        if (strpbrk(ports[i], "*?[")) {
+            *globbed = 1;
+
+            if (glob(ports[i], 0, NULL, &g) == 0) {
+                paths = realloc(paths, sizeof(char *) * (n + g.gl_pathc));
+                for (size_t j = 0; j < g.gl_pathc; j++) {
+                    paths[n++] = strdup(g.gl_pathv[j]);
+                }
+            }
+            globfree(&g);
+            continue;
+        }
+#endif
+        paths = realloc(paths, sizeof(char *) * (n + 1));
+        paths[n++] = strdup(ports[i]);
+    }
+
+    *out_n = n;
+
+    return paths;
+}
+
+static int
+open_port(batch_port_t *port, bytenuts_config_t *config, const char *script_path)
+{
+    char *err;
+
+    port->script = script_load(script_path, &err);
+    if (!port->script) {
+        fprintf(stderr, "bytenuts: %s: %s\n", script_path, err);
+        free(err);
+        return -1;
+    }
+
+    port->ser_fd = serial_open(port->path, config->baud);
+    if (port->ser_fd == SERIAL_INVALID) {
+        fprintf(stderr, "bytenuts: failed to open serial port \"%s\"\n", port->path);
+        return -1;
+    }
+
+    if (!port->farm) {
+        port->log = stdout;
+        if (config->log_path)
+            port->log = fopen(config->log_path, "w");
+        if (!port->log) {
+            fprintf(stderr, "bytenuts: failed to open log \"%s\"\n", config->log_path);
+            return -1;
+        }
+    } else {
+        /* -l names the directory for the logs, <port name>.log each */
+        const char *name = strrchr(port->path, '/');
+        char *path;
+
+        name = name ? name + 1 : port->path;
+        path = bstr_print(
+            NULL, "%s%s%s.log", config->log_path ? config->log_path : "",
+            config->log_path ? "/" : "", name
+        );
+
+        port->log = fopen(path, "w");
+        if (!port->log) {
+            fprintf(stderr, "bytenuts: failed to open log \"%s\"\n", path);
+            free(path);
+            return -1;
+        }
+        free(path);
+    }
+
+    return 0;
+}
+
+static void
+close_port(batch_port_t *port)
+{
+    if (port->log == stdout)
+        fflush(stdout);
+    else if (port->log)
+        fclose(port->log);
+    if (port->ser_fd != SERIAL_INVALID)
+        serial_close(port->ser_fd);
+    script_destroy(port->script);
+    free(port->pending);
+}
+
+static int
+worker_count(int ports_n)
+{
+    long cpus;
+
+#ifdef __MINGW32__
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    cpus = info.dwNumberOfProcessors;
+#else
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    if (cpus < 1)
+        cpus = 1;
+
+    return ports_n < cpus ? ports_n : cpus;
+}
+
+/* Drive every script of the worker's ports until they are all done, sleeping
+ * until output arrives, a port can take more or a script's wait runs out */
+static void *
+worker_thread(void *arg)
+{
+    batch_worker_t *w = arg;
+    int active = w->ports_n;
+
+#ifndef __MINGW32__
+    int epfd = epoll_create1(0);
+
+    for (int i = 0; i < w->ports_n; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = w->ports[i] };
+
+        w->ports[i]->worker_fd = epfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, w->ports[i]->ser_fd, &ev);
+    }
+#endif
+
+    for (int i = 0; i < w->ports_n; i++) {
+        step_port(w, w->ports[i]);
+        if (w->ports[i]->result != SCRIPT_RUNNING)
+            active--;
+    }
+
+    while (active > 0) {
+        struct timespec now;
+        uint32_t wait_ms = BATCH_WAIT_MAX_MS;
+
+        get_now(&now);
+        for (int i = 0; i < w->ports_n; i++) {
+            batch_port_t *port = w->ports[i];
+            struct timespec left = port->due;
+
+            if (port->result != SCRIPT_RUNNING)
+                continue;
+
+            if (timer_cmp(&left, &now) <= 0) {
+                wait_ms = 0;
+                break;
+            }
+
+            timer_sub(&left, &now);
+            if (left.tv_sec * 1000 + (left.tv_nsec + 999999) / 1000000 < wait_ms)
+                wait_ms = left.tv_sec * 1000 + (left.tv_nsec + 999999) / 1000000;
+        }
+
+        wait_ports(w, wait_ms);
+
+        get_now(&now);
+        for (int i = 0; i < w->ports_n; i++) {
+            batch_port_t *port = w->ports[i];
+
+            if (port->result != SCRIPT_RUNNING)
+                continue;
+            if (!port->ready && timer_cmp(&port->due, &now) > 0)
+                continue;
+
+            port->ready = 0;
+            step_port(w, port);
+            if (port->result != SCRIPT_RUNNING)
+                active--;
+        }
+    }
+
+#ifndef __MINGW32__
+    close(epfd);
+#endif
+
+    return NULL;
+}
+
+static void
+step_port(batch_worker_t *w, batch_port_t *port)
+{
+    script_ops_t ops = {
+        .send = port_send,
+        .log = port_log,
+        .status = NULL,
+        .arg = port,
+    };
+    uint32_t wait_ms;
+    int ret;
+
+    ret = script_step(port->script, &ops, w->ending, &wait_ms);
+    if (ret == SCRIPT_RUNNING) {
+        get_now(&port->due);
+        timer_add_ms(&port->due, wait_ms);
+        return;
+    }
+
+    /* the port went away under the script */
+    if (ret == SCRIPT_CANCELLED && port->read_failed) {
+        port_log("failed to read from the port", port);
+        ret = SCRIPT_IO_ERROR;
+    }
+
+    port->result = ret;
+    get_now(&port->took);
+    timer_sub(&port->took, &w->start);
+
+    /* output after the end is of no interest */
+#ifndef __MINGW32__
+    epoll_ctl(port->worker_fd, EPOLL_CTL_DEL, port->ser_fd, NULL);
+#endif
+}
+
+#ifndef __MINGW32__
+static void
+wait_ports(batch_worker_t *w, uint32_t wait_ms)
+{
+    struct epoll_event evs[64];
+    int n;
+
+    if (w->ports_n == 0)
+        return;
+
+    n = epoll_wait(w->ports[0]->worker_fd, evs, 64, wait_ms);
+
+    for (int i = 0; i < n; i++) {
+        batch_port_t *port = evs[i].data.ptr;
+
+        if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            read_port(port, 1);
+        /* hung up or unplugged, what it still had has been read */
+        if ((evs[i].events & (EPOLLHUP | EPOLLERR)) && !port->read_failed)
+            fail_port(port);
+        if ((evs[i].events & EPOLLOUT) && !port->read_failed && flush_port(port))
+            script_cancel(port->script);
+    }
+}
+#else
+static void
+wait_ports(batch_worker_t *w, uint32_t wait_ms)
+{
+    /* no epoll, every port is checked in turn and the worker naps when none
+     * had anything */
+    int any = 0;
+
+    for (int i = 0; i < w->ports_n; i++) {
+        batch_port_t *port = w->ports[i];
+
+        if (port->result != SCRIPT_RUNNING)
+            continue;
+
+        read_port(port, 0);
+        any |= port->ready;
+        if (port->pending_len > 0 && flush_port(port))
+            script_cancel(port->script);
+    }
+
+    if (!any && wait_ms > 0)
+        Sleep(wait_ms < 10 ? wait_ms : 10);
+}
+#endif
+
+/* Read what the port has. woken is set when epoll said it was readable, then
+ * nothing at all to read means the port has gone away rather than that it is
+ * quiet, as VMIN=0 reads return 0 either way. */
+static void
+read_port(batch_port_t *port, int woken)
+{
+    char buf[4096];
+    size_t total = 0;
+
+    while (total < BATCH_READ_MAX) {
+        ssize_t n = serial_read(port->ser_fd, buf, sizeof(buf));
+
+        if (n > 0) {
+            fwrite(buf, 1, n, port->log);
+            script_feed(port->script, buf, n);
+            port->rx_bytes += n;
+            port->ready = 1;
+            total += n;
+            continue;
+        }
+
+        if (
+            (n < 0 && errno != EAGAIN && errno != EINTR) ||
+            (n == 0 && woken && total == 0)
+        ) {
+            fail_port(port);
+        }
+        break;
+    }
+}
+
+/* End the port's script as an I/O error and stop watching it */
+static void
+fail_port(batch_port_t *port)
+{
+    port->read_failed = 1;
+    port->ready = 1;
+    script_cancel(port->script);
+#ifndef __MINGW32__
+    epoll_ctl(port->worker_fd, EPOLL_CTL_DEL, port->ser_fd, NULL);
+#endif
+}
+
+/* Write as much of the pending data as the port takes. Returns -1 if the port
+ * fails. */
+static int
+flush_port(batch_port_t *port)
+{
+    size_t p = 0;
+
+    while (p < port->pending_len) {
+        ssize_t n = serial_write(port->ser_fd, &port->pending[p], port->pending_len - p);
+
+        if (n > 0) {
+            p += n;
+            continue;
+        }
+
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+        break;
+    }
+
+    port->tx_bytes += p;
+    port->pending_len -= p;
+    memmove(port->pending, &port->pending[p], port->pending_len);
+
+    watch_write(port, port->pending_len > 0);
+
+    return 0;
+}
+
+static void
+watch_write(batch_port_t *port, int on)
+{
+#ifndef __MINGW32__
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = port };
+
+    if (port->want_write == on)
+        return;
+
+    if (on)
+        ev.events |= EPOLLOUT;
+    epoll_ctl(port->worker_fd, EPOLL_CTL_MOD, port->ser_fd, &ev);
+#endif
+    port->want_write = on;
+}
+
+static int
+port_send(const char *buf, size_t len, void *arg)
+{
+    batch_port_t *port = arg;
+
+    port->pending = realloc(port->pending, port->pending_len + len);
+    memcpy(&port->pending[port->pending_len], buf, len);
+    port->pending_len += len;
+
+    return flush_port(port);
+}
+
+static void
+port_log(const char *msg, void *arg)
+{
+    batch_port_t *port = arg;
+
+    if (port->farm)
+        fprintf(stderr, "bytenuts: %s: %s\n", port->path, msg);
+    else
+        fprintf(stderr, "bytenuts: %s\n", msg);
+}
+
+static void
+get_now(struct timespec *ts)
+{
+#ifdef __MINGW32__
+    clock_gettime(CLOCK_REALTIME, ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#endif
+}
+
+static const char *
+result_str(int result)
+{
+    switch (result) {
+    case SCRIPT_OK:
+        return "passed";
+    case SCRIPT_TIMEOUT:
+        return "timed out";
+    case SCRIPT_FAILED:
+        return "failed";
+    default:
+        return "error";
+    }
+}
+
+static int
+result_code(int result)
+{
+    switch (result) {
+    case SCRIPT_OK:
+        return BATCH_EXIT_OK;
+    case SCRIPT_TIMEOUT:
+        return BATCH_EXIT_TIMEOUT;
+    case SCRIPT_FAILED:
+        return BATCH_EXIT_FAILED;
+    default:
+        return BATCH_EXIT_ERROR;
+    }
+}
+
+static void
+print_table(batch_port_t *ports, int ports_n, const struct timespec *took)
+{
+    int counts[4] = { 0 };
+    int width = 4;
+
+    for (int i = 0; i < ports_n; i++) {
+        int len = strlen(ports[i].path);
+
+        if (len > width)
+            width = len;
+    }
+
+    printf("%-*s  %-9s  %11s  %12s  %10s\n", width, "PORT", "RESULT", "TIME", "IN", "OUT");
+    for (int i = 0; i < ports_n; i++) {
+        batch_port_t *port = &ports[i];
+
+        counts[result_code(port->result)]++;
+        printf(
+            "%-*s  %-9s  %6ld.%03lds  %11lluB  %9lluB\n",
+            width, port->path, result_str(port->result),
+            (long)port->took.tv_sec, port->took.tv_nsec / 1000000,
+            (unsigned long long)port->rx_bytes, (unsigned long long)port->tx_bytes
+        );
+    }
+
+    printf(
+        "%d ports in %ld.%03lds: %d passed, %d timed out, %d failed, %d errors\n",
+        ports_n, (long)took->tv_sec, took->tv_nsec / 1000000,
+        counts[BATCH_EXIT_OK], counts[BATCH_EXIT_TIMEOUT],
+        counts[BATCH_EXIT_FAILED], counts[BATCH_EXIT_ERROR]
+    );
+}
@@ -0,0 +1,21 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include "bytenuts.h"
+
+/* Exit codes of a batch run */
+#define BATCH_EXIT_OK      (0) /* the script ran to the end */
+#define BATCH_EXIT_ERROR   (1) /* the port or script could not be used */
+#define BATCH_EXIT_TIMEOUT (2) /* an expect timed out */
+#define BATCH_EXIT_FAILED  (3) /* a fail pattern was seen */
+
+/* Run the script at script_path against every port in ports, which may hold
+ * glob patterns, without the UI. The ports are shared out over a worker
+ * thread per CPU, each waiting on its ports with epoll. With one port the
+ * output goes to the -l log, or stdout if there is none. With more, each port
+ * logs to <port name>.log in the -l directory and a table of results is
+ * printed at the end. Messages go to stderr. Returns the worst of the
+ * BATCH_EXIT_ codes of the ports. */
+int batch_run(bytenuts_config_t *config, const char *script_path, char * const *ports, int ports_n);
+
+#endif /* _BATCH_H_ */
@@ -0,0 +1,161 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bhash.h"
+
+typedef struct bhash_entry_struct {
+    const char *key; /* NULL if empty */
+    long val;
+    uint32_t hash;
+    int dead; /* tombstone left by bhash_del */
+} bhash_entry_t;
+
+typedef struct bhash_struct {
+    bhash_entry_t *ents;
+    size_t cap; /* always a power of 2 */
+    size_t len;
+    size_t used; /* live entries plus tombstones */
+} bhash_t;
+
+static uint32_t hash_str(const char *str);
+static bhash_entry_t *find(bhash_t *hash, const char *key, uint32_t h);
+static void grow(bhash_t *hash);
+
+bhash_handle
+bhash_create(size_t size_hint)
+{
+    bhash_t *ret = calloc(1, sizeof(bhash_t));
+
+    ret->cap = 16;
+    while (ret->cap < size_hint * 2)
+        ret->cap *= 2;
+    ret->ents = calloc(ret->cap, sizeof(bhash_entry_t));
+
+    return ret;
+}
+
+int
+bhash_get(bhash_handle hash, const char *key, long *val)
+{
+    bhash_entry_t *ent = find(hash, key, hash_str(key));
+
+    if (!ent->key)
+        return 0;
+
+    if (val)
+        *val = ent->val;
+    return 1;
+}
+
+void
+bhash_put(bhash_handle hash, const char *key, long val)
+{
+    uint32_t h = hash_str(key);
+    bhash_entry_t *ent;
+
+    /* keep the load factor under 1/2 */
+    if ((hash->used + 1) * 2 > hash->cap)
+        grow(hash);
+
+    ent = find(hash, key, h);
+    if (!ent->key) {
+        if (!ent->dead)
+            hash->used++;
+        hash->len++;
+    }
+
+    ent->key = key;
+    ent->val = val;
+    ent->hash = h;
+    ent->dead = 0;
+}
+
+void
+bhash_del(bhash_handle hash, const char *key)
+{
+    bhash_entry_t *ent = find(hash, key, hash_str(key));
+
+    if (!ent->key)
+        return;
+
+    ent->key = NULL;
+    ent->dead = 1;
+    hash->len--;
+}
+
+size_t
+bhash_len(bhash_handle hash)
+{
+    return hash->len;
+}
+
+void
+bhash_destroy(bhash_handle hash)
+{
+    if (!hash)
+        return;
+
+    free(hash->ents);
+    free(hash);
+}
+
+/* FNV-1a */
+static uint32_t
+hash_str(const char *str)
+{
+    uint32_t h = 2166136261u;
+
+    while (*str) {
+        h ^= (uint8_t)*str++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/* Find the entry holding key, or the slot it should be inserted into */
+static bhash_entry_t *
+find(bhash_t *hash, const char *key, uint32_t h)
+{
+    size_t mask = hash->cap - 1;
+    bhash_entry_t *tomb = NULL;
+
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        bhash_entry_t *ent = &hash->ents[i];
+
+        if (ent->key) {
+            if (ent->hash == h && !strcmp(ent->key, key))
+                return ent;
+        } else if (ent->dead) {
+            if (!tomb)
+                tomb = ent;
+        } else {
+            return tomb ? tomb : ent;
+        }
+    }
+}
+
+static void
+grow(bhash_t *hash)
+{
+    bhash_entry_t *old = hash->ents;
+    size_t old_cap = hash->cap;
+
+    /* only grow if the table is full of live entries, otherwise rehashing
+     * just clears out the tombstones */
+    if (hash->len * 4 >= hash->cap)
+        hash->cap *= 2;
+
+    hash->ents = calloc(hash->cap, sizeof(bhash_entry_t));
+    hash->used = hash->len;
+
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key) {
+            bhash_entry_t *ent = find(hash, old[i].key, old[i].hash);
+            *ent = old[i];
+        }
+    }
+
+    free(old);
+}
@@ -0,0 +1,29 @@
+#ifndef _BHASH_H_
+#define _BHASH_H_
+
+#include <stdio.h>
+
+/* String keyed hash table. Keys are not copied, they must stay valid for as
+ * long as they are in the table. */
+typedef struct bhash_struct * bhash_handle;
+
+/* Create a table, size_hint is the expected number of entries */
+bhash_handle bhash_create(size_t size_hint);
+
+/* Look up key, returning 1 and setting *val if it is in the table */
+int bhash_get(bhash_handle hash, const char *key, long *val);
+
+/* Insert key or, if an equal key is already present, replace its key pointer
+ * and value */
+void bhash_put(bhash_handle hash, const char *key, long val);
+
+/* Remove key from the table if present */
+void bhash_del(bhash_handle hash, const char *key);
+
+/* Number of entries in the table */
+size_t bhash_len(bhash_handle hash);
+
+/* Free the table (not the keys) */
+void bhash_destroy(bhash_handle hash);
+
+#endif /* _BHASH_H_ */
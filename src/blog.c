@@ -0,0 +1,217 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blog.h"
+#include "files.h"
+#include "timer_math.h"
+
+typedef struct blog_struct {
+    int fd;
+    pthread_t thr;
+    pthread_mutex_t lock;
+    pthread_mutex_t io_lock; /* held while writing to fd, keeps writes ordered */
+    pthread_cond_t cond;
+    int running;
+    /* appends go to the active buffer, the flusher swaps it out and writes it
+     * without holding the lock */
+    char *active;
+    size_t active_len;
+    size_t active_cap;
+    char *spare;
+    size_t spare_cap;
+    uint32_t flush_ms;
+    size_t flush_sz;
+    int sync;
+} blog_t;
+
+static void *blog_thread(void *arg);
+static void write_all(int fd, const char *buf, size_t len);
+
+blog_handle
+blog_open(const char *path, uint32_t flush_ms, uint32_t flush_kb, int sync)
+{
+    blog_t *log;
+    pthread_condattr_t attr;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+
+    log = calloc(1, sizeof(blog_t));
+    log->fd = fd;
+    log->flush_ms = flush_ms;
+    log->flush_sz = (size_t)flush_kb * 1024;
+    log->sync = sync;
+
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_mutex_init(&log->io_lock, NULL);
+    pthread_condattr_init(&attr);
+#ifndef __MINGW32__
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&log->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    log->running = 1;
+    if (pthread_create(&log->thr, NULL, blog_thread, log)) {
+        close(fd);
+        free(log);
+        return NULL;
+    }
+
+    return log;
+}
+
+void
+blog_write(blog_handle log, const void *buf, size_t len)
+{
+    if (len == 0)
+        return;
+
+    pthread_mutex_lock(&log->lock);
+
+    if (log->active_len + len > log->active_cap) {
+        size_t cap = log->active_cap ? log->active_cap : 4096;
+
+        while (cap < log->active_len + len)
+            cap *= 2;
+
+        log->active = realloc(log->active, cap);
+        log->active_cap = cap;
+    }
+
+    memcpy(&log->active[log->active_len], buf, len);
+    log->active_len += len;
+
+    if (log->flush_sz && log->active_len >= log->flush_sz)
+        pthread_cond_signal(&log->cond);
+
+    pthread_mutex_unlock(&log->lock);
+}
+
+void
+blog_append_file(blog_handle log, int src_fd, size_t len)
+{
+    pthread_mutex_lock(&log->io_lock);
+    pthread_mutex_lock(&log->lock);
+
+    /* keep what was already appended in order */
+    write_all(log->fd, log->active, log->active_len);
+    log->active_len = 0;
+
+    files_copy(log->fd, src_fd, len);
+
+    pthread_mutex_unlock(&log->lock);
+    pthread_mutex_unlock(&log->io_lock);
+}
+
+void
+blog_close(blog_handle log)
+{
+    if (!log)
+        return;
+
+    pthread_mutex_lock(&log->lock);
+    log->running = 0;
+    pthread_cond_signal(&log->cond);
+    pthread_mutex_unlock(&log->lock);
+
+    pthread_join(log->thr, NULL);
+
+    close(log->fd);
+    pthread_cond_destroy(&log->cond);
+    pthread_mutex_destroy(&log->lock);
+    pthread_mutex_destroy(&log->io_lock);
+    free(log->active);
+    free(log->spare);
+    free(log);
+}
+
+static void *
+blog_thread(void *arg)
+{
+    blog_t *log = arg;
+    int running = 1;
+
+    while (running) {
+        char *buf;
+        size_t len;
+        size_t cap;
+
+        pthread_mutex_lock(&log->lock);
+
+        if (
+            log->running &&
+            (!log->flush_sz || log->active_len < log->flush_sz)
+        ) {
+            if (log->flush_ms) {
+                struct timespec deadline;
+
+#ifdef __MINGW32__
+                clock_gettime(CLOCK_REALTIME, &deadline);
+#else
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+#endif
+                timer_add_ms(&deadline, log->flush_ms);
+                pthread_cond_timedwait(&log->cond, &log->lock, &deadline);
+            } else {
+                pthread_cond_wait(&log->cond, &log->lock);
+            }
+        }
+
+        pthread_mutex_unlock(&log->lock);
+
+        pthread_mutex_lock(&log->io_lock);
+        pthread_mutex_lock(&log->lock);
+
+        running = log->running;
+
+        /* swap buffers so appends can continue while we write */
+        buf = log->active;
+        len = log->active_len;
+        cap = log->active_cap;
+        log->active = log->spare;
+        log->active_cap = log->spare_cap;
+        log->active_len = 0;
+        log->spare = buf;
+        log->spare_cap = cap;
+
+        pthread_mutex_unlock(&log->lock);
+
+        if (len > 0) {
+            write_all(log->fd, buf, len);
+#ifndef __MINGW32__
+            if (log->sync)
+                fdatasync(log->fd);
+#endif
+        }
+
+        pthread_mutex_unlock(&log->io_lock);
+    }
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+static void
+write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(fd, buf, len);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        buf += ret;
+        len -= ret;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef _BLOG_H_
+#define _BLOG_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Backup log: appends are only copied into memory, a background flusher writes
+ * them out at least every flush_ms milliseconds or once flush_kb kilobytes are
+ * pending, optionally followed by an fdatasync */
+typedef struct blog_struct * blog_handle;
+
+/* Open (truncating) the log at path and start its flusher thread. Returns NULL
+ * if the file cannot be opened. */
+blog_handle blog_open(const char *path, uint32_t flush_ms, uint32_t flush_kb, int sync);
+
+/* Append a buffer to the log, never blocks on I/O */
+void blog_write(blog_handle log, const void *buf, size_t len);
+
+/* Append the first len bytes of the file src_fd onto the log without passing
+ * them through memory */
+void blog_append_file(blog_handle log, int src_fd, size_t len);
+
+/* Flush everything pending, stop the flusher and close the file */
+void blog_close(blog_handle log);
+
+#endif /* _BLOG_H_ */
@@ -11,6 +11,8 @@ typedef struct bstr_history_struct {
     int pos; /* current position index in the history */
 } bstr_history_t;
 
+static int hex_val(char ch);
+
 char *
 bstr_print(char *base, const char *fmt, ...)
 {
@@ -42,6 +44,43 @@ bstr_print(char *base, const char *fmt, ...)
     }
 }
 
+char *
+bstr_unescape(const char *str, size_t len, size_t *out_len)
+{
+    char *out = malloc(len + 1);
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] != '\\' || i + 1 == len) {
+            out[n++] = str[i];
+            continue;
+        }
+
+        i++;
+        switch (str[i]) {
+        case 'r': out[n++] = '\r'; break;
+        case 'n': out[n++] = '\n'; break;
+        case 't': out[n++] = '\t'; break;
+        case 'e': out[n++] = '\033'; break;
+        case 'x':
+            if (i + 2 < len && hex_val(str[i + 1]) >= 0 && hex_val(str[i + 2]) >= 0) {
+                out[n++] = hex_val(str[i + 1]) << 4 | hex_val(str[i + 2]);
+                i += 2;
+                break;
+            }
+            /* fall through */
+        default:
+            out[n++] = str[i];
+            break;
+        }
+    }
+
+    out[n] = '\0';
+    *out_len = n;
+
+    return out;
+}
+
 bstr_history_handle
 bstr_history_create(void)
 {
@@ -115,3 +154,15 @@ bstr_history_destroy(bstr_history_handle hist)
         free(hist->strs);
     }
 }
+
+static int
+hex_val(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
@@ -12,6 +12,10 @@ typedef struct bstr_history_struct * bstr_history_handle;
 __attribute__((format(printf, 2, 3)))
 char *bstr_print(char *base, const char *fmt, ...);
 
+/* Copy len bytes of str, expanding the escapes \r, \n, \t, \e, \\ and \xHH.
+ * Returns a malloc'd, NUL terminated string and its length in *out_len. */
+char *bstr_unescape(const char *str, size_t len, size_t *out_len);
+
 /* Create a new bstr_history struct. The position of the history will start as
  * unset. */
 bstr_history_handle bstr_history_create(void);
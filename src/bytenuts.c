@@ -3,6 +3,7 @@
 #else
 #  include <ncurses.h>
 #endif
+#include <fcntl.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdio.h>
@@ -11,31 +12,83 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "batch.h"
+#include "bhash.h"
+#include "bstr.h"
 #include "bytenuts.h"
 #include "cheerios.h"
+#include "ctl.h"
+#include "files.h"
 #include "ingest.h"
+#include "latency.h"
+#include "paths.h"
+#include "periodic.h"
+#include "prbs.h"
+#include "probe.h"
+#include "runner.h"
+#include "session.h"
+#include "textsend.h"
+#include "txq.h"
+#include "ui.h"
 
 #define USAGE ( \
 "USAGE\n\n" \
 "bytenuts [OPTIONS] <serial path>\n" \
+"bytenuts --sessions\n" \
+"bytenuts [OPTIONS] --batch <script> <serial path>...\n" \
+"bytenuts [OPTIONS] --prbs=<7|15|31> <serial path>\n" \
 "\nConfigs get loaded from ${HOME}/.bytenuts/config (if file exists)\n" \
 "\n OPTIONS\n=========\n\n" \
 "-h\n    Show this help.\n\n" \
 "-b <baud>\n    Set a baud rate (default 115200).\n\n" \
 "-l <path>\n   Log all output to the given file.\n\n" \
 "-c <path>\n   Load a config from the given path rather than the default.\n\n" \
-"-r|--resume\n    Resume the previous instance of bytenuts.\n\n" \
+"-r|--resume\n    Resume the previous instance of bytenuts on this session.\n\n" \
+"--session=<name>\n    Name the session used for resuming (default is based on the serial path).\n\n" \
+"--sessions\n    List the stored sessions.\n\n" \
+"--attach\n    Share the port with the bytenuts that has it open, through its control socket.\n\n" \
+"--script=<path>\n    Run a send/expect script once connected.\n\n" \
+"--batch <path>\n    Run a send/expect script without the UI and exit with its result: 0 if it\n    finished, 1 on errors, 2 if an expect timed out, 3 if a fail pattern was seen.\n    Given several serial paths or a quoted glob, runs on all of them at once with\n    a log per port in the -l directory.\n\n" \
+"--prbs=<7|15|31>\n    Send a PRBS out of the port and check it comes back, through a loopback plug or\n    the --prbs_rx port, reporting throughput and bit errors. Exits like --batch.\n\n" \
+"--prbs_rx=<path>\n    Port the PRBS comes back on when it is not the one it goes out of.\n\n" \
+"--prbs_time=<s>\n    Seconds to run the PRBS test for (default 0, until ctrl+c).\n\n" \
 "--colors=<0|1>\n    Turn 8-bit ANSI colors off/on.\n\n" \
 "--echo=<0|1>\n    Turn input echoing off/on.\n\n" \
 "--no_crlf=<0|1>\n    Choose to send LF and not CRLF on input.\n\n" \
 "--escape=<char>\n    Change the default ctrl+b escape character.\n\n" \
-"--inter_cmd_to=<ms>\n    Set the intercommand timeout in milliseconds (default is 10ms).\n\n" \
-"--time_fmt=<fmt>\n    Time format as used by strftime to prepend to every log line.\n" \
+"--inter_cmd_to=<ms>\n    Set the minimum gap between sent commands in milliseconds (default is 10ms).\n\n" \
+"--inter_char_us=<us>\n    Set the minimum gap between sent characters in microseconds (default 0, disabled).\n\n" \
+"--inter_line_ms=<ms>\n    Set the minimum gap after each sent newline in milliseconds (default 0, disabled).\n\n" \
+"--time_fmt=<fmt>\n    Time format as used by strftime to prepend to every log line.\n\n" \
+"--capture=<pattern>\n    Dump output around this pattern to a capture file (may be repeated).\n\n" \
+"--capture_pre=<MB>\n    Output kept in memory before a capture trigger (default 0, disabled).\n\n" \
+"--capture_post=<MB>\n    Output written to the capture file after a trigger (default 1).\n\n" \
+"--capture_dir=<path>\n    Directory capture files are written to (default is the working directory).\n\n" \
+"--trigger=<action> <pattern>\n    Act on a pattern in the output, the action is highlight, beep, log, capture or\n    send=<response> (may be repeated).\n\n" \
+"--backup_flush_ms=<ms>\n    Flush the backup log at least this often (default 1000ms, 0 to disable).\n\n" \
+"--backup_flush_kb=<KB>\n    Flush the backup log once this much output is pending (default 64KB, 0 to disable).\n\n" \
+"--backup_sync=<0|1>\n    fdatasync the backup log after every flush.\n\n" \
+"--history_max=<n>\n    Keep at most this many commands when resuming (default 0, unlimited).\n\n" \
+"--tx_queue_kb=<KB>\n    Size of the queue for data waiting to be sent (default 64KB).\n\n" \
+"--send_prompt=<regex>\n    When sending a text file, wait for this in the output before each next line.\n\n" \
+"--send_prompt_to=<ms>\n    How long to wait for the send prompt before giving up (default 5000ms).\n\n" \
+"--control=<0|1>\n    Serve the control socket ~/.config/bytenuts/<session>.sock (default 1).\n\n" \
+"--periodic=<ms> <command>\n    Send a command every ms milliseconds, toggled with ctrl+b t (may be repeated).\n\n" \
+"--latency_prompt=<regex>\n    Time typed commands until this shows up in the output, see ctrl+b i.\n\n" \
+"--probe_count=<n>\n    Frames sent by the ctrl+b e round trip latency probe (default 100).\n\n" \
+"--probe_to=<ms>\n    How long to wait for each probe frame to come back (default 1000ms).\n" \
 )
 
 static int parse_args(int argc, char **argv);
 static int load_configs();
+static char *config_strdup(const char *val);
+static void add_capture_pattern(const char *pattern);
+static void add_trigger(const char *spec);
+static void add_periodic(const char *spec);
+static void add_batch_port(const char *path);
 static int read_state();
+static void read_history(FILE *fd);
+static void history_push(bhash_handle seen, char *line, int *cap);
 static int load_state();
 
 static bytenuts_t bytenuts;
@@ -45,6 +98,10 @@ bytenuts_run(int argc, char **argv)
 {
     memset(&bytenuts, 0, sizeof(bytenuts_t));
 
+    if (argc == 2 && !strcmp(argv[1], "--sessions")) {
+        return session_list(stdout);
+    }
+
     if (parse_args(argc, argv)) {
         printf(USAGE);
         return -1;
@@ -54,24 +111,64 @@ bytenuts_run(int argc, char **argv)
         return -1;
     }
 
-    if (bytenuts.resume) {
-        read_state();
+    if (bytenuts.prbs) {
+        return prbs_run(
+            &bytenuts.config, bytenuts.prbs, bytenuts.config.serial_path,
+            bytenuts.prbs_rx, bytenuts.prbs_time
+        );
     }
 
-    bytenuts.serial_fd = serial_open(bytenuts.config.serial_path, bytenuts.config.baud);
-    if (bytenuts.serial_fd == SERIAL_INVALID) {
-        printf(
-            "Failed to open serial port \"%s\"\r\n",
-            bytenuts.config.serial_path
+    /* no session, terminal or threads, just the script and the port */
+    if (bytenuts.batch) {
+        return batch_run(
+            &bytenuts.config, bytenuts.batch,
+            bytenuts.batch_ports, bytenuts.batch_ports_n
         );
-        return -1;
     }
 
-    printf("Opened \"%s\"\r\n", bytenuts.config.serial_path);
+    {
+        char *key = session_key(bytenuts.config.session, bytenuts.config.serial_path);
+
+        if (!key)
+            return -1;
+        free(bytenuts.config.session);
+        bytenuts.config.session = key;
+    }
+
+    if (bytenuts.attach) {
+        /* the owner's socket stands in for the port */
+        bytenuts.serial_fd = ctl_attach(bytenuts.config.session);
+        if (bytenuts.serial_fd == SERIAL_INVALID)
+            return -1;
+
+        /* the owner keeps the session's logs, a viewer has its own. No key
+         * has a '.', so this is never another session's. */
+        bytenuts.config.session = bstr_print(bytenuts.config.session, ".attached");
+        bytenuts.config.control = 0;
+    }
+
+    if (bytenuts.resume) {
+        read_state();
+    }
+
+    if (bytenuts.attach) {
+        printf("Attached to \"%s\"\r\n", bytenuts.config.serial_path);
+    } else {
+        bytenuts.serial_fd = serial_open(bytenuts.config.serial_path, bytenuts.config.baud);
+        if (bytenuts.serial_fd == SERIAL_INVALID) {
+            printf(
+                "Failed to open serial port \"%s\"\r\n",
+                bytenuts.config.serial_path
+            );
+            return -1;
+        }
+
+        printf("Opened \"%s\"\r\n", bytenuts.config.serial_path);
+    }
 
 #ifndef __MINGW32__
     /* use pseudo-terminals for testing purposes */
-    if (!strcmp(bytenuts.config.serial_path, "/dev/ptmx")) {
+    if (!bytenuts.attach && !strcmp(bytenuts.config.serial_path, "/dev/ptmx")) {
         grantpt(bytenuts.serial_fd);
         unlockpt(bytenuts.serial_fd);
     }
@@ -94,32 +191,35 @@ bytenuts_run(int argc, char **argv)
     wrefresh(bytenuts.out_win);
     bytenuts.in_win = newwin(1, COLS, LINES - 1, 0);
     keypad(bytenuts.in_win, TRUE);
-    wtimeout(bytenuts.in_win, 1);
+    /* the UI thread polls stdin itself and only reads once a key is ready */
+    nodelay(bytenuts.in_win, TRUE);
     wmove(bytenuts.in_win, 0, 0);
     wrefresh(bytenuts.in_win);
 
     bytenuts.ingest_status = strdup("");
     bytenuts.cheerios_status = strdup("");
-    bytenuts_set_status(STATUS_BYTENUTS, "%s", bytenuts.config.serial_path);
+    bytenuts_set_status(
+        STATUS_BYTENUTS, "%s%s", bytenuts.config.serial_path,
+        bytenuts.attach ? " (attached)" : ""
+    );
 
     // Initialize in and out threads
     if (pthread_mutex_init(&bytenuts.lock, NULL)) {
         return -1;
     }
 
-    if (pthread_mutex_init(&bytenuts.term_lock, NULL)) {
-        return -1;
-    }
-
     if (pthread_cond_init(&bytenuts.stop_cond, NULL)) {
         return -1;
     }
 
     cheerios_start(&bytenuts);
+    txq_start(&bytenuts);
     ingest_start(&bytenuts);
+    /* ncurses belongs to the UI thread from here on */
+    ui_start(&bytenuts);
 
 #ifndef __MINGW32__
-    if (!strcmp(bytenuts.config.serial_path, "/dev/ptmx")) {
+    if (!bytenuts.attach && !strcmp(bytenuts.config.serial_path, "/dev/ptmx")) {
         char info[128];
         snprintf(info, sizeof(info), "Opened PTY port %s", ptsname(bytenuts.serial_fd));
         cheerios_info(info);
@@ -137,6 +237,16 @@ bytenuts_run(int argc, char **argv)
         );
     }
 
+    ctl_start(&bytenuts);
+    periodic_start(&bytenuts);
+    if (latency_start(&bytenuts)) {
+        cheerios_info("The latency prompt is not a valid regex, not timing commands");
+    }
+
+    if (bytenuts.script) {
+        runner_start(&bytenuts.config, bytenuts.script);
+    }
+
     pthread_mutex_lock(&bytenuts.lock);
     pthread_cond_wait(&bytenuts.stop_cond, &bytenuts.lock);
     pthread_mutex_unlock(&bytenuts.lock);
@@ -158,8 +268,22 @@ bytenuts_stop()
 void
 bytenuts_kill()
 {
+    /* batch and PRBS runs never started the UI */
+    if (bytenuts.batch || bytenuts.prbs)
+        return;
+
+    ctl_stop();
     ingest_stop();
+    textsend_stop();
+    probe_stop();
+    runner_stop();
+    periodic_stop();
+    latency_stop();
+    txq_stop();
     cheerios_stop();
+    ui_stop();
+
+    session_touch(bytenuts.config.session, bytenuts.config.serial_path);
 
     delwin(bytenuts.status_win);
     delwin(bytenuts.in_win);
@@ -190,10 +314,48 @@ bytenuts_print_stats()
     cheerios_insert(st_line, strlen(st_line));
     sprintf(st_line, "serial_path: %s\r\n", bytenuts.config.serial_path);
     cheerios_insert(st_line, strlen(st_line));
+    cheerios_print("session: %s\r\n", bytenuts.config.session);
     sprintf(st_line, "inter_cmd_to: %d\r\n", bytenuts.config.inter_cmd_to);
     cheerios_insert(st_line, strlen(st_line));
+    sprintf(st_line, "inter_char_us: %u\r\n", bytenuts.config.inter_char_us);
+    cheerios_insert(st_line, strlen(st_line));
+    sprintf(st_line, "inter_line_ms: %u\r\n", bytenuts.config.inter_line_ms);
+    cheerios_insert(st_line, strlen(st_line));
     sprintf(st_line, "time_fmt: %s\r\n", bytenuts.config.time_fmt);
     cheerios_insert(st_line, strlen(st_line));
+    sprintf(st_line, "capture_pre: %uMB\r\n", bytenuts.config.capture_pre);
+    cheerios_insert(st_line, strlen(st_line));
+    sprintf(st_line, "capture_post: %uMB\r\n", bytenuts.config.capture_post);
+    cheerios_insert(st_line, strlen(st_line));
+    for (int i = 0; i < bytenuts.config.capture_patterns_n; i++) {
+        cheerios_print("capture: %s\r\n", bytenuts.config.capture_patterns[i]);
+    }
+    for (int i = 0; i < bytenuts.config.triggers_n; i++) {
+        cheerios_print("trigger: %s\r\n", bytenuts.config.triggers[i]);
+    }
+    for (int i = 0; i < bytenuts.config.periodic_n; i++) {
+        cheerios_print("periodic: %s\r\n", bytenuts.config.periodic[i]);
+    }
+    sprintf(st_line, "backup_flush_ms: %u\r\n", bytenuts.config.backup_flush_ms);
+    cheerios_insert(st_line, strlen(st_line));
+    sprintf(st_line, "backup_flush_kb: %u\r\n", bytenuts.config.backup_flush_kb);
+    cheerios_insert(st_line, strlen(st_line));
+    sprintf(st_line, "backup_sync: %s\r\n", bytenuts.config.backup_sync ? "enabled" : "disabled");
+    cheerios_insert(st_line, strlen(st_line));
+    sprintf(st_line, "history_max: %u\r\n", bytenuts.config.history_max);
+    cheerios_insert(st_line, strlen(st_line));
+    sprintf(st_line, "tx_queue_kb: %u\r\n", bytenuts.config.tx_queue_kb);
+    cheerios_insert(st_line, strlen(st_line));
+    cheerios_print("send_prompt: %s\r\n", bytenuts.config.send_prompt);
+    sprintf(st_line, "send_prompt_to: %u\r\n", bytenuts.config.send_prompt_to);
+    cheerios_insert(st_line, strlen(st_line));
+    sprintf(st_line, "control: %s\r\n", bytenuts.config.control ? "enabled" : "disabled");
+    cheerios_insert(st_line, strlen(st_line));
+    cheerios_print("latency_prompt: %s\r\n", bytenuts.config.latency_prompt);
+    sprintf(st_line, "probe_count: %u\r\n", bytenuts.config.probe_count);
+    cheerios_insert(st_line, strlen(st_line));
+    sprintf(st_line, "probe_to: %u\r\n", bytenuts.config.probe_to);
+    cheerios_insert(st_line, strlen(st_line));
 
     return 0;
 }
@@ -201,7 +363,6 @@ bytenuts_print_stats()
 int
 bytenuts_set_status(int user, const char *fmt, ...)
 {
-    int cx, cy;
     char *new_status;
     int len;
     va_list ap;
@@ -237,6 +398,16 @@ bytenuts_set_status(int user, const char *fmt, ...)
             free(bytenuts.cmdpg_status);
         bytenuts.cmdpg_status = new_status;
         break;
+    case STATUS_TX:
+        if (bytenuts.tx_status)
+            free(bytenuts.tx_status);
+        bytenuts.tx_status = new_status;
+        break;
+    case STATUS_JOB:
+        if (bytenuts.job_status)
+            free(bytenuts.job_status);
+        bytenuts.job_status = new_status;
+        break;
     default:
         free(new_status);
         pthread_mutex_unlock(&bytenuts.lock);
@@ -244,59 +415,48 @@ bytenuts_set_status(int user, const char *fmt, ...)
     }
     pthread_mutex_unlock(&bytenuts.lock);
 
-    pthread_mutex_lock(&bytenuts.term_lock);
+    ui_post(UI_EV_STATUS);
 
-    getyx(bytenuts.in_win, cy, cx);
-    curs_set(0);
-    wmove(bytenuts.status_win, 0, 0);
+    return 0;
+}
 
+void
+bytenuts_draw_status()
+{
     int width = getmaxx(bytenuts.status_win);
+
+    pthread_mutex_lock(&bytenuts.lock);
+
+    wmove(bytenuts.status_win, 0, 0);
     for (int i = 0; i < width - 1; i++) {
         waddch(bytenuts.status_win, '-');
     }
     waddch(bytenuts.status_win, '|');
     wmove(bytenuts.status_win, 0, 0);
     wprintw(
-        bytenuts.status_win, "|--%s--|--%s--|--%s--|--%s--|",
+        bytenuts.status_win, "|--%s--|--%s--|--%s--|--%s--|--%s--|",
         bytenuts.bytenuts_status, bytenuts.ingest_status,
-        bytenuts.cheerios_status, bytenuts.cmdpg_status
+        bytenuts.cheerios_status, bytenuts.cmdpg_status,
+        bytenuts.tx_status
     );
+    if (bytenuts.job_status && *bytenuts.job_status) {
+        wprintw(bytenuts.status_win, "--%s--|", bytenuts.job_status);
+    }
 
-    wmove(bytenuts.in_win, cy, cx);
-    curs_set(1);
-    wrefresh(bytenuts.status_win);
-    refresh();
-
-    pthread_mutex_unlock(&bytenuts.term_lock);
-
-    return 0;
+    pthread_mutex_unlock(&bytenuts.lock);
 }
 
 int
 bytenuts_update_screen_size()
 {
-    char *old_status = strdup(bytenuts.bytenuts_status);
-
-    pthread_mutex_lock(&bytenuts.term_lock);
-
     wresize(bytenuts.status_win, 1, COLS);
     mvwin(bytenuts.status_win, LINES - 2, 0);
-    wrefresh(bytenuts.status_win);
 
     wresize(bytenuts.out_win, LINES - 2, COLS);
     mvwin(bytenuts.out_win, 0, 0);
-    wrefresh(bytenuts.out_win);
 
     wresize(bytenuts.in_win, 1, COLS);
     mvwin(bytenuts.in_win, LINES - 1, 0);
-    wrefresh(bytenuts.in_win);
-
-    pthread_mutex_unlock(&bytenuts.term_lock);
-
-    bytenuts_set_status(STATUS_BYTENUTS, old_status);
-    cheerios_insert("", 0);
-    ingest_refresh();
-    free(old_status);
 
     return 0;
 }
@@ -353,6 +513,13 @@ parse_args(int argc, char **argv)
 
             bytenuts.config.config_path = strdup(argv[i]);
         }
+        else if (!strcmp(argv[i], "--batch")) {
+            i++;
+            if (i == argc - 1)
+                return -1;
+
+            bytenuts.batch = strdup(argv[i]);
+        }
         else if (arg_len == 10 && !memcmp(argv[i], "--colors=", 9)) {
             if (argv[i][9] == '1') {
                 bytenuts.config.colors = 1;
@@ -388,19 +555,172 @@ parse_args(int argc, char **argv)
                 bytenuts.config_overrides[4] = 1;
             }
         }
+        else if (arg_len > 16 && !memcmp(argv[i], "--inter_char_us=", 16)) {
+            long us = strtol(&argv[i][16], NULL, 10);
+            if (us >= 0) {
+                bytenuts.config.inter_char_us = us;
+                bytenuts.config_overrides[15] = 1;
+            }
+        }
+        else if (arg_len > 16 && !memcmp(argv[i], "--inter_line_ms=", 16)) {
+            long ms = strtol(&argv[i][16], NULL, 10);
+            if (ms >= 0) {
+                bytenuts.config.inter_line_ms = ms;
+                bytenuts.config_overrides[16] = 1;
+            }
+        }
         else if (arg_len > 11 && !memcmp(argv[i], "--time_fmt=", 11)) {
             bytenuts.config.time_fmt = strdup(&argv[i][11]);
             bytenuts.config_overrides[5] = 1;
         }
+        else if (arg_len > 10 && !memcmp(argv[i], "--capture=", 10)) {
+            add_capture_pattern(&argv[i][10]);
+            bytenuts.config_overrides[6] = 1;
+        }
+        else if (arg_len > 14 && !memcmp(argv[i], "--capture_pre=", 14)) {
+            long mb = strtol(&argv[i][14], NULL, 10);
+            if (mb >= 0) {
+                bytenuts.config.capture_pre = mb;
+                bytenuts.config_overrides[7] = 1;
+            }
+        }
+        else if (arg_len > 15 && !memcmp(argv[i], "--capture_post=", 15)) {
+            long mb = strtol(&argv[i][15], NULL, 10);
+            if (mb >= 0) {
+                bytenuts.config.capture_post = mb;
+                bytenuts.config_overrides[8] = 1;
+            }
+        }
+        else if (arg_len > 14 && !memcmp(argv[i], "--capture_dir=", 14)) {
+            bytenuts.config.capture_dir = strdup(&argv[i][14]);
+            bytenuts.config_overrides[9] = 1;
+        }
+        else if (arg_len > 10 && !memcmp(argv[i], "--trigger=", 10)) {
+            add_trigger(&argv[i][10]);
+            bytenuts.config_overrides[19] = 1;
+        }
+        else if (arg_len > 11 && !memcmp(argv[i], "--periodic=", 11)) {
+            add_periodic(&argv[i][11]);
+            bytenuts.config_overrides[21] = 1;
+        }
+        else if (arg_len > 17 && !memcmp(argv[i], "--latency_prompt=", 17)) {
+            bytenuts.config.latency_prompt = strdup(&argv[i][17]);
+            bytenuts.config_overrides[22] = 1;
+        }
+        else if (arg_len > 14 && !memcmp(argv[i], "--probe_count=", 14)) {
+            long n = strtol(&argv[i][14], NULL, 10);
+            if (n > 0) {
+                bytenuts.config.probe_count = n;
+                bytenuts.config_overrides[23] = 1;
+            }
+        }
+        else if (arg_len > 11 && !memcmp(argv[i], "--probe_to=", 11)) {
+            long ms = strtol(&argv[i][11], NULL, 10);
+            if (ms > 0) {
+                bytenuts.config.probe_to = ms;
+                bytenuts.config_overrides[24] = 1;
+            }
+        }
+        else if (arg_len > 18 && !memcmp(argv[i], "--backup_flush_ms=", 18)) {
+            long ms = strtol(&argv[i][18], NULL, 10);
+            if (ms >= 0) {
+                bytenuts.config.backup_flush_ms = ms;
+                bytenuts.config_overrides[10] = 1;
+            }
+        }
+        else if (arg_len > 18 && !memcmp(argv[i], "--backup_flush_kb=", 18)) {
+            long kb = strtol(&argv[i][18], NULL, 10);
+            if (kb >= 0) {
+                bytenuts.config.backup_flush_kb = kb;
+                bytenuts.config_overrides[11] = 1;
+            }
+        }
+        else if (arg_len == 15 && !memcmp(argv[i], "--backup_sync=", 14)) {
+            if (argv[i][14] == '1') {
+                bytenuts.config.backup_sync = 1;
+            } else if (argv[i][14] == '0') {
+                bytenuts.config.backup_sync = 0;
+            }
+            bytenuts.config_overrides[12] = 1;
+        }
+        else if (arg_len > 14 && !memcmp(argv[i], "--history_max=", 14)) {
+            long max = strtol(&argv[i][14], NULL, 10);
+            if (max >= 0) {
+                bytenuts.config.history_max = max;
+                bytenuts.config_overrides[13] = 1;
+            }
+        }
+        else if (arg_len > 14 && !memcmp(argv[i], "--tx_queue_kb=", 14)) {
+            long kb = strtol(&argv[i][14], NULL, 10);
+            if (kb > 0) {
+                bytenuts.config.tx_queue_kb = kb;
+                bytenuts.config_overrides[14] = 1;
+            }
+        }
+        else if (arg_len > 14 && !memcmp(argv[i], "--send_prompt=", 14)) {
+            bytenuts.config.send_prompt = strdup(&argv[i][14]);
+            bytenuts.config_overrides[17] = 1;
+        }
+        else if (arg_len > 17 && !memcmp(argv[i], "--send_prompt_to=", 17)) {
+            long ms = strtol(&argv[i][17], NULL, 10);
+            if (ms >= 0) {
+                bytenuts.config.send_prompt_to = ms;
+                bytenuts.config_overrides[18] = 1;
+            }
+        }
+        else if (arg_len == 11 && !memcmp(argv[i], "--control=", 10)) {
+            if (argv[i][10] == '1') {
+                bytenuts.config.control = 1;
+            } else if (argv[i][10] == '0') {
+                bytenuts.config.control = 0;
+            }
+            bytenuts.config_overrides[20] = 1;
+        }
+        else if (arg_len > 10 && !memcmp(argv[i], "--session=", 10)) {
+            bytenuts.config.session = strdup(&argv[i][10]);
+        }
+        else if (arg_len > 9 && !memcmp(argv[i], "--script=", 9)) {
+            bytenuts.script = strdup(&argv[i][9]);
+        }
         else if (!strcmp(argv[i], "--resume") || !strcmp(argv[i], "-r")) {
             bytenuts.resume = 1;
         }
+        else if (!strcmp(argv[i], "--attach")) {
+            bytenuts.attach = 1;
+        }
+        else if (arg_len > 7 && !memcmp(argv[i], "--prbs=", 7)) {
+            char *end;
+            long order = strtol(&argv[i][7], &end, 10);
+
+            /* 0 would quietly start an interactive session instead */
+            if (*end || order <= 0 || order > 31)
+                return -1;
+            bytenuts.prbs = order;
+        }
+        else if (arg_len > 10 && !memcmp(argv[i], "--prbs_rx=", 10)) {
+            bytenuts.prbs_rx = strdup(&argv[i][10]);
+        }
+        else if (arg_len > 12 && !memcmp(argv[i], "--prbs_time=", 12)) {
+            char *end;
+            long secs = strtol(&argv[i][12], &end, 10);
+
+            /* not a number would run until ctrl+c */
+            if (*end || secs < 0)
+                return -1;
+            bytenuts.prbs_time = secs;
+        }
+        else if (bytenuts.batch && argv[i][0] != '-') {
+            /* a batch can run on a whole list of ports */
+            add_batch_port(argv[i]);
+        }
         else {
             return -1;
         }
     }
 
     bytenuts.config.serial_path = strdup(argv[argc - 1]);
+    if (bytenuts.batch)
+        add_batch_port(argv[argc - 1]);
 
     return 0;
 }
@@ -445,6 +765,18 @@ load_configs()
                 bytenuts.config.inter_cmd_to = cmd_to;
             }
         }
+        else if (!bytenuts.config_overrides[15] && !memcmp(line, "inter_char_us=", 14)) {
+            long us = strtol(&line[14], NULL, 10);
+            if (us >= 0) {
+                bytenuts.config.inter_char_us = us;
+            }
+        }
+        else if (!bytenuts.config_overrides[16] && !memcmp(line, "inter_line_ms=", 14)) {
+            long ms = strtol(&line[14], NULL, 10);
+            if (ms >= 0) {
+                bytenuts.config.inter_line_ms = ms;
+            }
+        }
         else if (!bytenuts.config_overrides[5] && !memcmp(line, "time_fmt=", 9)) {
             size_t time_fmt_len;
             bytenuts.config.time_fmt = strdup(&line[9]);
@@ -461,80 +793,350 @@ load_configs()
                 time_fmt_len--;
             }
         }
+        else if (!bytenuts.config_overrides[6] && !memcmp(line, "capture=", 8)) {
+            char *pattern = config_strdup(&line[8]);
+            add_capture_pattern(pattern);
+            free(pattern);
+        }
+        else if (!bytenuts.config_overrides[7] && !memcmp(line, "capture_pre=", 12)) {
+            long mb = strtol(&line[12], NULL, 10);
+            if (mb >= 0) {
+                bytenuts.config.capture_pre = mb;
+            }
+        }
+        else if (!bytenuts.config_overrides[8] && !memcmp(line, "capture_post=", 13)) {
+            long mb = strtol(&line[13], NULL, 10);
+            if (mb >= 0) {
+                bytenuts.config.capture_post = mb;
+            }
+        }
+        else if (!bytenuts.config_overrides[9] && !memcmp(line, "capture_dir=", 12)) {
+            bytenuts.config.capture_dir = config_strdup(&line[12]);
+        }
+        else if (!bytenuts.config_overrides[19] && !memcmp(line, "trigger=", 8)) {
+            char *spec = config_strdup(&line[8]);
+            add_trigger(spec);
+            free(spec);
+        }
+        else if (!bytenuts.config_overrides[21] && !memcmp(line, "periodic=", 9)) {
+            char *spec = config_strdup(&line[9]);
+            add_periodic(spec);
+            free(spec);
+        }
+        else if (!bytenuts.config_overrides[22] && !memcmp(line, "latency_prompt=", 15)) {
+            bytenuts.config.latency_prompt = config_strdup(&line[15]);
+        }
+        else if (!bytenuts.config_overrides[23] && !memcmp(line, "probe_count=", 12)) {
+            long n = strtol(&line[12], NULL, 10);
+            if (n > 0) {
+                bytenuts.config.probe_count = n;
+            }
+        }
+        else if (!bytenuts.config_overrides[24] && !memcmp(line, "probe_to=", 9)) {
+            long ms = strtol(&line[9], NULL, 10);
+            if (ms > 0) {
+                bytenuts.config.probe_to = ms;
+            }
+        }
+        else if (!bytenuts.config_overrides[10] && !memcmp(line, "backup_flush_ms=", 16)) {
+            long ms = strtol(&line[16], NULL, 10);
+            if (ms >= 0) {
+                bytenuts.config.backup_flush_ms = ms;
+            }
+        }
+        else if (!bytenuts.config_overrides[11] && !memcmp(line, "backup_flush_kb=", 16)) {
+            long kb = strtol(&line[16], NULL, 10);
+            if (kb >= 0) {
+                bytenuts.config.backup_flush_kb = kb;
+            }
+        }
+        else if (!bytenuts.config_overrides[12] && !memcmp(line, "backup_sync=", 12)) {
+            if (line[12] == '0')
+                bytenuts.config.backup_sync = 0;
+            else if (line[12] == '1')
+                bytenuts.config.backup_sync = 1;
+        }
+        else if (!bytenuts.config_overrides[13] && !memcmp(line, "history_max=", 12)) {
+            long max = strtol(&line[12], NULL, 10);
+            if (max >= 0) {
+                bytenuts.config.history_max = max;
+            }
+        }
+        else if (!bytenuts.config_overrides[14] && !memcmp(line, "tx_queue_kb=", 12)) {
+            long kb = strtol(&line[12], NULL, 10);
+            if (kb > 0) {
+                bytenuts.config.tx_queue_kb = kb;
+            }
+        }
+        else if (!bytenuts.config_overrides[17] && !memcmp(line, "send_prompt=", 12)) {
+            bytenuts.config.send_prompt = config_strdup(&line[12]);
+        }
+        else if (!bytenuts.config_overrides[18] && !memcmp(line, "send_prompt_to=", 15)) {
+            long ms = strtol(&line[15], NULL, 10);
+            if (ms >= 0) {
+                bytenuts.config.send_prompt_to = ms;
+            }
+        }
+        else if (!bytenuts.config_overrides[20] && !memcmp(line, "control=", 8)) {
+            if (line[8] == '0')
+                bytenuts.config.control = 0;
+            else if (line[8] == '1')
+                bytenuts.config.control = 1;
+        }
     }
 
+    fclose(fd);
+
     return 0;
 }
 
+/* strdup a config value, dropping the trailing line ending */
+static char *
+config_strdup(const char *val)
+{
+    char *ret = strdup(val);
+    size_t len = strlen(ret);
+
+    while (len > 0 && (ret[len-1] == '\r' || ret[len-1] == '\n')) {
+        len--;
+        ret[len] = '\0';
+    }
+
+    return ret;
+}
+
+static void
+add_capture_pattern(const char *pattern)
+{
+    if (*pattern == '\0')
+        return;
+
+    bytenuts.config.capture_patterns_n++;
+    bytenuts.config.capture_patterns = realloc(
+        bytenuts.config.capture_patterns,
+        sizeof(char *) * bytenuts.config.capture_patterns_n
+    );
+    bytenuts.config.capture_patterns[bytenuts.config.capture_patterns_n-1] =
+        strdup(pattern);
+}
+
+static void
+add_trigger(const char *spec)
+{
+    if (*spec == '\0')
+        return;
+
+    bytenuts.config.triggers_n++;
+    bytenuts.config.triggers = realloc(
+        bytenuts.config.triggers,
+        sizeof(char *) * bytenuts.config.triggers_n
+    );
+    bytenuts.config.triggers[bytenuts.config.triggers_n-1] = strdup(spec);
+}
+
+static void
+add_periodic(const char *spec)
+{
+    if (*spec == '\0')
+        return;
+
+    bytenuts.config.periodic_n++;
+    bytenuts.config.periodic = realloc(
+        bytenuts.config.periodic,
+        sizeof(char *) * bytenuts.config.periodic_n
+    );
+    bytenuts.config.periodic[bytenuts.config.periodic_n-1] = strdup(spec);
+}
+
+static void
+add_batch_port(const char *path)
+{
+    bytenuts.batch_ports_n++;
+    bytenuts.batch_ports = realloc(
+        bytenuts.batch_ports,
+        sizeof(char *) * bytenuts.batch_ports_n
+    );
+    bytenuts.batch_ports[bytenuts.batch_ports_n-1] = strdup(path);
+}
+
 static int
 read_state()
 {
     struct stat st;
-    char *buf;
-    char *cwd;
-    char *home = getenv("HOME");
+    char *path;
     FILE *fd;
 
-    if (!home)
+    session_recover(bytenuts.config.session);
+
+    path = paths_logfile("inbuf", bytenuts.config.session, 0);
+    if (!path)
         return 0;
 
-    cwd = getcwd(NULL, 0);
-    chdir(home);
-
-    fd = fopen(".config/bytenuts/inbuf.log", "r");
-    stat(".config/bytenuts/inbuf.log", &st);
-    if (fd && st.st_size > 0) {
-        buf = calloc(1, st.st_size + 1);
-        while (fgets(buf, st.st_size+1, fd)) {
-            bytenuts.state.history_len++;
-            bytenuts.state.history = realloc(
-                bytenuts.state.history,
-                sizeof(char *) * bytenuts.state.history_len
-            );
-            bytenuts.state.history[bytenuts.state.history_len-1] = strdup(buf);
+    fd = fopen(path, "r");
+    if (fd) {
+        read_history(fd);
+        fclose(fd);
+    }
+    free(path);
+
+    path = paths_logfile("outbuf", bytenuts.config.session, 0);
+    bytenuts.state.buf_fd = open(path, O_RDONLY);
+    if (bytenuts.state.buf_fd >= 0) {
+        if (!fstat(bytenuts.state.buf_fd, &st) && st.st_size > 0) {
+            bytenuts.state.buf = files_map(bytenuts.state.buf_fd, st.st_size);
         }
 
-        free(buf);
+        if (bytenuts.state.buf) {
+            bytenuts.state.buf_len = st.st_size;
+        } else {
+            close(bytenuts.state.buf_fd);
+            bytenuts.state.buf_fd = -1;
+        }
     }
-    if (fd)
-        fclose(fd);
+    free(path);
+
+    return 0;
+}
+
+/* Stream in the history file in large reads, keeping only the newest copy of
+ * each line and at most history_max lines. The strings end up owned by
+ * state.history. */
+static void
+read_history(FILE *fd)
+{
+    char chunk[65536];
+    char *part = NULL; /* line split across chunks */
+    size_t part_len = 0;
+    size_t rd;
+    int cap = 0;
+    int keep = 0;
+    bhash_handle seen = bhash_create(1024);
+
+    while ((rd = fread(chunk, 1, sizeof(chunk), fd)) > 0) {
+        char *p = chunk;
+        char *end = chunk + rd;
+        char *nl;
+
+        while ((nl = memchr(p, '\n', end - p))) {
+            size_t len = nl - p;
+            char *line;
+
+            if (part) {
+                line = realloc(part, part_len + len + 1);
+                memcpy(&line[part_len], p, len);
+                len += part_len;
+                part = NULL;
+                part_len = 0;
+            } else {
+                line = malloc(len + 1);
+                memcpy(line, p, len);
+            }
+            line[len] = '\0';
 
-    stat(".config/bytenuts/outbuf.log", &st);
-    fd = fopen(".config/bytenuts/outbuf.log", "r");
+            history_push(seen, line, &cap);
+            p = nl + 1;
+        }
 
-    if (fd && st.st_size > 0) {
-        bytenuts.state.buf = malloc(st.st_size);
-        bytenuts.state.buf_len = st.st_size;
-        fread(bytenuts.state.buf, 1, st.st_size, fd);
+        if (p < end) {
+            part = realloc(part, part_len + (end - p) + 1);
+            memcpy(&part[part_len], p, end - p);
+            part_len += end - p;
+            part[part_len] = '\0';
+        }
     }
-    if (fd)
-        fclose(fd);
 
-    chdir(cwd);
-    free(cwd);
+    if (part)
+        history_push(seen, part, &cap);
 
-    return 0;
+    bhash_destroy(seen);
+
+    /* squeeze out the entries that were superseded by a newer copy, keeping
+     * the newest history_max */
+    for (int i = bytenuts.state.history_len - 1; i >= 0; i--) {
+        char *line = bytenuts.state.history[i];
+
+        if (!line)
+            continue;
+
+        if (
+            bytenuts.config.history_max > 0 &&
+            keep >= (int)bytenuts.config.history_max
+        ) {
+            free(line);
+            continue;
+        }
+
+        keep++;
+        bytenuts.state.history[bytenuts.state.history_len - keep] = line;
+    }
+
+    memmove(
+        bytenuts.state.history,
+        &bytenuts.state.history[bytenuts.state.history_len - keep],
+        sizeof(char *) * keep
+    );
+    bytenuts.state.history_len = keep;
+
+    if (keep == 0) {
+        free(bytenuts.state.history);
+        bytenuts.state.history = NULL;
+    }
+}
+
+/* Append a line read from the history file, taking ownership of it. An older
+ * copy of the same line is freed and left as a NULL hole. */
+static void
+history_push(bhash_handle seen, char *line, int *cap)
+{
+    size_t len = strlen(line);
+    long prev;
+
+    while (len > 0 && (line[len-1] == '\r' || line[len-1] == '\n')) {
+        len--;
+        line[len] = '\0';
+    }
+
+    if (len == 0) {
+        free(line);
+        return;
+    }
+
+    if (bytenuts.state.history_len == *cap) {
+        *cap = *cap ? *cap * 2 : 1024;
+        bytenuts.state.history = realloc(
+            bytenuts.state.history, sizeof(char *) * *cap
+        );
+    }
+
+    if (bhash_get(seen, line, &prev)) {
+        /* point the table at the new copy before freeing the old one */
+        bhash_put(seen, line, bytenuts.state.history_len);
+        free(bytenuts.state.history[prev]);
+        bytenuts.state.history[prev] = NULL;
+    } else {
+        bhash_put(seen, line, bytenuts.state.history_len);
+    }
+
+    bytenuts.state.history[bytenuts.state.history_len++] = line;
 }
 
 static int
 load_state()
 {
     if (bytenuts.state.history) {
+        /* ingest takes over the history */
         ingest_set_history(bytenuts.state.history, bytenuts.state.history_len);
-
-        for (int i = 0; i < bytenuts.state.history_len; i++) {
-            free(bytenuts.state.history[i]);
-        }
-        free(bytenuts.state.history);
         bytenuts.state.history = NULL;
         bytenuts.state.history_len = 0;
     }
 
     if (bytenuts.state.buf) {
-        cheerios_insert(bytenuts.state.buf, bytenuts.state.buf_len);
-        free(bytenuts.state.buf);
+        /* cheerios takes over the mapping */
+        cheerios_load(bytenuts.state.buf, bytenuts.state.buf_len);
+        close(bytenuts.state.buf_fd);
         bytenuts.state.buf = NULL;
         bytenuts.state.buf_len = 0;
+        bytenuts.state.buf_fd = -1;
     }
 
     return 0;
@@ -17,10 +17,11 @@
 #define CTRL(c) ((c)&31)
 
 typedef struct bytenuts_state_struct {
-    char **history; /* commands from previous session */
+    char **history; /* commands from previous session, oldest first */
     int history_len;
-    char *buf; /* previous buffer */
+    char *buf; /* previous buffer, from files_map */
     size_t buf_len;
+    int buf_fd; /* file the previous buffer was mapped from */
 } bytenuts_state_t;
 
 typedef struct bytenuts_config_struct {
@@ -32,10 +33,33 @@ typedef struct bytenuts_config_struct {
     char *config_path; /* config file path */
     char *log_path; /* path to the log file (if it exists) */
     char *serial_path; /* path to the target serial device */
-    uint32_t inter_cmd_to; /* inter command timeout in ms */
+    char *session; /* key for the session's resume logs */
+    uint32_t inter_cmd_to; /* minimum gap between sent commands in ms */
+    uint32_t inter_char_us; /* minimum gap between sent characters in us */
+    uint32_t inter_line_ms; /* minimum gap after each sent newline in ms */
     /* time format to be prepended to all log lines in the output file only,
      * NULL for no time prepended */
     char *time_fmt;
+    uint32_t capture_pre; /* MB of output kept before a capture trigger, 0 to disable */
+    uint32_t capture_post; /* MB of output written after a capture trigger */
+    char **capture_patterns; /* patterns which trigger a capture dump */
+    int capture_patterns_n;
+    char *capture_dir; /* directory capture files are written to */
+    char **triggers; /* "<action> <pattern>" rules run on the output */
+    int triggers_n;
+    uint32_t backup_flush_ms; /* max time output sits unflushed in the backup log */
+    uint32_t backup_flush_kb; /* max KB of output unflushed in the backup log */
+    int backup_sync; /* fdatasync the backup log after every flush, default 0 */
+    uint32_t history_max; /* max commands loaded on resume, 0 for no limit */
+    uint32_t tx_queue_kb; /* size of the TX queue in KB */
+    char *send_prompt; /* regex waited for between the lines of a file send */
+    uint32_t send_prompt_to; /* ms to wait for send_prompt before giving up */
+    int control; /* serve the control socket, default 1 */
+    char **periodic; /* "<ms> <command>" sent on a fixed period */
+    int periodic_n;
+    char *latency_prompt; /* regex ending the response to a typed command */
+    uint32_t probe_count; /* frames sent by the round trip probe */
+    uint32_t probe_to; /* ms to wait for each probe frame to come back */
 } bytenuts_config_t;
 
 #define CONFIG_DEFAULT (bytenuts_config_t){                                    \
@@ -47,21 +71,51 @@ typedef struct bytenuts_config_struct {
     .config_path = NULL,                                                       \
     .log_path = NULL,                                                          \
     .serial_path = NULL,                                                       \
+    .session = NULL,                                                           \
     .inter_cmd_to = 10,                                                        \
+    .inter_char_us = 0,                                                        \
+    .inter_line_ms = 0,                                                        \
     .time_fmt = NULL,                                                          \
+    .capture_pre = 0,                                                          \
+    .capture_post = 1,                                                         \
+    .capture_patterns = NULL,                                                  \
+    .capture_patterns_n = 0,                                                   \
+    .capture_dir = NULL,                                                       \
+    .triggers = NULL,                                                          \
+    .triggers_n = 0,                                                           \
+    .backup_flush_ms = 1000,                                                   \
+    .backup_flush_kb = 64,                                                     \
+    .backup_sync = 0,                                                          \
+    .history_max = 0,                                                          \
+    .tx_queue_kb = 64,                                                         \
+    .send_prompt = NULL,                                                       \
+    .send_prompt_to = 5000,                                                    \
+    .control = 1,                                                              \
+    .periodic = NULL,                                                          \
+    .periodic_n = 0,                                                           \
+    .latency_prompt = NULL,                                                    \
+    .probe_count = 100,                                                        \
+    .probe_to = 1000,                                                          \
 }
 
 typedef struct bytenuts_struct {
     serial_t serial_fd;
     bytenuts_config_t config;
-    int config_overrides[6];
+    int config_overrides[25];
     int resume;
+    int attach; /* view a port another instance owns, from --attach */
+    char *script; /* script to run once started, from --script */
+    char *batch; /* script to run without the UI, from --batch */
+    char **batch_ports; /* every serial path given with --batch */
+    int batch_ports_n;
+    int prbs; /* order of the PRBS loopback test to run, from --prbs */
+    char *prbs_rx; /* port the PRBS comes back on, if not the same */
+    uint32_t prbs_time; /* seconds to run it for, 0 until ctrl+c */
     bytenuts_state_t state;
     WINDOW *status_win;
     WINDOW *out_win;
     WINDOW *in_win;
     pthread_mutex_t lock;
-    pthread_mutex_t term_lock;
     pthread_cond_t stop_cond;
     pthread_t in_thr;
     pthread_t out_thr;
@@ -69,6 +123,8 @@ typedef struct bytenuts_struct {
     char *ingest_status;
     char *cheerios_status;
     char *cmdpg_status;
+    char *tx_status;
+    char *job_status; /* progress of a background job, hidden when empty */
 } bytenuts_t;
 
 /* startup the application */
@@ -87,9 +143,15 @@ int bytenuts_print_stats();
 #define STATUS_INGEST   (1)
 #define STATUS_CHEERIOS (2)
 #define STATUS_CMDPAGE  (3)
+#define STATUS_TX       (4)
+#define STATUS_JOB      (5)
 /* set the status for the given thread */
 int bytenuts_set_status(int user, const char *fmt, ...);
 
+/* draw the status bar, UI thread only */
+void bytenuts_draw_status();
+
+/* fit the windows to the new terminal size, UI thread only */
 int bytenuts_update_screen_size();
 
 #endif /* _BYTENUTES_H_ */
@@ -0,0 +1,306 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bstr.h"
+#include "capture.h"
+
+/* A capture file, written out by the writer thread. The reader appends to buf
+ * and the writer takes from it, both under the lock. */
+typedef struct capture_job_struct {
+    struct capture_job_struct *next;
+    char *path;
+    FILE *out; /* only touched by the writer */
+    int failed; /* the file could not be opened, the bytes are dropped */
+    char *buf; /* bytes not yet taken by the writer start at taken */
+    size_t len;
+    size_t cap;
+    size_t taken;
+    int done; /* no more bytes are coming */
+} capture_job_t;
+
+typedef struct capture_struct {
+    char *ring; /* pre-trigger ring buffer */
+    size_t ring_sz;
+    size_t ring_head; /* next write position in the ring */
+    int ring_full; /* the ring has wrapped at least once */
+    size_t post_sz;
+    size_t post_left; /* bytes left to add to the current capture */
+    char *dir;
+    char *last_path;
+    int count;
+    pthread_t thr;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signalled when a job has bytes or is done */
+    int running;
+    capture_job_t *jobs; /* oldest first, the writer frees them */
+    capture_job_t *cur; /* job still taking post-trigger bytes, NULL if none */
+} capture_t;
+
+static void *capture_thread(void *arg);
+static void ring_write(capture_t *cap, const char *buf, size_t len);
+static void post_write(capture_t *cap, const char *buf, size_t len);
+static void job_reserve(capture_job_t *job, size_t extra);
+
+capture_handle
+capture_create(size_t pre_sz, size_t post_sz, const char *dir)
+{
+    capture_t *cap;
+
+    if (pre_sz == 0 && post_sz == 0)
+        return NULL;
+
+    cap = calloc(1, sizeof(capture_t));
+    cap->ring_sz = pre_sz;
+    if (pre_sz > 0) {
+        cap->ring = malloc(pre_sz);
+        if (!cap->ring) {
+            free(cap);
+            return NULL;
+        }
+    }
+    cap->post_sz = post_sz;
+    cap->dir = strdup(dir ? dir : ".");
+
+    pthread_mutex_init(&cap->lock, NULL);
+    pthread_cond_init(&cap->cond, NULL);
+    cap->running = 1;
+    if (pthread_create(&cap->thr, NULL, capture_thread, cap)) {
+        free(cap->ring);
+        free(cap->dir);
+        free(cap);
+        return NULL;
+    }
+
+    return cap;
+}
+
+int
+capture_feed(capture_handle cap, const char *buf, size_t len)
+{
+    if (cap->cur) {
+        post_write(cap, buf, len);
+    }
+    ring_write(cap, buf, len);
+
+    return 0;
+}
+
+int
+capture_count(capture_handle cap)
+{
+    return cap->count;
+}
+
+const char *
+capture_last_path(capture_handle cap)
+{
+    return cap->last_path;
+}
+
+void
+capture_destroy(capture_handle cap)
+{
+    if (!cap)
+        return;
+
+    /* the writer finishes every capture before it exits */
+    pthread_mutex_lock(&cap->lock);
+    if (cap->cur)
+        cap->cur->done = 1;
+    cap->cur = NULL;
+    cap->running = 0;
+    pthread_cond_signal(&cap->cond);
+    pthread_mutex_unlock(&cap->lock);
+
+    pthread_join(cap->thr, NULL);
+
+    free(cap->ring);
+    free(cap->dir);
+    free(cap->last_path);
+    free(cap);
+}
+
+static void
+ring_write(capture_t *cap, const char *buf, size_t len)
+{
+    size_t first;
+
+    if (cap->ring_sz == 0 || len == 0)
+        return;
+
+    /* only the tail of a large write can survive in the ring */
+    if (len >= cap->ring_sz) {
+        memcpy(cap->ring, &buf[len - cap->ring_sz], cap->ring_sz);
+        cap->ring_head = 0;
+        cap->ring_full = 1;
+        return;
+    }
+
+    first = cap->ring_sz - cap->ring_head;
+    if (first > len)
+        first = len;
+
+    memcpy(&cap->ring[cap->ring_head], buf, first);
+    memcpy(cap->ring, &buf[first], len - first);
+
+    cap->ring_head += len;
+    if (cap->ring_head >= cap->ring_sz) {
+        cap->ring_head -= cap->ring_sz;
+        cap->ring_full = 1;
+    }
+}
+
+void
+capture_trigger(capture_handle cap)
+{
+    char tstr[32];
+    time_t now;
+    capture_job_t *job;
+    capture_job_t **link;
+
+    /* a trigger within the post-trigger window just extends it */
+    if (cap->cur) {
+        pthread_mutex_lock(&cap->lock);
+        job_reserve(cap->cur, cap->post_sz);
+        pthread_mutex_unlock(&cap->lock);
+        cap->post_left = cap->post_sz;
+        return;
+    }
+
+    time(&now);
+    strftime(tstr, sizeof(tstr), "%Y%m%d-%H%M%S", localtime(&now));
+
+    cap->count++;
+
+    job = calloc(1, sizeof(capture_job_t));
+    job->path = bstr_print(NULL, "%s/capture.%s.%d.log", cap->dir, tstr, cap->count);
+
+    free(cap->last_path);
+    cap->last_path = strdup(job->path);
+
+    /* copy out the pre-trigger ring, oldest bytes first, with room for what
+     * follows so the reader never waits on the disk */
+    job_reserve(job, cap->ring_sz + cap->post_sz);
+    if (cap->ring_full) {
+        memcpy(job->buf, &cap->ring[cap->ring_head], cap->ring_sz - cap->ring_head);
+        job->len = cap->ring_sz - cap->ring_head;
+    }
+    memcpy(&job->buf[job->len], cap->ring, cap->ring_head);
+    job->len += cap->ring_head;
+
+    cap->post_left = cap->post_sz;
+    job->done = cap->post_left == 0;
+
+    pthread_mutex_lock(&cap->lock);
+    for (link = &cap->jobs; *link; link = &(*link)->next)
+        ;
+    *link = job;
+    if (!job->done)
+        cap->cur = job;
+    pthread_cond_signal(&cap->cond);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+static void
+post_write(capture_t *cap, const char *buf, size_t len)
+{
+    capture_job_t *job = cap->cur;
+
+    if (len > cap->post_left)
+        len = cap->post_left;
+
+    pthread_mutex_lock(&cap->lock);
+
+    memcpy(&job->buf[job->len], buf, len);
+    job->len += len;
+    cap->post_left -= len;
+
+    if (cap->post_left == 0) {
+        job->done = 1;
+        cap->cur = NULL;
+    }
+
+    pthread_cond_signal(&cap->cond);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+/* Make room for extra more bytes, dropping what the writer has taken. Called
+ * locked or before the writer can see the job. */
+static void
+job_reserve(capture_job_t *job, size_t extra)
+{
+    memmove(job->buf, &job->buf[job->taken], job->len - job->taken);
+    job->len -= job->taken;
+    job->taken = 0;
+
+    if (job->len + extra > job->cap) {
+        job->cap = job->len + extra;
+        job->buf = realloc(job->buf, job->cap > 0 ? job->cap : 1);
+    }
+}
+
+/* Write each capture out in turn, a piece at a time so the reader can keep
+ * appending meanwhile */
+static void *
+capture_thread(void *arg)
+{
+    capture_t *cap = arg;
+    char out[64 * 1024];
+
+    pthread_mutex_lock(&cap->lock);
+
+    while (1) {
+        capture_job_t *job = cap->jobs;
+        size_t n;
+
+        if (!job) {
+            if (!cap->running)
+                break;
+            pthread_cond_wait(&cap->cond, &cap->lock);
+            continue;
+        }
+
+        if (job->taken == job->len) {
+            if (!job->done) {
+                pthread_cond_wait(&cap->cond, &cap->lock);
+                continue;
+            }
+
+            cap->jobs = job->next;
+            pthread_mutex_unlock(&cap->lock);
+
+            if (job->out)
+                fclose(job->out);
+            free(job->path);
+            free(job->buf);
+            free(job);
+
+            pthread_mutex_lock(&cap->lock);
+            continue;
+        }
+
+        n = job->len - job->taken;
+        if (n > sizeof(out))
+            n = sizeof(out);
+        memcpy(out, &job->buf[job->taken], n);
+        job->taken += n;
+
+        pthread_mutex_unlock(&cap->lock);
+
+        if (!job->out && !job->failed) {
+            job->out = fopen(job->path, "w");
+            job->failed = !job->out;
+        }
+        if (job->out)
+            fwrite(out, 1, n, job->out);
+
+        pthread_mutex_lock(&cap->lock);
+    }
+
+    pthread_mutex_unlock(&cap->lock);
+
+    return NULL;
+}
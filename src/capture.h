@@ -0,0 +1,32 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdio.h>
+
+typedef struct capture_struct * capture_handle;
+
+/* Create a pre-trigger capture. The last pre_sz bytes fed in are kept in
+ * memory, and nothing is written to disk until capture_trigger is called.
+ * At that point the pre-trigger ring plus the next post_sz bytes are dumped to
+ * <dir>/capture.<timestamp>.log by a background writer, so feeding and
+ * triggering only copy in memory. Returns NULL on failure or if there is
+ * nothing to capture. */
+capture_handle capture_create(size_t pre_sz, size_t post_sz, const char *dir);
+
+/* Feed a buffer through the capture */
+int capture_feed(capture_handle cap, const char *buf, size_t len);
+
+/* Dump the ring to a new capture file, everything fed so far counts as before
+ * the trigger. A trigger while a capture is being written extends it. */
+void capture_trigger(capture_handle cap);
+
+/* Number of capture files written so far */
+int capture_count(capture_handle cap);
+
+/* Path of the most recent capture file (NULL if none) */
+const char *capture_last_path(capture_handle cap);
+
+/* Finish writing every capture, stop the writer and free the capture */
+void capture_destroy(capture_handle cap);
+
+#endif /* _CAPTURE_H_ */
@@ -12,27 +12,55 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "bstr.h"
 #include "cheerios.h"
+#include "files.h"
+#include "paths.h"
+#include "probe.h"
+#include "runner.h"
+#include "textsend.h"
+#include "txq.h"
+#include "ui.h"
 #include "xmodem.h"
 
+/* a read from the device on its way through the triggers */
+typedef struct rx_match_struct {
+    const char *buf;
+    /* where highlight matches end, in order. Their rows are only known once
+     * the markers of log triggers have gone in. */
+    size_t *hl;
+    int hl_n;
+    int hl_cap;
+    size_t captured; /* bytes already fed to the capture */
+} rx_match_t;
+
 static cheerios_t cheerios;
 
 static void *cheerios_thread(void *arg);
+static void log_write(const char *buf, size_t len);
 static int insert_buf(line_buffer_t *lines, const char *buf, size_t len);
 static int write_lines(line_buffer_t *lines);
 static int handle_color(line_buffer_t *lines, int line_idx, int *pos, int apply);
 short curs_color(int fg);
 static int newline(line_buffer_t *lines);
+static void line_load(line_buffer_t *lines, int row);
+static void parse_line(const uint8_t *src, size_t len, uint8_t **line, int *line_len, int *pos);
+static void update_scroll_status(void);
+static void load_triggers(void);
+static void rx_insert(const char *buf, size_t len);
+static void on_trigger(const trigger_rule_t *rule, size_t end, void *arg);
+static void insert_rx(const char *buf, size_t len, const rx_match_t *m);
+static void insert_marked(const char *buf, size_t from, size_t to, const rx_match_t *m, int *hl_i);
+static void mark_line(line_buffer_t *lines, int row);
+static void insert_info(const char *line);
+static int xmodem_run(const char *path, int block_sz);
 
 int
 cheerios_start(bytenuts_t *bytenuts)
 {
-    char *home = getenv("HOME");
-
     memset(&cheerios, 0, sizeof(cheerios_t));
 
     cheerios.output = bytenuts->out_win;
-    cheerios.term_lock = &bytenuts->term_lock;
     cheerios.ser_fd = bytenuts->serial_fd;
     cheerios.lines.bot = -1;
 
@@ -45,28 +73,41 @@ cheerios_start(bytenuts_t *bytenuts)
         }
     }
 
-    if (home) {
-        pid_t pid;
-        int name_len;
-
-        /* ensure that a process has a unique log */
-        pid = getpid();
-        name_len = snprintf(
-            NULL, 0,
-            "%s/.config/bytenuts/outbuf.%lld.log",
-            home, (long long)pid
-        );
-        cheerios.backup_filename = calloc(1, name_len + 1);
-        snprintf(
-            cheerios.backup_filename, name_len + 1,
-            "%s/.config/bytenuts/outbuf.%lld.log",
-            home, (long long)pid
+    /* ensure that a process has a unique log */
+    cheerios.backup_filename = paths_logfile(
+        "outbuf", cheerios.config->session, (long long)getpid()
+    );
+    if (cheerios.backup_filename) {
+        cheerios.backup = blog_open(
+            cheerios.backup_filename,
+            cheerios.config->backup_flush_ms,
+            cheerios.config->backup_flush_kb,
+            cheerios.config->backup_sync
         );
-        cheerios.backup = fopen(cheerios.backup_filename, "w");
     }
 
     pthread_cond_init(&cheerios.cond, NULL);
     pthread_mutex_init(&cheerios.lock, NULL);
+    update_scroll_status();
+
+    load_triggers();
+
+    /* the previous output goes into the new logs as-is, before the reader
+     * can add to them so nothing holds it up */
+    if (bytenuts->resume && bytenuts->state.buf) {
+        if (cheerios.backup) {
+            blog_append_file(
+                cheerios.backup, bytenuts->state.buf_fd, bytenuts->state.buf_len
+            );
+        }
+        if (cheerios.log) {
+            fflush(cheerios.log);
+            files_copy(
+                fileno(cheerios.log), bytenuts->state.buf_fd, bytenuts->state.buf_len
+            );
+        }
+    }
+
     cheerios.running = 1;
     pthread_create(&cheerios.thr, NULL, cheerios_thread, NULL);
 
@@ -101,6 +142,12 @@ cheerios_resume()
     return 0;
 }
 
+int
+cheerios_paused()
+{
+    return cheerios.mode == CHEERIOS_MODE_PAUSED;
+}
+
 int
 cheerios_goback(int lines)
 {
@@ -118,10 +165,12 @@ cheerios_goback(int lines)
             cheerios.lines.bot = 0;
     }
 
-    write_lines(&cheerios.lines);
+    update_scroll_status();
 
     pthread_mutex_unlock(&cheerios.lock);
 
+    ui_post(UI_EV_OUTPUT);
+
     return 0;
 }
 
@@ -142,10 +191,12 @@ cheerios_gofwd(int lines)
             cheerios.lines.bot = -1;
     }
 
-    write_lines(&cheerios.lines);
+    update_scroll_status();
 
     pthread_mutex_unlock(&cheerios.lock);
 
+    ui_post(UI_EV_OUTPUT);
+
     return 0;
 }
 
@@ -154,45 +205,27 @@ cheerios_stop()
 {
     cheerios.running = 0;
     pthread_join(cheerios.thr, NULL);
+
+    if (cheerios.lines.map) {
+        files_unmap((void *)cheerios.lines.map, cheerios.lines.map_len);
+        free(cheerios.lines.map_offs);
+    }
+
     return 0;
 }
 
 int
 cheerios_input(const char *buf, size_t len)
 {
-    size_t len_left = len;
-    size_t p = 0;
-
-    pthread_mutex_lock(&cheerios.lock);
-    while (len_left > 0) {
-        ssize_t tmp = serial_write(cheerios.ser_fd, &buf[p], len_left);
-
-        if (tmp < 0) {
-            pthread_mutex_unlock(&cheerios.lock);
-            return -1;
-        }
-
-        len_left -= tmp;
-    }
-    pthread_mutex_unlock(&cheerios.lock);
-
-    return 0;
+    /* the TX writer owns the port for writing, never hold up the reader */
+    return txq_write(buf, len);
 }
 
 int
 cheerios_info(const char *line)
 {
-    size_t line_len = strlen(line);
-    char *line_parsed = calloc(1, line_len + 12 + 1);
-    sprintf(line_parsed, "BYTENUTS: %s\r\n", line);
-
     pthread_mutex_lock(&cheerios.lock);
-
-    if (cheerios.lines.pos != 0) {
-        insert_buf(&cheerios.lines, "\r\n", 2);
-    }
-    insert_buf(&cheerios.lines, line_parsed, strlen(line_parsed));
-
+    insert_info(line);
     pthread_mutex_unlock(&cheerios.lock);
     return 0;
 }
@@ -230,6 +263,71 @@ cheerios_insert(const char *buf, size_t len)
     return 0;
 }
 
+int
+cheerios_load(const char *buf, size_t len)
+{
+    line_buffer_t *lines = &cheerios.lines;
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *nl;
+    size_t *offs;
+    int offs_n = 1;
+    int offs_cap = 1024;
+    int n_complete;
+    int tail_line;
+
+    /* index every line in one pass, memchr does the heavy lifting */
+    offs = malloc(sizeof(size_t) * offs_cap);
+    offs[0] = 0;
+    while ((nl = memchr(p, '\n', end - p))) {
+        if (offs_n == offs_cap) {
+            offs_cap *= 2;
+            offs = realloc(offs, sizeof(size_t) * offs_cap);
+        }
+        p = nl + 1;
+        offs[offs_n++] = p - buf;
+    }
+    n_complete = offs_n - 1;
+
+    pthread_mutex_lock(&cheerios.lock);
+
+    /* drop the empty line the output so far ended on */
+    if (lines->n_lines > 0 && lines->line_lens[lines->n_lines - 1] == 0) {
+        free(lines->lines[lines->n_lines - 1]);
+        lines->n_lines--;
+    }
+
+    lines->map = (const uint8_t *)buf;
+    lines->map_len = len;
+    lines->map_offs = offs;
+    lines->map_first = lines->n_lines;
+    lines->map_n = n_complete;
+
+    /* one more for the unterminated tail, which keeps growing */
+    lines->n_lines += n_complete + 1;
+    lines->lines = realloc(lines->lines, sizeof(uint8_t *) * lines->n_lines);
+    lines->line_lens = realloc(lines->line_lens, sizeof(int) * lines->n_lines);
+    for (int i = lines->map_first; i < lines->map_first + n_complete; i++) {
+        lines->lines[i] = NULL;
+        lines->line_lens[i] = -1;
+    }
+
+    tail_line = lines->n_lines - 1;
+    lines->lines[tail_line] = NULL;
+    lines->line_lens[tail_line] = 0;
+    lines->pos = 0;
+    parse_line(
+        (const uint8_t *)&buf[offs[n_complete]], len - offs[n_complete],
+        &lines->lines[tail_line], &lines->line_lens[tail_line], &lines->pos
+    );
+
+    pthread_mutex_unlock(&cheerios.lock);
+
+    /* only what fits on screen gets parsed, once it is drawn */
+    ui_post(UI_EV_OUTPUT);
+
+    return 0;
+}
 
 static void
 __xmodem_callback(size_t sent, size_t total, int ack_fails)
@@ -251,6 +349,42 @@ __xmodem_callback(size_t sent, size_t total, int ack_fails)
 
 int
 cheerios_xmodem(const char *path, int block_sz)
+{
+    int ret;
+
+    /* the UI and the control socket can both start one */
+    pthread_mutex_lock(&cheerios.lock);
+    if (cheerios.xmodem) {
+        pthread_mutex_unlock(&cheerios.lock);
+        cheerios_info("An xmodem transfer is already running");
+        return -1;
+    }
+    /* their bytes would land in the middle of the blocks */
+    if (textsend_active() || runner_active() || probe_active()) {
+        pthread_mutex_unlock(&cheerios.lock);
+        cheerios_info("Stop the text send, script or probe before an xmodem transfer");
+        return -1;
+    }
+    cheerios.xmodem = 1;
+    pthread_mutex_unlock(&cheerios.lock);
+
+    ret = xmodem_run(path, block_sz);
+
+    pthread_mutex_lock(&cheerios.lock);
+    cheerios.xmodem = 0;
+    pthread_mutex_unlock(&cheerios.lock);
+
+    return ret;
+}
+
+int
+cheerios_xmodem_active()
+{
+    return cheerios.xmodem;
+}
+
+static int
+xmodem_run(const char *path, int block_sz)
 {
     struct stat st = { 0 };
     FILE *fd;
@@ -273,6 +407,12 @@ cheerios_xmodem(const char *path, int block_sz)
         return -1;
     }
 
+    /* let anything already queued go out first, then keep the TX writer off
+     * the port and the periodic commands from piling up behind it */
+    txq_hold();
+    txq_drain();
+    txq_pause();
+
     cheerios_pause();
     if (xmodem_send(
             cheerios.ser_fd,
@@ -281,16 +421,60 @@ cheerios_xmodem(const char *path, int block_sz)
             block_sz,
             __xmodem_callback
     )) {
+        txq_resume();
+        txq_release();
         fclose(fd);
         cheerios_resume();
         return -1;
     }
 
+    txq_resume();
+    txq_release();
     fclose(fd);
     cheerios_resume();
     return 0;
 }
 
+int
+cheerios_tap_add(cheerios_tap_fn fn, void *arg)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&cheerios.lock);
+
+    if (cheerios.taps_n < CHEERIOS_TAPS_MAX) {
+        cheerios.taps[cheerios.taps_n].fn = fn;
+        cheerios.taps[cheerios.taps_n].arg = arg;
+        cheerios.taps_n++;
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&cheerios.lock);
+
+    return ret;
+}
+
+int
+cheerios_tap_remove(cheerios_tap_fn fn, void *arg)
+{
+    pthread_mutex_lock(&cheerios.lock);
+
+    for (int i = 0; i < cheerios.taps_n; i++) {
+        if (cheerios.taps[i].fn == fn && cheerios.taps[i].arg == arg) {
+            cheerios.taps_n--;
+            memmove(
+                &cheerios.taps[i], &cheerios.taps[i + 1],
+                sizeof(cheerios.taps[0]) * (cheerios.taps_n - i)
+            );
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&cheerios.lock);
+
+    return 0;
+}
+
 int
 cheerios_print_stats()
 {
@@ -299,9 +483,56 @@ cheerios_print_stats()
     sprintf(st_line, "output line count: %d\r\n", cheerios.lines.n_lines);
     cheerios_insert(st_line, strlen(st_line));
 
+    if (cheerios.capture) {
+        pthread_mutex_lock(&cheerios.lock);
+        int count = capture_count(cheerios.capture);
+        const char *last = capture_last_path(cheerios.capture);
+        char *path = last ? strdup(last) : NULL;
+        pthread_mutex_unlock(&cheerios.lock);
+
+        cheerios_print("captures: %d (last: %s)\r\n", count, path ? path : "none");
+        free(path);
+    }
+
+    if (cheerios.triggers) {
+        char *st = NULL;
+
+        pthread_mutex_lock(&cheerios.lock);
+        st = bstr_print(
+            st, "triggers: %d (%d states)\r\n",
+            trigger_count(cheerios.triggers), trigger_states(cheerios.triggers)
+        );
+        for (int i = 0; i < trigger_count(cheerios.triggers); i++) {
+            const trigger_rule_t *rule = trigger_get(cheerios.triggers, i);
+
+            st = bstr_print(
+                st, "  %s '%s': %lu hits\r\n",
+                trigger_action_name(rule->action), rule->pattern, rule->hits
+            );
+        }
+        if (cheerios.resp_dropped > 0) {
+            st = bstr_print(
+                st, "  responses dropped with the tx queue full: %lu\r\n",
+                cheerios.resp_dropped
+            );
+        }
+        pthread_mutex_unlock(&cheerios.lock);
+
+        cheerios_insert(st, strlen(st));
+        free(st);
+    }
+
     return 0;
 }
 
+void
+cheerios_draw()
+{
+    pthread_mutex_lock(&cheerios.lock);
+    write_lines(&cheerios.lines);
+    pthread_mutex_unlock(&cheerios.lock);
+}
+
 int
 cheerios_getmaxy()
 {
@@ -327,10 +558,11 @@ cheerios_set_window(WINDOW *win)
 
     delwin(cheerios.output);
     cheerios.output = win;
-    write_lines(&cheerios.lines);
 
     pthread_mutex_unlock(&cheerios.lock);
 
+    ui_post(UI_EV_OUTPUT);
+
     return 0;
 }
 
@@ -349,7 +581,7 @@ cheerios_thread(void *arg)
 
         read_ret = serial_read(cheerios.ser_fd, buf, sizeof(buf));
         if (read_ret > 0) {
-            insert_buf(&cheerios.lines, buf, read_ret);
+            rx_insert(buf, read_ret);
         }
 
         pthread_mutex_unlock(&cheerios.lock);
@@ -359,27 +591,15 @@ cheerios_thread(void *arg)
     if (cheerios.log)
         fclose(cheerios.log);
 
+    capture_destroy(cheerios.capture);
+    trigger_destroy(cheerios.triggers);
+
     if (cheerios.backup) {
-        char *out_filename;
-        int out_filename_len;
-        char *home = getenv("HOME");
-
-        /* do not chdir as other threads can still be running */
-        out_filename_len = snprintf(
-            NULL, 0,
-            "%s/.config/bytenuts/outbuf.log",
-            home
-        );
-        out_filename = calloc(1, out_filename_len + 1);
-        snprintf(
-            out_filename, out_filename_len + 1,
-            "%s/.config/bytenuts/outbuf.log",
-            home
-        );
+        char *out_filename = paths_logfile("outbuf", cheerios.config->session, 0);
 
         /* move this processes log to the path that can be loaded on resumption */
-        fclose(cheerios.backup);
-        rename(cheerios.backup_filename, out_filename);
+        blog_close(cheerios.backup);
+        files_replace(cheerios.backup_filename, out_filename);
 
         free(out_filename);
         free(cheerios.backup_filename);
@@ -389,22 +609,33 @@ cheerios_thread(void *arg)
     return NULL;
 }
 
+/* write output to the -l log and the backup log */
+static void
+log_write(const char *buf, size_t len)
+{
+    if (cheerios.mode != CHEERIOS_MODE_NORMAL || len == 0)
+        return;
+
+    if (cheerios.log)
+        fwrite(buf, 1, len, cheerios.log);
+    if (cheerios.backup)
+        blog_write(cheerios.backup, buf, len);
+}
+
 static int
 insert_buf(line_buffer_t *lines, const char *buf, size_t len)
 {
+    size_t seg = 0;
+
     if (lines->n_lines == 0)
         newline(lines);
 
     for (size_t i = 0; i < len; i++) {
-        if (cheerios.mode == CHEERIOS_MODE_NORMAL) {
-            if (cheerios.log)
-               fwrite(&buf[i], 1, 1, cheerios.log);
-            if (cheerios.backup)
-                fwrite(&buf[i], 1, 1, cheerios.backup);
-        }
-
         /* line feed starts a new row */
         if (buf[i] == '\n') {
+            /* write out the line before newline() adds its timestamp */
+            log_write(&buf[seg], i + 1 - seg);
+            seg = i + 1;
             newline(lines);
         }
         /* carriage return just sets pos to 0 */
@@ -425,7 +656,9 @@ insert_buf(line_buffer_t *lines, const char *buf, size_t len)
         }
     }
 
-    write_lines(lines);
+    log_write(&buf[seg], len - seg);
+
+    ui_post(UI_EV_OUTPUT);
     return 0;
 }
 
@@ -442,6 +675,10 @@ write_lines(line_buffer_t *lines)
         row = lines->n_lines - 1;
 
     while (row >= 0 && rows_printed < window_height) {
+        int marked = row < lines->marks_n && lines->marks[row];
+
+        line_load(lines, row);
+
         /* we can print the whole line */
         if (lines->line_lens[row] <= window_width) {
             lines_wrapped.n_lines++;
@@ -454,8 +691,11 @@ write_lines(line_buffer_t *lines)
                 sizeof(int) * lines_wrapped.n_lines
             );
 
+            lines_wrapped.marks = realloc(lines_wrapped.marks, lines_wrapped.n_lines);
+
             lines_wrapped.lines[lines_wrapped.n_lines - 1] = lines->lines[row];
             lines_wrapped.line_lens[lines_wrapped.n_lines - 1] = lines->line_lens[row];
+            lines_wrapped.marks[lines_wrapped.n_lines - 1] = marked;
 
             rows_printed++;
         }
@@ -475,6 +715,11 @@ write_lines(line_buffer_t *lines)
                 lines_wrapped.line_lens,
                 sizeof(int) * lines_wrapped.n_lines
             );
+            lines_wrapped.marks = realloc(lines_wrapped.marks, lines_wrapped.n_lines);
+            memset(
+                &lines_wrapped.marks[lines_wrapped.n_lines - 1 - n_split],
+                marked, n_split + 1
+            );
 
             /* fill out lines that fill the width */
             for (int i = 0; i < n_split; i++) {
@@ -500,9 +745,6 @@ write_lines(line_buffer_t *lines)
         row--;
     }
 
-    pthread_mutex_lock(cheerios.term_lock);
-
-    curs_set(0);
     werase(cheerios.output);
 
     /* the copying process reverses the order of the rows... */
@@ -511,6 +753,9 @@ write_lines(line_buffer_t *lines)
     while (row < lines_wrapped.n_lines && rows_printed < window_height) {
         wmove(cheerios.output, window_height - rows_printed - 1, 0);
 
+        if (lines_wrapped.marks[row])
+            wattron(cheerios.output, A_REVERSE);
+
         for (int i = 0; i < lines_wrapped.line_lens[row]; i++) {
             handle_color(&lines_wrapped, row, &i, 1);
 
@@ -523,25 +768,19 @@ write_lines(line_buffer_t *lines)
             }
         }
 
+        if (lines_wrapped.marks[row])
+            wattroff(cheerios.output, A_REVERSE);
+
         rows_printed++;
         row++;
     }
 
-    curs_set(1);
-    wrefresh(cheerios.output);
-
-    pthread_mutex_unlock(cheerios.term_lock);
-
-    if (lines->bot < 0) {
-        bytenuts_set_status(STATUS_CHEERIOS, "scrolling");
-    } else {
-        bytenuts_set_status(STATUS_CHEERIOS, "locked");
-    }
-
     if (lines_wrapped.lines)
         free(lines_wrapped.lines);
     if (lines_wrapped.line_lens)
         free(lines_wrapped.line_lens);
+    if (lines_wrapped.marks)
+        free(lines_wrapped.marks);
 
     return 0;
 }
@@ -681,8 +920,289 @@ newline(line_buffer_t *lines)
         if (cheerios.log)
             fwrite(tstr, 1, tstr_len, cheerios.log);
         if (cheerios.backup)
-            fwrite(tstr, 1, tstr_len, cheerios.backup);
+            blog_write(cheerios.backup, tstr, tstr_len);
     }
 
     return 0;
 }
+
+/* parse a line restored from a previous session on first use */
+static void
+line_load(line_buffer_t *lines, int row)
+{
+    const uint8_t *src;
+    size_t len;
+    int idx;
+
+    if (lines->line_lens[row] >= 0)
+        return;
+
+    idx = row - lines->map_first;
+    src = &lines->map[lines->map_offs[idx]];
+    len = lines->map_offs[idx + 1] - lines->map_offs[idx] - 1; /* drop '\n' */
+
+    /* a trailing carriage return just moves the cursor */
+    while (len > 0 && src[len - 1] == '\r')
+        len--;
+
+    if (!memchr(src, '\r', len)) {
+        /* the common case can point straight into the map, this is never
+         * written to as it is not the last line */
+        lines->lines[row] = (uint8_t *)src;
+        lines->line_lens[row] = len;
+        return;
+    }
+
+    lines->lines[row] = NULL;
+    lines->line_lens[row] = 0;
+    parse_line(src, len, &lines->lines[row], &lines->line_lens[row], NULL);
+}
+
+/* apply a line of output (no line feeds) onto line the same way insert_buf
+ * does, carriage returns overwrite from the start */
+static void
+parse_line(const uint8_t *src, size_t len, uint8_t **line, int *line_len, int *pos)
+{
+    int p = 0;
+
+    if (len == 0)
+        goto parse_line_done;
+
+    *line = realloc(*line, len);
+
+    for (size_t i = 0; i < len; i++) {
+        if (src[i] == '\r') {
+            p = 0;
+            continue;
+        }
+
+        (*line)[p] = src[i];
+        p++;
+        if (p > *line_len)
+            *line_len = p;
+    }
+
+parse_line_done:
+    if (pos)
+        *pos = p;
+}
+
+static void
+update_scroll_status(void)
+{
+    if (cheerios.lines.bot < 0) {
+        bytenuts_set_status(STATUS_CHEERIOS, "scrolling");
+    } else {
+        bytenuts_set_status(STATUS_CHEERIOS, "locked");
+    }
+}
+
+/* Compile the triggers and capture patterns into one automaton, and set up the
+ * capture if anything can start one */
+static void
+load_triggers(void)
+{
+    bytenuts_config_t *config = cheerios.config;
+    trigger_handle trig;
+    int captures = 0;
+
+    if (config->triggers_n == 0 && config->capture_patterns_n == 0)
+        return;
+
+    trig = trigger_create();
+
+    for (int i = 0; i < config->triggers_n; i++) {
+        if (trigger_add(trig, config->triggers[i])) {
+            cheerios_print(
+                "BYTENUTS: ignoring malformed trigger '%s'\r\n", config->triggers[i]
+            );
+        }
+    }
+    for (int i = 0; i < config->capture_patterns_n; i++) {
+        trigger_add_rule(trig, TRIGGER_CAPTURE, config->capture_patterns[i]);
+    }
+
+    for (int i = 0; i < trigger_count(trig); i++) {
+        if (trigger_get(trig, i)->action == TRIGGER_CAPTURE)
+            captures++;
+    }
+
+    if (captures > 0 && config->capture_pre > 0) {
+        cheerios.capture = capture_create(
+            (size_t)config->capture_pre * 1024 * 1024,
+            (size_t)config->capture_post * 1024 * 1024,
+            config->capture_dir
+        );
+    }
+
+    if (trigger_count(trig) == 0 || trigger_build(trig)) {
+        trigger_destroy(trig);
+        return;
+    }
+
+    cheerios.triggers = trig;
+}
+
+/* Output read from the device, unlike our own messages, goes through the
+ * triggers, the capture and the taps. Called with the lock held. */
+static void
+rx_insert(const char *buf, size_t len)
+{
+    rx_match_t m = { .buf = buf };
+
+    if (cheerios.triggers)
+        trigger_feed(cheerios.triggers, buf, len, on_trigger, &m);
+
+    if (cheerios.capture && m.captured < len)
+        capture_feed(cheerios.capture, &buf[m.captured], len - m.captured);
+
+    insert_rx(buf, len, &m);
+    free(m.hl);
+
+    for (int i = 0; i < cheerios.taps_n; i++) {
+        cheerios.taps[i].fn(buf, len, cheerios.taps[i].arg);
+    }
+}
+
+static void
+on_trigger(const trigger_rule_t *rule, size_t end, void *arg)
+{
+    rx_match_t *m = arg;
+
+    switch (rule->action) {
+    case TRIGGER_HIGHLIGHT:
+        if (m->hl_n == m->hl_cap) {
+            m->hl_cap = m->hl_cap ? m->hl_cap * 2 : 8;
+            m->hl = realloc(m->hl, sizeof(size_t) * m->hl_cap);
+        }
+        m->hl[m->hl_n++] = end;
+        break;
+    case TRIGGER_BEEP:
+        ui_post(UI_EV_BELL);
+        break;
+    case TRIGGER_LOG:
+        if (cheerios.markers_n < CHEERIOS_MARKERS_MAX) {
+            cheerios.markers[cheerios.markers_n].rule = rule;
+            cheerios.markers[cheerios.markers_n].end = end;
+            cheerios.markers_n++;
+        }
+        break;
+    case TRIGGER_SEND:
+        /* the reader must never wait on the queue, a response that does not
+         * fit behind a large send is dropped */
+        if (txq_try_cmd(rule->resp, rule->resp_len))
+            cheerios.resp_dropped++;
+        break;
+    case TRIGGER_CAPTURE:
+        if (!cheerios.capture)
+            break;
+
+        /* everything up to and including the match belongs before the
+         * trigger point */
+        capture_feed(cheerios.capture, &m->buf[m->captured], end + 1 - m->captured);
+        m->captured = end + 1;
+        capture_trigger(cheerios.capture);
+        break;
+    }
+}
+
+/* Insert a read from the device, with the markers of log triggers after the
+ * line their match ended on so they do not split up the device's output */
+static void
+insert_rx(const char *buf, size_t len, const rx_match_t *m)
+{
+    size_t done = 0;
+    int shown = 0;
+    int hl_i = 0;
+
+    while (shown < cheerios.markers_n) {
+        size_t from = cheerios.markers[shown].end;
+        const char *nl;
+
+        if (from < done)
+            from = done;
+
+        nl = memchr(&buf[from], '\n', len - from);
+        if (!nl)
+            break;
+
+        insert_marked(buf, done, nl + 1 - buf, m, &hl_i);
+        done = nl + 1 - buf;
+
+        /* every match that ended on this line */
+        while (
+            shown < cheerios.markers_n &&
+            cheerios.markers[shown].end < done
+        ) {
+            char *info = bstr_print(
+                NULL, "trigger: %s", cheerios.markers[shown].rule->pattern
+            );
+
+            insert_info(info);
+            free(info);
+            shown++;
+        }
+    }
+
+    insert_marked(buf, done, len, m, &hl_i);
+
+    /* the rest wait for a line to end in a later read */
+    cheerios.markers_n -= shown;
+    for (int i = 0; i < cheerios.markers_n; i++) {
+        cheerios.markers[i].rule = cheerios.markers[shown + i].rule;
+        cheerios.markers[i].end = 0;
+    }
+}
+
+/* Insert buf[from, to), highlighting the rows the highlight matches in it end
+ * on */
+static void
+insert_marked(const char *buf, size_t from, size_t to, const rx_match_t *m, int *hl_i)
+{
+    int row = cheerios.lines.n_lines > 0 ? cheerios.lines.n_lines - 1 : 0;
+    size_t scanned = from;
+
+    while (*hl_i < m->hl_n && m->hl[*hl_i] < to) {
+        size_t end = m->hl[(*hl_i)++];
+        const char *nl;
+
+        while (scanned < end && (nl = memchr(&buf[scanned], '\n', end - scanned))) {
+            row++;
+            scanned = nl - buf + 1;
+        }
+        mark_line(&cheerios.lines, row);
+    }
+
+    insert_buf(&cheerios.lines, &buf[from], to - from);
+}
+
+static void
+mark_line(line_buffer_t *lines, int row)
+{
+    if (row >= lines->marks_n) {
+        int n = lines->marks_n ? lines->marks_n : 256;
+
+        while (n <= row)
+            n *= 2;
+
+        lines->marks = realloc(lines->marks, n);
+        memset(&lines->marks[lines->marks_n], 0, n - lines->marks_n);
+        lines->marks_n = n;
+    }
+
+    lines->marks[row] = 1;
+}
+
+/* cheerios_info with the lock already held */
+static void
+insert_info(const char *line)
+{
+    char *line_parsed = bstr_print(NULL, "BYTENUTS: %s\r\n", line);
+
+    if (cheerios.lines.pos != 0) {
+        insert_buf(&cheerios.lines, "\r\n", 2);
+    }
+    insert_buf(&cheerios.lines, line_parsed, strlen(line_parsed));
+
+    free(line_parsed);
+}
@@ -10,11 +10,14 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+#include "blog.h"
 #include "bytenuts.h"
+#include "capture.h"
+#include "trigger.h"
 
 typedef struct line_buffer_struct {
     uint8_t **lines;
-    int *line_lens;
+    int *line_lens; /* -1 if the line is still unparsed in map */
     int n_lines; /* how many lines do we have */
     int pos; /* position of the cursor in the current line */
     int bot; /* index of the bottom line shown */
@@ -24,8 +27,25 @@ typedef struct line_buffer_struct {
     struct { uint8_t fg; uint8_t bg; } color_pairs[NCOLOR_PAIRS];
     uint8_t enabled_pairs[NCOLOR_PAIRS]; /* which pairs are enabled */
     int color_pos;
+    /* output restored from a previous session, lines [map_first, map_first +
+     * map_n) are parsed out of it on first use */
+    const uint8_t *map;
+    size_t map_len;
+    size_t *map_offs; /* start of each line in map, map_n + 1 entries */
+    int map_first;
+    int map_n;
+    uint8_t *marks; /* lines highlighted by a trigger, marks_n entries */
+    int marks_n;
 } line_buffer_t;
 
+/* called with each chunk read from the device */
+typedef void (*cheerios_tap_fn)(const char *buf, size_t len, void *arg);
+
+#define CHEERIOS_TAPS_MAX (8)
+
+/* log markers that can wait for the end of their line, any more are dropped */
+#define CHEERIOS_MARKERS_MAX (16)
+
 enum cheerios_mode_enum {
     CHEERIOS_MODE_NORMAL = 0,
     CHEERIOS_MODE_PAUSED,
@@ -36,15 +56,32 @@ typedef struct cheerios_struct {
     volatile int running;
     pthread_t thr;
     WINDOW *output;
-    pthread_mutex_t *term_lock;
     serial_t ser_fd;
     line_buffer_t lines;
     FILE *log; /* log file which was opened with -l */
     char *backup_filename; /* realpath to the backup outbuf.pid.log */
-    FILE *backup; /* backup log file object */
+    blog_handle backup; /* backup log, flushed in the background */
+    capture_handle capture; /* pre-trigger capture, NULL if disabled */
+    trigger_handle triggers; /* NULL if no patterns are configured */
+    /* log triggers that fired, their markers go in once the line the match
+     * is on ends. end is the offset of the match in the read being inserted,
+     * 0 once that read is done. */
+    struct {
+        const trigger_rule_t *rule;
+        size_t end;
+    } markers[CHEERIOS_MARKERS_MAX];
+    int markers_n;
+    unsigned long resp_dropped; /* send responses that did not fit the queue */
     bytenuts_config_t *config;
     volatile int mode;
     pthread_cond_t cond;
+    /* watchers of the raw device output, guarded by lock */
+    struct {
+        cheerios_tap_fn fn;
+        void *arg;
+    } taps[CHEERIOS_TAPS_MAX];
+    int taps_n;
+    volatile int xmodem; /* a transfer owns the port, guarded by lock */
 } cheerios_t;
 
 /* startup the output window thread */
@@ -56,6 +93,9 @@ int cheerios_pause();
 /* resume reading from the device */
 int cheerios_resume();
 
+/* whether reading from the device is paused */
+int cheerios_paused();
+
 /* go back in the log history, this also stops the buffer from scrolling down
  * if negative, jump to the back of the log */
 int cheerios_goback(int lines);
@@ -81,11 +121,32 @@ int cheerios_print(const char *fmt, ...);
 /* directly insert a buffer to the output window */
 int cheerios_insert(const char *buf, size_t len);
 
-/* send the file at path over xmodem */
+/* Load output from a previous session. Only the line index is built up front,
+ * lines are parsed when they are first displayed. Takes ownership of buf,
+ * which must come from files_map. cheerios_start has already copied it to the
+ * logs. */
+int cheerios_load(const char *buf, size_t len);
+
+/* Have fn called on the reader thread with everything read from the device
+ * from now on. fn runs with the output locked, so it must be quick and must not
+ * call back into cheerios. Returns -1 if there are too many taps. */
+int cheerios_tap_add(cheerios_tap_fn fn, void *arg);
+
+/* Stop calling fn, once this returns it will not be called again */
+int cheerios_tap_remove(cheerios_tap_fn fn, void *arg);
+
+/* Send the file at path over xmodem. Returns -1 if it fails or another
+ * transfer is already running. */
 int cheerios_xmodem(const char *path, int block_sz);
 
+/* Whether an xmodem transfer is running, reading must be left paused */
+int cheerios_xmodem_active();
+
 int cheerios_print_stats();
 
+/* draw the visible lines into the output window, UI thread only */
+void cheerios_draw();
+
 /* getter for window height */
 int cheerios_getmaxy();
 /* getter for window width */
@@ -0,0 +1,246 @@
+#ifdef __linux__
+/* d_type */
+#  define _DEFAULT_SOURCE
+#endif
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "bstr.h"
+#include "complete.h"
+
+/* directories remembered at once, the least recently used is dropped */
+#define COMPLETE_CACHE_N (8)
+
+typedef struct complete_ent_struct {
+    char *name;
+    int is_dir;
+} complete_ent_t;
+
+typedef struct complete_dir_struct {
+    char *path; /* NULL for an unused slot */
+    time_t mtime;
+    time_t listed; /* when the listing was read */
+    unsigned long used; /* for picking the least recently used */
+    complete_ent_t *ents; /* sorted by name */
+    int ents_n;
+} complete_dir_t;
+
+static complete_dir_t cache[COMPLETE_CACHE_N];
+static unsigned long use_count;
+
+static complete_dir_t *get_dir(const char *path);
+static int read_dir(complete_dir_t *dir, const char *path);
+static void free_dir(complete_dir_t *dir);
+static int ent_cmp(const void *a, const void *b);
+static int lower_bound(complete_dir_t *dir, const char *prefix);
+
+char *
+complete_path(const char *path, int *unique, int *is_dir)
+{
+    const char *slash = strrchr(path, '/');
+    const char *base;
+    char *dir_path;
+    complete_dir_t *dir;
+    size_t base_len;
+    size_t common = 0;
+    const char *first = NULL;
+    int matches = 0;
+
+    *unique = 0;
+    *is_dir = 0;
+
+    if (!slash) {
+        dir_path = strdup(".");
+        base = path;
+    } else if (slash == path) {
+        dir_path = strdup("/");
+        base = slash + 1;
+    } else {
+        dir_path = bstr_print(NULL, "%.*s", (int)(slash - path), path);
+        base = slash + 1;
+    }
+    base_len = strlen(base);
+
+    dir = get_dir(dir_path);
+    free(dir_path);
+    if (!dir)
+        return NULL;
+
+    /* the matches are a contiguous run of the sorted names */
+    for (int i = lower_bound(dir, base); i < dir->ents_n; i++) {
+        const char *name = dir->ents[i].name;
+        size_t n;
+
+        if (strncmp(name, base, base_len))
+            break;
+
+        /* like ls, hidden entries only complete when asked for */
+        if (name[0] == '.' && base[0] != '.')
+            continue;
+
+        if (!first) {
+            first = name;
+            common = strlen(name);
+            *is_dir = dir->ents[i].is_dir;
+        } else {
+            for (n = base_len; n < common && name[n] == first[n]; n++);
+            common = n;
+        }
+
+        matches++;
+    }
+
+    if (matches == 0)
+        return NULL;
+
+    *unique = matches == 1;
+    if (!*unique)
+        *is_dir = 0;
+
+    return bstr_print(NULL, "%.*s", (int)(common - base_len), &first[base_len]);
+}
+
+void
+complete_clear(void)
+{
+    for (int i = 0; i < COMPLETE_CACHE_N; i++) {
+        free_dir(&cache[i]);
+    }
+}
+
+/* Listing of path, from the cache if the directory has not changed since */
+static complete_dir_t *
+get_dir(const char *path)
+{
+    complete_dir_t *dir = NULL;
+    struct stat st;
+
+    if (stat(path, &st) || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    for (int i = 0; i < COMPLETE_CACHE_N; i++) {
+        if (cache[i].path && !strcmp(cache[i].path, path)) {
+            dir = &cache[i];
+            break;
+        }
+    }
+
+    /* mtime only has second resolution, so a listing read in the same second
+     * as a change may have missed part of it */
+    if (dir && dir->mtime == st.st_mtime && dir->listed > dir->mtime) {
+        dir->used = ++use_count;
+        return dir;
+    }
+
+    if (!dir) {
+        dir = &cache[0];
+        for (int i = 1; i < COMPLETE_CACHE_N; i++) {
+            if (cache[i].used < dir->used)
+                dir = &cache[i];
+        }
+    }
+
+    free_dir(dir);
+    if (read_dir(dir, path))
+        return NULL;
+
+    dir->mtime = st.st_mtime;
+    dir->used = ++use_count;
+
+    return dir;
+}
+
+static int
+read_dir(complete_dir_t *dir, const char *path)
+{
+    DIR *d = opendir(path);
+    struct dirent *ent;
+    int cap = 0;
+
+    if (!d)
+        return -1;
+
+    dir->listed = time(NULL);
+
+    while ((ent = readdir(d))) {
+        complete_ent_t *e;
+
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+
+        if (dir->ents_n == cap) {
+            cap = cap ? cap * 2 : 64;
+            dir->ents = realloc(dir->ents, sizeof(complete_ent_t) * cap);
+        }
+
+        e = &dir->ents[dir->ents_n++];
+        e->name = strdup(ent->d_name);
+        e->is_dir = 0;
+
+#ifdef DT_DIR
+        if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK) {
+            e->is_dir = ent->d_type == DT_DIR;
+            continue;
+        }
+#endif
+        /* follows symlinks, a link to a directory completes like one */
+        {
+            char *full = bstr_print(NULL, "%s/%s", path, ent->d_name);
+            struct stat st;
+
+            e->is_dir = !stat(full, &st) && S_ISDIR(st.st_mode);
+            free(full);
+        }
+    }
+
+    closedir(d);
+
+    qsort(dir->ents, dir->ents_n, sizeof(complete_ent_t), ent_cmp);
+    dir->path = strdup(path);
+
+    return 0;
+}
+
+static void
+free_dir(complete_dir_t *dir)
+{
+    for (int i = 0; i < dir->ents_n; i++) {
+        free(dir->ents[i].name);
+    }
+    free(dir->ents);
+    free(dir->path);
+    memset(dir, 0, sizeof(complete_dir_t));
+}
+
+static int
+ent_cmp(const void *a, const void *b)
+{
+    return strcmp(
+        ((const complete_ent_t *)a)->name,
+        ((const complete_ent_t *)b)->name
+    );
+}
+
+/* Index of the first name not sorting before prefix */
+static int
+lower_bound(complete_dir_t *dir, const char *prefix)
+{
+    int lo = 0;
+    int hi = dir->ents_n;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (strcmp(dir->ents[mid].name, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
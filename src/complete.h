@@ -0,0 +1,16 @@
+#ifndef _COMPLETE_H_
+#define _COMPLETE_H_
+
+/* File path completion without a shell. Directory listings are kept sorted in
+ * a small cache and only read again once the directory's mtime changes. */
+
+/* Find the text that completes path as far as every match agrees. Returns a
+ * malloc'd string to append (empty if there is nothing to add), or NULL if
+ * nothing matches. *unique is set if exactly one entry matched and *is_dir if
+ * that entry is a directory. */
+char *complete_path(const char *path, int *unique, int *is_dir);
+
+/* Drop every cached listing */
+void complete_clear(void);
+
+#endif /* _COMPLETE_H_ */
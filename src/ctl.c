@@ -0,0 +1,712 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef __MINGW32__
+#  include <poll.h>
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <unistd.h>
+#endif
+
+#include "bstr.h"
+#include "cheerios.h"
+#include "ctl.h"
+#include "paths.h"
+#include "probe.h"
+#include "runner.h"
+#include "textsend.h"
+#include "txq.h"
+
+#ifdef __MINGW32__
+
+/* no unix sockets to serve on */
+int
+ctl_start(bytenuts_t *bytenuts)
+{
+    return 0;
+}
+
+int
+ctl_stop()
+{
+    return 0;
+}
+
+serial_t
+ctl_attach(const char *session)
+{
+    printf("Attaching needs unix sockets\r\n");
+    return SERIAL_INVALID;
+}
+
+#else
+
+static ctl_t ctl = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .listen_fd = -1,
+};
+
+static void *ctl_thread(void *arg);
+static int open_socket(const char *path);
+static void accept_client();
+static void drop_client(int idx);
+static int read_client(ctl_client_t *client);
+static void run_command(ctl_client_t *client, char *line);
+static void write_client(ctl_client_t *client);
+static void client_tx(ctl_client_t *client, const char *buf, size_t len);
+static void flush_tx(ctl_client_t *client);
+static void reply(ctl_client_t *client, const char *fmt, ...);
+static void rx_tap(const char *buf, size_t len, void *arg);
+static void wake();
+
+int
+ctl_start(bytenuts_t *bytenuts)
+{
+    if (!bytenuts->config.control)
+        return 0;
+
+    ctl.config = &bytenuts->config;
+    ctl.path = paths_ctl_socket(bytenuts->config.session);
+    if (!ctl.path)
+        return -1;
+
+    ctl.listen_fd = open_socket(ctl.path);
+    if (ctl.listen_fd < 0) {
+        free(ctl.path);
+        ctl.path = NULL;
+        return -1;
+    }
+
+    if (pipe(ctl.wake)) {
+        close(ctl.listen_fd);
+        unlink(ctl.path);
+        return -1;
+    }
+    fcntl(ctl.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(ctl.wake[1], F_SETFL, O_NONBLOCK);
+
+    ctl.ring = malloc(CTL_RING_SZ);
+
+    cheerios_tap_add(rx_tap, NULL);
+
+    ctl.running = 1;
+    if (pthread_create(&ctl.thr, NULL, ctl_thread, NULL)) {
+        ctl.running = 0;
+        cheerios_tap_remove(rx_tap, NULL);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+ctl_stop()
+{
+    if (!ctl.running)
+        return 0;
+
+    cheerios_tap_remove(rx_tap, NULL);
+
+    ctl.running = 0;
+    wake();
+    pthread_join(ctl.thr, NULL);
+
+    while (ctl.clients_n > 0) {
+        ctl_client_t *client = &ctl.clients[ctl.clients_n - 1];
+
+        /* a viewer can not tell the socket closing from a quiet device */
+        if (client->attached) {
+            write_client(client);
+            reply(client, "\r\n[%s is no longer shared]\r\n", ctl.config->serial_path);
+        }
+        drop_client(ctl.clients_n - 1);
+    }
+    free(ctl.ring);
+    ctl.ring = NULL;
+
+    close(ctl.listen_fd);
+    close(ctl.wake[0]);
+    close(ctl.wake[1]);
+    unlink(ctl.path);
+    free(ctl.path);
+    ctl.path = NULL;
+
+    return 0;
+}
+
+serial_t
+ctl_attach(const char *session)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char *path = paths_ctl_socket(session);
+    char resp[64];
+    size_t resp_len = 0;
+    int fd;
+
+    if (!path)
+        return SERIAL_INVALID;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Control socket path %s is too long\r\n", path);
+        free(path);
+        return SERIAL_INVALID;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        printf("No bytenuts is sharing session %s at %s\r\n", session, path);
+        goto ctl_attach_fail;
+    }
+
+    if (write(fd, "attach\n", 7) != 7)
+        goto ctl_attach_fail;
+
+    /* the reply, anything after it is output */
+    while (resp_len < sizeof(resp) - 1) {
+        struct pollfd fds = { .fd = fd, .events = POLLIN };
+
+        if (poll(&fds, 1, 2000) <= 0 || read(fd, &resp[resp_len], 1) != 1)
+            break;
+        if (resp[resp_len++] == '\n')
+            break;
+    }
+    resp[resp_len] = '\0';
+
+    if (strcmp(resp, "ok\n")) {
+        printf("Could not attach to %s\r\n", path);
+        goto ctl_attach_fail;
+    }
+
+    /* behave like the serial ports, which are opened non-blocking */
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    /* a write after the owner has gone must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    free(path);
+    return fd;
+
+ctl_attach_fail:
+    if (fd >= 0)
+        close(fd);
+    free(path);
+    return SERIAL_INVALID;
+}
+
+static void *
+ctl_thread(void *arg)
+{
+    struct pollfd fds[CTL_CLIENTS_MAX + 2];
+
+    while (ctl.running) {
+        int n = 0;
+        int waiting = 0;
+
+        fds[n].fd = ctl.wake[0];
+        fds[n++].events = POLLIN;
+        fds[n].fd = ctl.listen_fd;
+        fds[n++].events = POLLIN;
+
+        pthread_mutex_lock(&ctl.lock);
+        for (int i = 0; i < ctl.clients_n; i++) {
+            ctl_client_t *client = &ctl.clients[i];
+
+            flush_tx(client);
+            waiting |= client->tx_ends_n > 0;
+
+            /* a client whose input can not go anywhere is left unread */
+            fds[n].fd = client->fd;
+            fds[n++].events = (client->tx_len < CTL_TX_MAX ? POLLIN : 0) | (
+                client->subscribed && client->pos < ctl.seq ? POLLOUT : 0
+            );
+        }
+        pthread_mutex_unlock(&ctl.lock);
+
+        /* nothing says when the TX queue has room again, look now and then */
+        if (poll(fds, n, waiting ? CTL_TX_RETRY_MS : -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[0].revents) {
+            char buf[64];
+
+            pthread_mutex_lock(&ctl.lock);
+            while (read(ctl.wake[0], buf, sizeof(buf)) > 0);
+            ctl.woken = 0;
+            pthread_mutex_unlock(&ctl.lock);
+        }
+
+        /* backwards, a client dropped is replaced by the last one */
+        for (int i = n - 3; i >= 0; i--) {
+            short revents = fds[i + 2].revents;
+
+            if ((revents & (POLLIN | POLLHUP | POLLERR)) && read_client(&ctl.clients[i])) {
+                drop_client(i);
+                continue;
+            }
+
+            if (revents & POLLOUT)
+                write_client(&ctl.clients[i]);
+        }
+
+        if (fds[1].revents & POLLIN)
+            accept_client();
+    }
+
+    return NULL;
+}
+
+/* Bind the socket at path, unless another instance is serving on it. Stale
+ * sockets from instances that are gone are replaced. */
+static int
+open_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        cheerios_print("Control socket path %s is too long\r\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        cheerios_print("Control socket %s is in use by another instance\r\n", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    if (
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(fd, CTL_CLIENTS_MAX)
+    ) {
+        cheerios_print("Could not open control socket %s\r\n", path);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    return fd;
+}
+
+static void
+accept_client()
+{
+    ctl_client_t *client;
+    int fd = accept(ctl.listen_fd, NULL, NULL);
+
+    if (fd < 0)
+        return;
+
+    if (ctl.clients_n == CTL_CLIENTS_MAX) {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_lock(&ctl.lock);
+    client = &ctl.clients[ctl.clients_n++];
+    memset(client, 0, sizeof(ctl_client_t));
+    client->fd = fd;
+    pthread_mutex_unlock(&ctl.lock);
+}
+
+static void
+drop_client(int idx)
+{
+    pthread_mutex_lock(&ctl.lock);
+
+    close(ctl.clients[idx].fd);
+    ctl.streams_n -= ctl.clients[idx].subscribed;
+    free(ctl.clients[idx].tx);
+    free(ctl.clients[idx].tx_ends);
+
+    ctl.clients_n--;
+    if (idx != ctl.clients_n)
+        ctl.clients[idx] = ctl.clients[ctl.clients_n];
+
+    pthread_mutex_unlock(&ctl.lock);
+}
+
+/* Take in what the client sent and run any whole commands. Returns -1 once
+ * the client has gone. */
+static int
+read_client(ctl_client_t *client)
+{
+    char buf[1024];
+    ssize_t n = read(client->fd, buf, sizeof(buf));
+
+    if (n == 0)
+        return -1;
+    if (n < 0)
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+    /* typed into an attached viewer */
+    if (client->attached) {
+        client_tx(client, buf, n);
+        return 0;
+    }
+
+    if (client->subscribed)
+        return 0;
+
+    for (ssize_t i = 0; i < n; i++) {
+        /* anything after an attach in the same read is already input */
+        if (client->attached) {
+            client_tx(client, &buf[i], n - i);
+            break;
+        }
+        if (client->subscribed)
+            break;
+
+        if (buf[i] == '\n') {
+            client->line[client->line_len] = '\0';
+            if (client->line_len > 0 && client->line[client->line_len - 1] == '\r')
+                client->line[client->line_len - 1] = '\0';
+
+            run_command(client, client->line);
+            client->line_len = 0;
+        } else if (client->line_len < CTL_LINE_MAX - 1) {
+            client->line[client->line_len++] = buf[i];
+        }
+    }
+
+    return 0;
+}
+
+static void
+run_command(ctl_client_t *client, char *line)
+{
+    char *arg = line + strcspn(line, " ");
+
+    if (*arg) {
+        *arg = '\0';
+        arg++;
+    }
+
+    if (!strcmp(line, "send")) {
+        const char *ending = ctl.config->no_crlf ? "\n" : "\r\n";
+        size_t len;
+        char *out = bstr_unescape(arg, strlen(arg), &len);
+
+        out = realloc(out, len + strlen(ending));
+        memcpy(&out[len], ending, strlen(ending));
+
+        client_tx(client, out, len + strlen(ending));
+        free(out);
+        reply(client, "ok\n");
+    }
+    else if (!strcmp(line, "hex")) {
+        char *out = malloc(strlen(arg) / 2 + 1);
+        size_t len = 0;
+        int digits = 0;
+        int bad = 0;
+
+        for (char *p = arg; *p; p++) {
+            char digit[2] = { *p, '\0' };
+            char *inval;
+            long val;
+
+            if (*p == ' ')
+                continue;
+
+            val = strtol(digit, &inval, 16);
+            if (inval == digit) {
+                bad = 1;
+                break;
+            }
+
+            if (digits++ % 2 == 0)
+                out[len] = val << 4;
+            else
+                out[len++] |= val;
+        }
+
+        if (bad || digits % 2 || len == 0) {
+            reply(client, "error bad hex '%s'\n", arg);
+        } else {
+            client_tx(client, out, len);
+            reply(client, "ok\n");
+        }
+        free(out);
+    }
+    else if (
+        (!strcmp(line, "pause") || !strcmp(line, "resume") ||
+         !strcmp(line, "xmodem") || !strcmp(line, "xmodem1k")) &&
+        cheerios_xmodem_active()
+    ) {
+        /* the transfer reads the ACKs itself */
+        reply(client, "error busy\n");
+    }
+    else if (
+        (!strcmp(line, "xmodem") || !strcmp(line, "xmodem1k")) &&
+        (textsend_active() || runner_active() || probe_active())
+    ) {
+        /* their bytes would land in the middle of the blocks */
+        reply(client, "error busy\n");
+    }
+    else if (!strcmp(line, "pause")) {
+        cheerios_pause();
+        reply(client, "ok\n");
+    }
+    else if (!strcmp(line, "resume")) {
+        cheerios_resume();
+        reply(client, "ok\n");
+    }
+    else if (!strcmp(line, "xmodem") || !strcmp(line, "xmodem1k")) {
+        /* holds up the other clients, but the output is paused anyway */
+        if (cheerios_xmodem(arg, line[6] ? 1024 : 128))
+            reply(client, "error xmodem of '%s' failed\n", arg);
+        else
+            reply(client, "ok\n");
+    }
+    else if (!strcmp(line, "stats")) {
+        uint64_t dropped = 0;
+        uint64_t rx;
+        int subscribers = 0;
+        int attached = 0;
+        int clients;
+
+        pthread_mutex_lock(&ctl.lock);
+        rx = ctl.rx_total;
+        clients = ctl.clients_n;
+        for (int i = 0; i < ctl.clients_n; i++) {
+            subscribers += ctl.clients[i].subscribed && !ctl.clients[i].attached;
+            attached += ctl.clients[i].attached;
+            dropped += ctl.clients[i].dropped;
+        }
+        pthread_mutex_unlock(&ctl.lock);
+
+        reply(
+            client,
+            "serial_path %s\n"
+            "rx_bytes %llu\n"
+            "tx_bytes %llu\n"
+            "tx_pending %llu\n"
+            "paused %d\n"
+            "clients %d\n"
+            "subscribers %d\n"
+            "attached %d\n"
+            "dropped %llu\n"
+            "ok\n",
+            ctl.config->serial_path,
+            (unsigned long long)rx,
+            (unsigned long long)txq_written(),
+            (unsigned long long)txq_pending(),
+            cheerios_paused(),
+            clients,
+            subscribers,
+            attached,
+            (unsigned long long)dropped
+        );
+    }
+    else if (!strcmp(line, "subscribe") || !strcmp(line, "attach")) {
+        reply(client, "ok\n");
+
+        /* the output from here on */
+        pthread_mutex_lock(&ctl.lock);
+        client->pos = ctl.seq;
+        client->subscribed = 1;
+        client->attached = line[0] == 'a';
+        ctl.streams_n++;
+        pthread_mutex_unlock(&ctl.lock);
+    }
+    else if (*line) {
+        reply(client, "error unknown command '%s'\n", line);
+    }
+}
+
+/* Send the client as much of the output it has not had yet as the socket
+ * takes, straight out of the ring */
+static void
+write_client(ctl_client_t *client)
+{
+    pthread_mutex_lock(&ctl.lock);
+
+    if (ctl.seq - client->pos > CTL_RING_SZ) {
+        client->dropped += ctl.seq - client->pos - CTL_RING_SZ;
+        client->pos = ctl.seq - CTL_RING_SZ;
+    }
+
+    while (client->pos < ctl.seq) {
+        size_t off = client->pos % CTL_RING_SZ;
+        size_t chunk = ctl.seq - client->pos;
+        ssize_t n;
+
+        if (off + chunk > CTL_RING_SZ)
+            chunk = CTL_RING_SZ - off;
+
+        n = send(client->fd, &ctl.ring[off], chunk, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+
+        client->pos += n;
+    }
+
+    pthread_mutex_unlock(&ctl.lock);
+}
+
+/* Answer a command. Replies are short, so the socket is waited on for a
+ * little if it is full rather than queueing them. */
+static void
+reply(ctl_client_t *client, const char *fmt, ...)
+{
+    char *msg;
+    size_t len;
+    size_t p = 0;
+    va_list ap;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    msg = malloc(len + 1);
+    va_start(ap, fmt);
+    vsnprintf(msg, len + 1, fmt, ap);
+    va_end(ap);
+
+    while (p < len) {
+        ssize_t n = send(client->fd, &msg[p], len - p, MSG_NOSIGNAL);
+
+        if (n > 0) {
+            p += n;
+        } else if (n < 0 && errno == EAGAIN) {
+            struct pollfd fds = { .fd = client->fd, .events = POLLOUT };
+
+            if (poll(&fds, 1, 1000) <= 0)
+                break;
+        } else if (n < 0 && errno != EINTR) {
+            break;
+        }
+    }
+
+    free(msg);
+}
+
+/* Runs on the reader thread, put the output in the ring once for all the
+ * clients */
+/* Send buf to the device as one command, after anything of the client's
+ * still waiting. Never blocks, what does not fit in the TX queue waits with
+ * the client. */
+static void
+client_tx(ctl_client_t *client, const char *buf, size_t len)
+{
+    if (client->tx_len + len > client->tx_cap) {
+        client->tx_cap = client->tx_len + len;
+        client->tx = realloc(client->tx, client->tx_cap);
+    }
+    if (client->tx_ends_n == client->tx_ends_cap) {
+        client->tx_ends_cap = client->tx_ends_cap ? client->tx_ends_cap * 2 : 8;
+        client->tx_ends = realloc(client->tx_ends, sizeof(size_t) * client->tx_ends_cap);
+    }
+
+    memcpy(&client->tx[client->tx_len], buf, len);
+    client->tx_len += len;
+    client->tx_ends[client->tx_ends_n++] = client->tx_len;
+
+    flush_tx(client);
+}
+
+/* Move as much of the client's waiting input into the TX queue as it takes
+ * right now, keeping the commands apart */
+static void
+flush_tx(ctl_client_t *client)
+{
+    while (client->tx_ends_n > 0) {
+        size_t end = client->tx_ends[0];
+
+        if (end > 0) {
+            size_t n = txq_write_some(client->tx, end);
+
+            memmove(client->tx, &client->tx[n], client->tx_len - n);
+            client->tx_len -= n;
+            for (int i = 0; i < client->tx_ends_n; i++)
+                client->tx_ends[i] -= n;
+
+            if (n < end)
+                return;
+        }
+
+        if (txq_try_end_cmd())
+            return;
+
+        client->tx_ends_n--;
+        memmove(client->tx_ends, &client->tx_ends[1], sizeof(size_t) * client->tx_ends_n);
+    }
+}
+
+static void
+rx_tap(const char *buf, size_t len, void *arg)
+{
+    uint64_t seq;
+    size_t n = len;
+    size_t off;
+
+    pthread_mutex_lock(&ctl.lock);
+
+    ctl.rx_total += len;
+
+    /* nobody to keep it for, new clients start from the next output */
+    if (ctl.streams_n == 0) {
+        pthread_mutex_unlock(&ctl.lock);
+        return;
+    }
+
+    /* only the newest CTL_RING_SZ bytes can be kept */
+    seq = ctl.seq;
+    if (n > CTL_RING_SZ) {
+        seq += n - CTL_RING_SZ;
+        buf += n - CTL_RING_SZ;
+        n = CTL_RING_SZ;
+    }
+
+    off = seq % CTL_RING_SZ;
+    if (off + n > CTL_RING_SZ) {
+        size_t first = CTL_RING_SZ - off;
+
+        memcpy(&ctl.ring[off], buf, first);
+        memcpy(ctl.ring, &buf[first], n - first);
+    } else {
+        memcpy(&ctl.ring[off], buf, n);
+    }
+    ctl.seq += len;
+
+    pthread_mutex_unlock(&ctl.lock);
+
+    wake();
+}
+
+/* Get the thread out of poll so it looks at the clients again */
+static void
+wake()
+{
+    int poke;
+
+    pthread_mutex_lock(&ctl.lock);
+    poke = !ctl.woken;
+    ctl.woken = 1;
+    pthread_mutex_unlock(&ctl.lock);
+
+    if (poke && write(ctl.wake[1], "w", 1) < 0) {
+        /* the pipe is full, so a wake up is already pending */
+    }
+}
+
+#endif /* __MINGW32__ */
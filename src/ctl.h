@@ -0,0 +1,97 @@
+#ifndef _CTL_H_
+#define _CTL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "bytenuts.h"
+#include "serial.h"
+
+/* Control socket at ~/.config/bytenuts/<session>.sock for driving a running
+ * instance from other programs. Commands are lines of text, each answered with
+ * "ok" or "error <reason>":
+ *
+ *   send <text>        queue text and the line ending (escapes as in bstr_unescape)
+ *   hex <digits>       queue the bytes given in hex, spaces are skipped
+ *   pause              stop reading from the device
+ *   resume             start reading from the device again
+ *   xmodem <path>      send a file over xmodem, xmodem1k for 1K payloads.
+ *                      While one runs, xmodem, pause and resume get
+ *                      "error busy", as does xmodem during a text send,
+ *                      script or probe.
+ *   stats              "<name> <value>" lines before the ok
+ *   subscribe          after the ok, the connection only carries the output
+ *                      read from the device, further input is ignored
+ *   attach             like subscribe, but further input is sent to the
+ *                      device, which is how bytenuts --attach shares a port
+ *
+ * The output is copied once into a ring shared by every client, each client
+ * keeps its own position in it. A client more than the ring behind skips to
+ * the oldest output still held, so it never holds up the reader or the other
+ * clients. Input for the device waits with its client while the TX queue is
+ * full, and only that client stops being read.
+ */
+
+/* clients connected at once, more are turned away */
+#define CTL_CLIENTS_MAX (16)
+
+/* longest command line */
+#define CTL_LINE_MAX (4096)
+
+/* output kept for the clients, a client further behind loses the oldest */
+#define CTL_RING_SZ (1024 * 1024)
+
+/* input a client may have waiting for room in the TX queue before it stops
+ * being read, and how often that is retried */
+#define CTL_TX_MAX (16 * 1024)
+#define CTL_TX_RETRY_MS (10)
+
+typedef struct ctl_client_struct {
+    int fd;
+    char line[CTL_LINE_MAX]; /* command being received */
+    size_t line_len;
+    int subscribed; /* gets the output */
+    int attached; /* and its input goes to the device */
+    uint64_t pos; /* output sent to it so far, compared against seq */
+    uint64_t dropped; /* output skipped because the client was behind */
+    /* commands for the device not yet in the TX queue, tx_ends[i] is where
+     * the ith ends in tx */
+    char *tx;
+    size_t tx_len;
+    size_t tx_cap;
+    size_t *tx_ends;
+    int tx_ends_n;
+    int tx_ends_cap;
+} ctl_client_t;
+
+typedef struct ctl_struct {
+    /* guards the clients, the output tap takes it on the reader thread */
+    pthread_mutex_t lock;
+    volatile int running;
+    pthread_t thr;
+    int listen_fd;
+    int wake[2]; /* pipe, written to get the thread out of poll */
+    int woken; /* a wake up is already in the pipe */
+    char *path;
+    bytenuts_config_t *config;
+    ctl_client_t clients[CTL_CLIENTS_MAX];
+    int clients_n;
+    int streams_n; /* clients subscribed or attached */
+    char *ring; /* the latest output, CTL_RING_SZ */
+    uint64_t seq; /* output put in the ring so far, ring[seq % size] is next */
+    uint64_t rx_total; /* bytes read from the device since the start */
+} ctl_t;
+
+/* Open the control socket and start serving it, does nothing if disabled in
+ * the config or if another instance has the session's socket */
+int ctl_start(bytenuts_t *bytenuts);
+
+/* stop the thread, disconnect all clients and remove the socket */
+int ctl_stop();
+
+/* Attach to the instance serving the session's control socket. Returns a
+ * connected socket that can be used in place of a serial port, or
+ * SERIAL_INVALID with the reason printed. */
+serial_t ctl_attach(const char *session);
+
+#endif /* _CTL_H_ */
@@ -0,0 +1,135 @@
+#ifdef __linux__
+/* copy_file_range */
+#  define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __MINGW32__
+#  include <windows.h>
+#else
+#  include <sys/mman.h>
+#endif
+
+#include "files.h"
+
+void *
+files_map(int fd, size_t len)
+{
+#ifdef __MINGW32__
+    char *buf;
+    size_t p = 0;
+
+    if (len == 0)
+        return NULL;
+
+    buf = malloc(len);
+    if (!buf)
+        return NULL;
+
+    lseek(fd, 0, SEEK_SET);
+    while (p < len) {
+        ssize_t ret = read(fd, &buf[p], len - p);
+
+        if (ret <= 0) {
+            free(buf);
+            return NULL;
+        }
+        p += ret;
+    }
+
+    return buf;
+#else
+    void *buf;
+
+    if (len == 0)
+        return NULL;
+
+    buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED)
+        return NULL;
+
+    /* the whole file gets indexed front to back */
+    madvise(buf, len, MADV_SEQUENTIAL);
+
+    return buf;
+#endif
+}
+
+void
+files_unmap(void *buf, size_t len)
+{
+    if (!buf)
+        return;
+
+#ifdef __MINGW32__
+    free(buf);
+#else
+    munmap(buf, len);
+#endif
+}
+
+int
+files_copy(int dst_fd, int src_fd, size_t len)
+{
+    char buf[65536];
+    off_t off = 0;
+
+#ifdef __linux__
+    while ((size_t)off < len) {
+        ssize_t ret = copy_file_range(src_fd, &off, dst_fd, NULL, len - off, 0);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+    }
+
+    if ((size_t)off == len)
+        return 0;
+#endif
+
+    /* fall back to copying through userspace */
+    if (lseek(src_fd, off, SEEK_SET) < 0)
+        return -1;
+
+    while ((size_t)off < len) {
+        size_t chunk = len - off;
+        ssize_t ret;
+
+        if (chunk > sizeof(buf))
+            chunk = sizeof(buf);
+
+        ret = read(src_fd, buf, chunk);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+
+        for (ssize_t p = 0; p < ret;) {
+            ssize_t wr = write(dst_fd, &buf[p], ret - p);
+
+            if (wr < 0 && errno == EINTR)
+                continue;
+            if (wr < 0)
+                return -1;
+            p += wr;
+        }
+
+        off += ret;
+    }
+
+    return 0;
+}
+
+int
+files_replace(const char *from, const char *to)
+{
+#ifdef __MINGW32__
+    return MoveFileEx(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(from, to);
+#endif
+}
@@ -0,0 +1,20 @@
+#ifndef _FILES_H_
+#define _FILES_H_
+
+#include <stdio.h>
+
+/* Map the first len bytes of fd read-only into memory (read into a buffer
+ * where mmap is not available). Returns NULL on failure. */
+void *files_map(int fd, size_t len);
+
+/* Release a buffer returned by files_map */
+void files_unmap(void *buf, size_t len);
+
+/* Append the first len bytes of src_fd onto dst_fd, in kernel where possible.
+ * Returns 0 on success. */
+int files_copy(int dst_fd, int src_fd, size_t len);
+
+/* Atomically replace the file at to with the file at from */
+int files_replace(const char *from, const char *to);
+
+#endif /* _FILES_H_ */
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gapbuf.h"
+
+#define GAPBUF_MIN_CAP (256)
+
+typedef struct gapbuf_struct {
+    char *buf;
+    size_t cap;
+    size_t gap_start; /* text is [0, gap_start) and [gap_end, cap) */
+    size_t gap_end;
+    size_t pos; /* cursor, the gap is only moved here on an edit */
+} gapbuf_t;
+
+static void gap_move(gapbuf_t *gb, size_t to);
+static void gap_reserve(gapbuf_t *gb, size_t len);
+
+gapbuf_handle
+gapbuf_create(void)
+{
+    gapbuf_t *gb = calloc(1, sizeof(gapbuf_t));
+
+    gb->cap = GAPBUF_MIN_CAP;
+    gb->buf = malloc(gb->cap);
+    gb->gap_end = gb->cap;
+
+    return gb;
+}
+
+size_t
+gapbuf_len(gapbuf_handle gb)
+{
+    return gb->cap - (gb->gap_end - gb->gap_start);
+}
+
+size_t
+gapbuf_pos(gapbuf_handle gb)
+{
+    return gb->pos;
+}
+
+void
+gapbuf_move(gapbuf_handle gb, size_t pos)
+{
+    size_t len = gapbuf_len(gb);
+
+    gb->pos = pos > len ? len : pos;
+}
+
+void
+gapbuf_insert(gapbuf_handle gb, const char *buf, size_t len)
+{
+    if (len == 0)
+        return;
+
+    gap_move(gb, gb->pos);
+    gap_reserve(gb, len);
+
+    memcpy(&gb->buf[gb->gap_start], buf, len);
+    gb->gap_start += len;
+    gb->pos += len;
+}
+
+int
+gapbuf_backspace(gapbuf_handle gb)
+{
+    if (gb->pos == 0)
+        return 0;
+
+    gap_move(gb, gb->pos);
+    gb->gap_start--;
+    gb->pos--;
+
+    return 1;
+}
+
+int
+gapbuf_delete(gapbuf_handle gb)
+{
+    if (gb->pos == gapbuf_len(gb))
+        return 0;
+
+    gap_move(gb, gb->pos);
+    gb->gap_end++;
+
+    return 1;
+}
+
+void
+gapbuf_set(gapbuf_handle gb, const char *str)
+{
+    gapbuf_clear(gb);
+    gapbuf_insert(gb, str, strlen(str));
+}
+
+void
+gapbuf_clear(gapbuf_handle gb)
+{
+    gb->gap_start = 0;
+    gb->gap_end = gb->cap;
+    gb->pos = 0;
+}
+
+char
+gapbuf_at(gapbuf_handle gb, size_t idx)
+{
+    if (idx < gb->gap_start)
+        return gb->buf[idx];
+    return gb->buf[idx + (gb->gap_end - gb->gap_start)];
+}
+
+void
+gapbuf_copy(gapbuf_handle gb, char *dst)
+{
+    memcpy(dst, gb->buf, gb->gap_start);
+    memcpy(&dst[gb->gap_start], &gb->buf[gb->gap_end], gb->cap - gb->gap_end);
+}
+
+const char *
+gapbuf_str(gapbuf_handle gb)
+{
+    gap_move(gb, gapbuf_len(gb));
+    gap_reserve(gb, 1);
+    gb->buf[gb->gap_start] = '\0';
+
+    return gb->buf;
+}
+
+void
+gapbuf_destroy(gapbuf_handle gb)
+{
+    if (!gb)
+        return;
+
+    free(gb->buf);
+    free(gb);
+}
+
+/* Move the gap so it starts at text position to */
+static void
+gap_move(gapbuf_t *gb, size_t to)
+{
+    if (to < gb->gap_start) {
+        size_t n = gb->gap_start - to;
+
+        memmove(&gb->buf[gb->gap_end - n], &gb->buf[to], n);
+        gb->gap_start -= n;
+        gb->gap_end -= n;
+    } else if (to > gb->gap_start) {
+        size_t n = to - gb->gap_start;
+
+        memmove(&gb->buf[gb->gap_start], &gb->buf[gb->gap_end], n);
+        gb->gap_start += n;
+        gb->gap_end += n;
+    }
+}
+
+/* Make sure the gap can take len more bytes, doubling the buffer if not */
+static void
+gap_reserve(gapbuf_t *gb, size_t len)
+{
+    size_t tail_len;
+    size_t cap;
+
+    if (gb->gap_end - gb->gap_start >= len)
+        return;
+
+    cap = gb->cap;
+    while (cap - gapbuf_len(gb) < len)
+        cap *= 2;
+
+    tail_len = gb->cap - gb->gap_end;
+    gb->buf = realloc(gb->buf, cap);
+    memmove(&gb->buf[cap - tail_len], &gb->buf[gb->gap_end], tail_len);
+
+    gb->gap_end = cap - tail_len;
+    gb->cap = cap;
+}
@@ -0,0 +1,52 @@
+#ifndef _GAPBUF_H_
+#define _GAPBUF_H_
+
+#include <stddef.h>
+
+/* Growable text buffer for line editing. The free space (the gap) sits at the
+ * last edit, so typing and deleting at the cursor are O(1) amortized and only
+ * an edit elsewhere moves the gap. */
+typedef struct gapbuf_struct * gapbuf_handle;
+
+/* Create an empty buffer with the cursor at 0 */
+gapbuf_handle gapbuf_create(void);
+
+/* Number of characters in the buffer */
+size_t gapbuf_len(gapbuf_handle gb);
+
+/* Cursor position, in the range [0, len] */
+size_t gapbuf_pos(gapbuf_handle gb);
+
+/* Move the cursor, clamped to the end of the buffer */
+void gapbuf_move(gapbuf_handle gb, size_t pos);
+
+/* Insert len bytes at the cursor, leaving the cursor after them */
+void gapbuf_insert(gapbuf_handle gb, const char *buf, size_t len);
+
+/* Delete the character before the cursor. Returns 0 if there was none. */
+int gapbuf_backspace(gapbuf_handle gb);
+
+/* Delete the character at the cursor. Returns 0 if there was none. */
+int gapbuf_delete(gapbuf_handle gb);
+
+/* Replace the contents with str and put the cursor at the end */
+void gapbuf_set(gapbuf_handle gb, const char *str);
+
+/* Remove everything */
+void gapbuf_clear(gapbuf_handle gb);
+
+/* Character at position idx, which must be less than the length */
+char gapbuf_at(gapbuf_handle gb, size_t idx);
+
+/* Copy the contents to dst, which must hold gapbuf_len bytes. No terminator is
+ * added. */
+void gapbuf_copy(gapbuf_handle gb, char *dst);
+
+/* The contents as a NUL terminated string, valid until the next edit. Moves
+ * the gap to the end. */
+const char *gapbuf_str(gapbuf_handle gb);
+
+/* Free the buffer */
+void gapbuf_destroy(gapbuf_handle gb);
+
+#endif /* _GAPBUF_H_ */
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hist.h"
+
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct hist_struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t n;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} hist_t;
+
+static int bucket_of(uint64_t val);
+static uint64_t bucket_top(int idx);
+
+hist_handle
+hist_create(void)
+{
+    return calloc(1, sizeof(hist_t));
+}
+
+void
+hist_add(hist_handle hist, uint64_t val)
+{
+    hist->counts[bucket_of(val)]++;
+    if (hist->n == 0 || val < hist->min)
+        hist->min = val;
+    if (val > hist->max)
+        hist->max = val;
+    hist->sum += val;
+    hist->n++;
+}
+
+uint64_t
+hist_count(hist_handle hist)
+{
+    return hist->n;
+}
+
+uint64_t
+hist_min(hist_handle hist)
+{
+    return hist->min;
+}
+
+uint64_t
+hist_max(hist_handle hist)
+{
+    return hist->max;
+}
+
+double
+hist_mean(hist_handle hist)
+{
+    return hist->n ? hist->sum / hist->n : 0;
+}
+
+uint64_t
+hist_percentile(hist_handle hist, double pct)
+{
+    uint64_t want;
+    uint64_t seen = 0;
+
+    if (hist->n == 0)
+        return 0;
+
+    /* the rank of the value, counting from 1 */
+    want = (uint64_t)(pct / 100.0 * hist->n + 0.5);
+    if (want < 1)
+        want = 1;
+    if (want > hist->n)
+        want = hist->n;
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= want) {
+            uint64_t top = bucket_top(i);
+
+            return top < hist->max ? top : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+uint64_t
+hist_count_below(hist_handle hist, uint64_t val)
+{
+    uint64_t ret = 0;
+    int end;
+
+    if (val == 0)
+        return 0;
+
+    /* the bucket val starts, the ones before it are all below */
+    end = bucket_of(val);
+    if (bucket_of(val - 1) == end)
+        end++;
+
+    for (int i = 0; i < end; i++)
+        ret += hist->counts[i];
+
+    return ret;
+}
+
+void
+hist_reset(hist_handle hist)
+{
+    memset(hist, 0, sizeof(hist_t));
+}
+
+void
+hist_destroy(hist_handle hist)
+{
+    free(hist);
+}
+
+char *
+hist_fmt_us(char *buf, size_t sz, uint64_t us)
+{
+    if (us < 1000)
+        snprintf(buf, sz, "%lluus", (unsigned long long)us);
+    else if (us < 1000000)
+        snprintf(buf, sz, "%.1fms", us / 1e3);
+    else
+        snprintf(buf, sz, "%.2fs", us / 1e6);
+
+    return buf;
+}
+
+/* Values below HIST_SUB get a bucket each. Above that the top HIST_SUB_BITS
+ * bits after the leading one pick the bucket within its power of 2. */
+static int
+bucket_of(uint64_t val)
+{
+    int msb = 0;
+
+    if (val < HIST_SUB)
+        return val;
+    if (val >> HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+
+    for (uint64_t v = val; v > 1; v >>= 1)
+        msb++;
+
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+        ((val >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* largest value that lands in bucket idx */
+static uint64_t
+bucket_top(int idx)
+{
+    int msb;
+    uint64_t low;
+
+    if (idx < HIST_SUB)
+        return idx;
+
+    msb = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    low = (uint64_t)(HIST_SUB + idx % HIST_SUB) << (msb - HIST_SUB_BITS);
+
+    return low + ((uint64_t)1 << (msb - HIST_SUB_BITS)) - 1;
+}
@@ -0,0 +1,50 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Latency histogram with log-linear buckets, as in HdrHistogram: every power
+ * of 2 is split into HIST_SUB equal buckets, so any recorded value is known to
+ * within 1/HIST_SUB of itself however large it is, in a fixed amount of
+ * memory. Values are unitless, callers use microseconds. */
+typedef struct hist_struct * hist_handle;
+
+#define HIST_SUB_BITS (5)
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+/* values from 2^HIST_MAX_BITS up are counted in the last bucket */
+#define HIST_MAX_BITS (40)
+
+/* Create an empty histogram */
+hist_handle hist_create(void);
+
+/* Count one value */
+void hist_add(hist_handle hist, uint64_t val);
+
+/* Number of values counted */
+uint64_t hist_count(hist_handle hist);
+
+/* Smallest and largest values counted, exact, 0 if empty */
+uint64_t hist_min(hist_handle hist);
+uint64_t hist_max(hist_handle hist);
+
+/* Mean of the values counted, exact, 0 if empty */
+double hist_mean(hist_handle hist);
+
+/* Value below which pct percent of the values fall, rounded up to the top of
+ * its bucket but never past the largest value, 0 if empty */
+uint64_t hist_percentile(hist_handle hist, double pct);
+
+/* Number of values counted below val, exact when val is a power of 2 */
+uint64_t hist_count_below(hist_handle hist, uint64_t val);
+
+/* Forget all values */
+void hist_reset(hist_handle hist);
+
+void hist_destroy(hist_handle hist);
+
+/* Print a value in microseconds into buf as us, ms or s, returns buf */
+char *hist_fmt_us(char *buf, size_t sz, uint64_t us);
+
+#endif /* _HIST_H_ */
@@ -0,0 +1,438 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bhash.h"
+#include "bstr.h"
+#include "files.h"
+#include "history.h"
+
+/* never compact below this many stale slots or journal lines */
+#define HISTORY_COMPACT_MIN (1024)
+
+/* searches shorter than a trigram scan the entries directly */
+#define HISTORY_GRAM_LEN (3)
+
+/* slots of the entries containing a trigram, ascending. Slots of moved
+ * entries are left in place and skipped when searching. */
+typedef struct history_gram_struct {
+    uint32_t key; /* the three bytes, 0 for an unused bucket */
+    int *slots;
+    int n;
+    int cap;
+} history_gram_t;
+
+typedef struct history_struct {
+    /* entries oldest first, a moved entry leaves a NULL behind */
+    char **slots;
+    int slots_n;
+    int slots_cap;
+    int live; /* non-NULL slots */
+    int pos; /* browse position, slots_n when not browsing */
+    bhash_handle index; /* entry -> slot */
+    /* open addressed trigram -> slots index for searching */
+    history_gram_t *grams;
+    size_t grams_n;
+    size_t grams_cap;
+    char *path;
+    FILE *journal;
+    int journal_lines; /* lines in the journal, live or stale */
+} history_t;
+
+static void journal_write(history_t *hist, const char *line);
+static void journal_compact(history_t *hist);
+static void slots_compact(history_t *hist);
+static void grams_add(history_t *hist, int slot);
+static void grams_rebuild(history_t *hist);
+static void grams_free(history_t *hist);
+static history_gram_t *gram_find(history_t *hist, uint32_t key);
+static int search_scan(history_t *hist, const char *query, int from);
+static int search_grams(history_t *hist, const char *query, int from);
+
+history_handle
+history_create(const char *path)
+{
+    history_t *hist = calloc(1, sizeof(history_t));
+
+    hist->index = bhash_create(0);
+
+    if (path) {
+        hist->path = strdup(path);
+        hist->journal = fopen(path, "w");
+    }
+
+    return hist;
+}
+
+void
+history_set(history_handle hist, char **lines, int n)
+{
+    for (int i = 0; i < hist->slots_n; i++) {
+        if (hist->slots[i]) {
+            bhash_del(hist->index, hist->slots[i]);
+            free(hist->slots[i]);
+        }
+    }
+    free(hist->slots);
+
+    hist->slots = lines;
+    hist->slots_n = n;
+    hist->slots_cap = n;
+    hist->live = n;
+    hist->pos = n;
+
+    for (int i = 0; i < n; i++) {
+        bhash_put(hist->index, lines[i], i);
+    }
+
+    grams_rebuild(hist);
+    journal_compact(hist);
+}
+
+void
+history_add(history_handle hist, const char *line)
+{
+    long slot;
+    char *entry;
+
+    hist->pos = hist->slots_n;
+
+    if (*line == '\0')
+        return;
+
+    if (bhash_get(hist->index, line, &slot)) {
+        /* already the newest, nothing to record */
+        if (slot == hist->slots_n - 1)
+            return;
+
+        entry = hist->slots[slot];
+        hist->slots[slot] = NULL;
+        hist->live--;
+    } else {
+        entry = strdup(line);
+    }
+
+    if (hist->slots_n == hist->slots_cap) {
+        hist->slots_cap = hist->slots_cap ? hist->slots_cap * 2 : 64;
+        hist->slots = realloc(hist->slots, sizeof(char *) * hist->slots_cap);
+    }
+
+    hist->slots[hist->slots_n] = entry;
+    bhash_put(hist->index, entry, hist->slots_n);
+    grams_add(hist, hist->slots_n);
+    hist->slots_n++;
+    hist->live++;
+
+    if (hist->slots_n - hist->live > hist->live + HISTORY_COMPACT_MIN)
+        slots_compact(hist);
+    hist->pos = hist->slots_n;
+
+    journal_write(hist, entry);
+}
+
+int
+history_len(history_handle hist)
+{
+    return hist->live;
+}
+
+const char *
+history_older(history_handle hist)
+{
+    int pos = hist->pos;
+
+    while (--pos >= 0) {
+        if (hist->slots[pos]) {
+            hist->pos = pos;
+            return hist->slots[pos];
+        }
+    }
+
+    return NULL;
+}
+
+const char *
+history_newer(history_handle hist)
+{
+    while (hist->pos < hist->slots_n) {
+        hist->pos++;
+        if (hist->pos < hist->slots_n && hist->slots[hist->pos])
+            return hist->slots[hist->pos];
+    }
+
+    return NULL;
+}
+
+const char *
+history_search(history_handle hist, const char *query, int older)
+{
+    int from = hist->pos;
+    int slot;
+
+    if (from == hist->slots_n || older)
+        from--;
+    if (from < 0)
+        return NULL;
+
+    if (strlen(query) < HISTORY_GRAM_LEN) {
+        slot = search_scan(hist, query, from);
+    } else {
+        slot = search_grams(hist, query, from);
+    }
+
+    if (slot < 0)
+        return NULL;
+
+    hist->pos = slot;
+    return hist->slots[slot];
+}
+
+int
+history_browsing(history_handle hist)
+{
+    return hist->pos < hist->slots_n;
+}
+
+void
+history_reset_pos(history_handle hist)
+{
+    hist->pos = hist->slots_n;
+}
+
+void
+history_destroy(history_handle hist)
+{
+    if (!hist)
+        return;
+
+    if (hist->journal)
+        fclose(hist->journal);
+
+    for (int i = 0; i < hist->slots_n; i++) {
+        free(hist->slots[i]);
+    }
+    free(hist->slots);
+    bhash_destroy(hist->index);
+    grams_free(hist);
+    free(hist->path);
+    free(hist);
+}
+
+/* Append an entry to the journal. Replaying it keeps the newest copy of each
+ * line, so moves are just appends too. */
+static void
+journal_write(history_t *hist, const char *line)
+{
+    if (!hist->journal)
+        return;
+
+    fputs(line, hist->journal);
+    fputc('\n', hist->journal);
+    fflush(hist->journal);
+    hist->journal_lines++;
+
+    if (hist->journal_lines > 2 * hist->live + HISTORY_COMPACT_MIN)
+        journal_compact(hist);
+}
+
+/* Rewrite the journal with just the live entries and swap it in */
+static void
+journal_compact(history_t *hist)
+{
+    char *tmp_path;
+    FILE *fd;
+
+    if (!hist->journal)
+        return;
+
+    tmp_path = bstr_print(NULL, "%s.tmp", hist->path);
+    fd = fopen(tmp_path, "w");
+    if (!fd) {
+        free(tmp_path);
+        return;
+    }
+
+    for (int i = 0; i < hist->slots_n; i++) {
+        if (hist->slots[i]) {
+            fputs(hist->slots[i], fd);
+            fputc('\n', fd);
+        }
+    }
+
+    if (fclose(fd) || files_replace(tmp_path, hist->path)) {
+        /* keep appending to the old journal, it is still complete */
+        remove(tmp_path);
+        free(tmp_path);
+        return;
+    }
+    free(tmp_path);
+
+    fclose(hist->journal);
+    hist->journal = fopen(hist->path, "a");
+    hist->journal_lines = hist->live;
+}
+
+/* Squeeze out the slots left behind by moved entries */
+static void
+slots_compact(history_t *hist)
+{
+    int n = 0;
+
+    for (int i = 0; i < hist->slots_n; i++) {
+        if (!hist->slots[i])
+            continue;
+
+        hist->slots[n] = hist->slots[i];
+        bhash_put(hist->index, hist->slots[n], n);
+        n++;
+    }
+
+    hist->slots_n = n;
+
+    /* every slot moved, so the index has to be redone */
+    grams_rebuild(hist);
+}
+
+/* Record slot under each trigram of its entry */
+static void
+grams_add(history_t *hist, int slot)
+{
+    const unsigned char *p = (const unsigned char *)hist->slots[slot];
+
+    if (!p[0] || !p[1])
+        return;
+
+    for (; p[2]; p++) {
+        uint32_t key = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+        history_gram_t *gram;
+
+        /* keep the load factor under a half */
+        if ((hist->grams_n + 1) * 2 > hist->grams_cap) {
+            history_gram_t *old = hist->grams;
+            size_t old_cap = hist->grams_cap;
+
+            hist->grams_cap = old_cap ? old_cap * 2 : 4096;
+            hist->grams = calloc(hist->grams_cap, sizeof(history_gram_t));
+
+            for (size_t i = 0; i < old_cap; i++) {
+                if (old[i].key)
+                    *gram_find(hist, old[i].key) = old[i];
+            }
+            free(old);
+        }
+
+        gram = gram_find(hist, key);
+        if (!gram->key) {
+            gram->key = key;
+            hist->grams_n++;
+        }
+
+        /* a trigram repeated within the entry */
+        if (gram->n > 0 && gram->slots[gram->n - 1] == slot)
+            continue;
+
+        if (gram->n == gram->cap) {
+            gram->cap = gram->cap ? gram->cap * 2 : 4;
+            gram->slots = realloc(gram->slots, sizeof(int) * gram->cap);
+        }
+        gram->slots[gram->n++] = slot;
+    }
+}
+
+static void
+grams_rebuild(history_t *hist)
+{
+    grams_free(hist);
+
+    for (int i = 0; i < hist->slots_n; i++) {
+        if (hist->slots[i])
+            grams_add(hist, i);
+    }
+}
+
+static void
+grams_free(history_t *hist)
+{
+    for (size_t i = 0; i < hist->grams_cap; i++) {
+        free(hist->grams[i].slots);
+    }
+    free(hist->grams);
+
+    hist->grams = NULL;
+    hist->grams_n = 0;
+    hist->grams_cap = 0;
+}
+
+/* Bucket holding key, or the empty bucket it would go in */
+static history_gram_t *
+gram_find(history_t *hist, uint32_t key)
+{
+    size_t mask = hist->grams_cap - 1;
+    size_t i = (key * 2654435761u) & mask;
+
+    while (hist->grams[i].key && hist->grams[i].key != key) {
+        i = (i + 1) & mask;
+    }
+
+    return &hist->grams[i];
+}
+
+/* Newest slot at or before from containing query, checking every entry */
+static int
+search_scan(history_t *hist, const char *query, int from)
+{
+    for (int i = from; i >= 0; i--) {
+        if (hist->slots[i] && strstr(hist->slots[i], query))
+            return i;
+    }
+
+    return -1;
+}
+
+/* Newest slot at or before from containing query, only checking the entries
+ * that have its rarest trigram */
+static int
+search_grams(history_t *hist, const char *query, int from)
+{
+    const unsigned char *p = (const unsigned char *)query;
+    history_gram_t *best = NULL;
+    int lo;
+    int hi;
+
+    if (!hist->grams_cap)
+        return -1;
+
+    for (; p[2]; p++) {
+        uint32_t key = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+        history_gram_t *gram = gram_find(hist, key);
+
+        /* no entry has this trigram, so none can match */
+        if (!gram->key)
+            return -1;
+
+        if (!best || gram->n < best->n)
+            best = gram;
+    }
+
+    /* first index past from */
+    lo = 0;
+    hi = best->n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (best->slots[mid] <= from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    while (--lo >= 0) {
+        int slot = best->slots[lo];
+
+        if (hist->slots[slot] && strstr(hist->slots[slot], query))
+            return slot;
+    }
+
+    return -1;
+}
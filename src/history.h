@@ -0,0 +1,51 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdio.h>
+
+/* Command history: unique entries ordered oldest to newest with a hash index,
+ * so adding or re-using a command is O(1). Every add is appended to a journal
+ * file, which is rewritten without the stale copies once they outnumber the
+ * live entries. */
+typedef struct history_struct * history_handle;
+
+/* Create an empty history journaled to path, which is truncated. path may be
+ * NULL to keep the history in memory only. */
+history_handle history_create(const char *path);
+
+/* Replace the entries, oldest first. Takes ownership of the array and its
+ * strings, which must be malloc'd, unique and have no line endings. The
+ * journal is rewritten to match. */
+void history_set(history_handle hist, char **lines, int n);
+
+/* Make line the newest entry, moving it if it is already present. Empty lines
+ * are ignored. Resets the browse position. */
+void history_add(history_handle hist, const char *line);
+
+/* Number of entries */
+int history_len(history_handle hist);
+
+/* Step the browse position one entry older and return that entry, NULL if
+ * already at the oldest */
+const char *history_older(history_handle hist);
+
+/* Step the browse position one entry newer and return that entry, NULL once
+ * it moves past the newest */
+const char *history_newer(history_handle hist);
+
+/* Step the browse position to the newest entry containing query, starting
+ * from the current entry, or the one before it if older is set. Returns the
+ * entry, or NULL leaving the position alone if nothing matches. Uses a
+ * trigram index, so it stays fast on very large histories. */
+const char *history_search(history_handle hist, const char *query, int older);
+
+/* Whether the browse position is on an entry rather than past the newest */
+int history_browsing(history_handle hist);
+
+/* Move the browse position past the newest entry */
+void history_reset_pos(history_handle hist);
+
+/* Flush and close the journal and free everything */
+void history_destroy(history_handle hist);
+
+#endif /* _HISTORY_H_ */
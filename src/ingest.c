@@ -1,37 +1,51 @@
-#include <libgen.h>
 #ifdef __MINGW32__
 #  include <curses.h>
 #else
 #  include <ncurses.h>
 #endif
 #include <pthread.h>
-#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
 #include "bytenuts.h"
 #include "cheerios.h"
+#include "complete.h"
+#include "files.h"
+#include "gapbuf.h"
+#include "history.h"
+#include "latency.h"
 #include "ingest.h"
-#include "timer_math.h"
+#include "paths.h"
+#include "periodic.h"
+#include "probe.h"
+#include "runner.h"
+#include "textsend.h"
+#include "txq.h"
+#include "ui.h"
 
 static void *ingest_thread(void *arg);
+static int get_key(void);
+static void show_line(const char *prepend, gapbuf_handle gb);
+static void save_tmp_history(void);
+static void paste(void);
+static int search_key(int ch);
+static void search_update(int older);
+static void search_end(void);
 
 static ingest_t ingest;
 
 static int mode_normal(int ch);
-static int mode_xmodem(int block_sz);
+static int mode_path(void);
 static int mode_hex(int ch);
 static int handle_functions(int ch);
 static int print_stats(void);
 static int auto_complete(void);
 static int read_cmd_page(const char *home_dir, int idx);
 static void update_cmd_pg_status(void);
-static void inter_command_wait(void);
 
 int
 ingest_start(bytenuts_t *bytenuts)
@@ -41,47 +55,35 @@ ingest_start(bytenuts_t *bytenuts)
     memset(&ingest, 0, sizeof(ingest));
 
     ingest.input = bytenuts->in_win;
-    ingest.term_lock = &bytenuts->term_lock;
     ingest.config = &bytenuts->config;
     ingest.cmd_pg_cur = -1;
     ingest.xmodem_hist = bstr_history_create();
+    ingest.inbuf = gapbuf_create();
+    ingest.search = gapbuf_create();
+    pthread_mutex_init(&ingest.shown_lock, NULL);
 
     HOME = getenv("HOME");
     if (HOME) {
         int idx = 0;
-        int name_len;
-        pid_t pid;
 
         while (!read_cmd_page(HOME, idx)) {
             idx++;
         }
 
         /* ensure that a process has a unique log */
-        pid = getpid();
-        name_len = snprintf(
-            NULL, 0,
-            "%s/.config/bytenuts/inbuf.%lld.log",
-            HOME, (long long)pid
+        ingest.history_filename = paths_logfile(
+            "inbuf", ingest.config->session, (long long)getpid()
         );
-        ingest.history_filename = calloc(1, name_len + 1);
-        snprintf(
-            ingest.history_filename, name_len + 1,
-            "%s/.config/bytenuts/inbuf.%lld.log",
-            HOME, (long long)pid
-        );
-
-        ingest.history_fd = fopen(ingest.history_filename, "w");
     }
 
+    /* without a config dir the history is only kept in memory */
+    ingest.history = history_create(ingest.history_filename);
+
     if (ingest.cmd_pgs_n > 0) {
         ingest.cmd_pg_cur = 0;
     }
     update_cmd_pg_status();
 
-    clock_gettime(CLOCK_REALTIME, &ingest.cmd_ts);
-    /* ensure first command is not delayed */
-    timer_sub_ms(&ingest.cmd_ts, ingest.config->inter_cmd_to);
-
     ingest.running = 1;
     if (pthread_create(&ingest.thr, NULL, ingest_thread, NULL)) {
         return -1;
@@ -94,34 +96,57 @@ int
 ingest_stop()
 {
     ingest.running = 0;
+    ui_wake_reader();
     pthread_join(ingest.thr, NULL);
+
+    free(ingest.shown_prepend);
+    free(ingest.shown_buf);
+
     return 0;
 }
 
 int
 ingest_refresh()
+{
+    if (ingest.searching) {
+        char *prompt = bstr_print(
+            NULL, "(%sreverse-i-search)'%s': ",
+            ingest.search_failed ? "failed " : "", gapbuf_str(ingest.search)
+        );
+
+        show_line(prompt, ingest.inbuf);
+        free(prompt);
+        return 0;
+    }
+
+    show_line(ingest.prepend, ingest.inbuf);
+    return 0;
+}
+
+void
+ingest_draw()
 {
     static int start = 0;
     int startx = 0, starty = 0;
     int cx = -1, cy = -1;
     int win_len = getmaxx(ingest.input) + 1;
 
-    pthread_mutex_lock(ingest.term_lock);
+    pthread_mutex_lock(&ingest.shown_lock);
 
     werase(ingest.input);
     wmove(ingest.input, 0, 0);
-    if (ingest.prepend) {
-        wprintw(ingest.input, "%s", ingest.prepend);
+    if (ingest.shown_prepend) {
+        wprintw(ingest.input, "%s", ingest.shown_prepend);
         getyx(ingest.input, starty, startx);
     }
 
-    if (start > ingest.inpos) {
-        start = ingest.inpos;
+    if (start > ingest.shown_pos) {
+        start = ingest.shown_pos;
     }
     /* this is not perfect as some characters are wider than one space, but it
      * makes the algorithm for printing less redundant */
-    else if (ingest.inpos > (start + win_len)) {
-        start = ingest.inpos - win_len;
+    else if (ingest.shown_pos > (start + win_len)) {
+        start = ingest.shown_pos - win_len;
     }
 
     int i = 0;
@@ -134,14 +159,14 @@ ingest_refresh()
         getyx(ingest.input, iy, ix);
 
         /* print the cursor at this position */
-        if (p == ingest.inpos) {
+        if (p == ingest.shown_pos) {
             cy = iy;
             cx = ix;
             hit_cursor = 1;
         }
 
         /* nothing left to write... */
-        if (p >= ingest.inlen)
+        if (p >= ingest.shown_len)
             break;
 
         /* we want to leave a blank character for printing the cursor at the end of the line */
@@ -156,53 +181,24 @@ ingest_refresh()
             continue;
         }
 
-        waddch(ingest.input, ingest.inbuf[p]);
+        waddch(ingest.input, ingest.shown_buf[p]);
     }
 
     if (cx < 0) {
-        cx = ingest.inlen < win_len ? ingest.inlen : win_len - 1;
+        cx = ingest.shown_len < win_len ? ingest.shown_len : win_len - 1;
         cy = 0;
     }
 
     wmove(ingest.input, cy, cx);
-    wrefresh(ingest.input);
-
-    pthread_mutex_unlock(ingest.term_lock);
 
-    return 0;
+    pthread_mutex_unlock(&ingest.shown_lock);
 }
 
 int
 ingest_set_history(char **history, int history_len)
 {
-    if (ingest.history) {
-        for (int i = 0; ingest.history[i] != NULL; i++) {
-            free(ingest.history[i]);
-        }
-        free(ingest.history);
-    }
-
-    ingest.history = calloc(1, sizeof(char *) * (history_len+1));
-    for (int i = 0; i < history_len; i++) {
-        size_t item_len = strlen(history[i]);
-        ingest.history[i] = strdup(history[i]);
-
-        while (
-            ingest.history[i][item_len-1] == '\n' ||
-            ingest.history[i][item_len-1] == '\r'
-        ) {
-            item_len--;
-            ingest.history[i][item_len] = '\0';
-        }
-
-        if (ingest.history_fd) {
-            fwrite(ingest.history[i], 1, item_len, ingest.history_fd);
-            fwrite("\n", 1, 1, ingest.history_fd);
-        }
-    }
-
-    ingest.history_len = history_len;
-    ingest.history_pos = ingest.history_len;
+    /* carries the history over into this process's journal in one go */
+    history_set(ingest.history, history, history_len);
 
     return 0;
 }
@@ -212,18 +208,17 @@ ingest_thread(void *arg)
 {
     int ch;
 
-    memset(ingest.inbuf, 0, sizeof(ingest.inbuf));
-    ingest.inpos = 0;
+    gapbuf_clear(ingest.inbuf);
 
     bytenuts_set_status(STATUS_INGEST, "normal");
 
     while (ingest.running) {
-        pthread_mutex_lock(ingest.term_lock);
-        ch = wgetch(ingest.input);
-        pthread_mutex_unlock(ingest.term_lock);
+        ch = get_key();
+        if (ch == ERR)
+            continue;
 
-        if (ch == ERR) {
-            nanosleep(&(struct timespec){ 0, 100000 }, NULL);
+        if (ch == UI_KEY_PASTE) {
+            paste();
             continue;
         }
 
@@ -231,17 +226,12 @@ ingest_thread(void *arg)
             int should_quit = 0;
             int should_continue = 0;
 
-            bytenuts_set_status(STATUS_INGEST, "control");
+            /* keep whatever the search found */
+            search_end();
 
-            while (1) {
-                pthread_mutex_lock(ingest.term_lock);
-                ch = wgetch(ingest.input);
-                pthread_mutex_unlock(ingest.term_lock);
+            bytenuts_set_status(STATUS_INGEST, "control");
 
-                if (ch != ERR)
-                    break;
-                nanosleep(&(struct timespec){ 0, 100000 }, NULL);
-            }
+            ch = get_key();
 
             switch (ch) {
             case '1':
@@ -262,8 +252,6 @@ ingest_thread(void *arg)
                     break;
 
                 int idx;
-                char *toload;
-                size_t toload_len;
                 char **cmds = ingest.cmd_pgs[ingest.cmd_pg_cur].cmds;
                 int cmds_n = ingest.cmd_pgs[ingest.cmd_pg_cur].cmds_n;
 
@@ -274,12 +262,7 @@ ingest_thread(void *arg)
                 if (idx >= cmds_n)
                     break;
 
-                toload = cmds[idx];
-                toload_len = strlen(toload);
-
-                memcpy(ingest.inbuf, toload, toload_len);
-                ingest.inpos = toload_len;
-                ingest.inlen = toload_len;
+                gapbuf_set(ingest.inbuf, cmds[idx]);
                 ingest_refresh();
                 break;
             }
@@ -333,15 +316,7 @@ ingest_thread(void *arg)
             {
                 bytenuts_set_status(STATUS_CMDPAGE, "selecting...");
 
-                while (1) {
-                    pthread_mutex_lock(ingest.term_lock);
-                    ch = wgetch(ingest.input);
-                    pthread_mutex_unlock(ingest.term_lock);
-
-                    if (ch != ERR)
-                        break;
-                    nanosleep(&(struct timespec){ 0, 100000 }, NULL);
-                }
+                ch = get_key();
 
                 should_continue = 1;
                 bytenuts_set_status(STATUS_INGEST, "normal");
@@ -357,6 +332,51 @@ ingest_thread(void *arg)
                 update_cmd_pg_status();
                 break;
             }
+            case 't':
+            {
+                int on;
+
+                if (periodic_count() == 0) {
+                    cheerios_info("No periodic commands configured");
+                    bytenuts_set_status(STATUS_INGEST, "normal");
+                    should_continue = 1;
+                    break;
+                }
+
+                periodic_list();
+                bytenuts_set_status(STATUS_INGEST, "periodic");
+
+                ch = get_key();
+
+                should_continue = 1;
+                bytenuts_set_status(STATUS_INGEST, "normal");
+
+                if (ch < '1' || ch > '9')
+                    break;
+
+                on = periodic_toggle(ch - '1');
+                if (on >= 0) {
+                    cheerios_print(
+                        "Periodic command %d %s\r\n", ch - '0',
+                        on ? "enabled" : "disabled"
+                    );
+                }
+                break;
+            }
+            case 'l':
+            {
+                char *path = latency_export();
+
+                if (path) {
+                    cheerios_print("Latency stats written to %s\r\n", path);
+                    free(path);
+                } else {
+                    cheerios_info("Could not write the latency stats");
+                }
+                bytenuts_set_status(STATUS_INGEST, "normal");
+                should_continue = 1;
+                break;
+            }
             case 'i':
                 print_stats();
                 bytenuts_set_status(STATUS_INGEST, "normal");
@@ -374,6 +394,35 @@ ingest_thread(void *arg)
                 ingest.mode = INGEST_MODE_XMODEM1K;
                 bytenuts_set_status(STATUS_INGEST, "xmodem1k");
                 break;
+            case 'f':
+                if (textsend_active()) {
+                    textsend_cancel();
+                    bytenuts_set_status(STATUS_INGEST, "normal");
+                    should_continue = 1;
+                    break;
+                }
+                ingest.mode = INGEST_MODE_SEND;
+                bytenuts_set_status(STATUS_INGEST, "send");
+                break;
+            case 's':
+                if (runner_active()) {
+                    runner_cancel();
+                    bytenuts_set_status(STATUS_INGEST, "normal");
+                    should_continue = 1;
+                    break;
+                }
+                ingest.mode = INGEST_MODE_SCRIPT;
+                bytenuts_set_status(STATUS_INGEST, "script");
+                break;
+            case 'e':
+                if (probe_active()) {
+                    probe_cancel();
+                } else {
+                    probe_start(ingest.config);
+                }
+                bytenuts_set_status(STATUS_INGEST, "normal");
+                should_continue = 1;
+                break;
             case 'H':
                 if (ingest.mode == INGEST_MODE_NORMAL) {
                     ingest.mode = INGEST_MODE_HEX;
@@ -391,9 +440,14 @@ ingest_thread(void *arg)
                     "  0-9: load the given quick command (0 is 10)\r\n"
                     "  p: select a different quick commands page\r\n"
                     "  i: view info/stats\r\n"
+                    "  l: write command latency stats to a CSV file\r\n"
                     "  x: start XModem upload with 128B payloads\r\n"
                     "  X: start XModem upload with 1024B payloads\r\n"
+                    "  f: send a text file line by line (again to stop)\r\n"
+                    "  s: run a send/expect script (again to stop)\r\n"
+                    "  e: probe round trip latency with echoed frames (again to stop)\r\n"
                     "  H: enter/exit hex buffer mode\r\n"
+                    "  t: toggle a periodic command, by its number\r\n"
                     "  h: view this help\r\n"
                     "  q: quit Bytenuts\r\n",
                     ingest.config->escape
@@ -419,10 +473,10 @@ ingest_thread(void *arg)
             mode_normal(ch);
             break;
         case INGEST_MODE_XMODEM:
-            mode_xmodem(128);
-            break;
         case INGEST_MODE_XMODEM1K:
-            mode_xmodem(1024);
+        case INGEST_MODE_SEND:
+        case INGEST_MODE_SCRIPT:
+            mode_path();
             break;
         case INGEST_MODE_HEX:
             mode_hex(ch);
@@ -431,99 +485,199 @@ ingest_thread(void *arg)
             break;
         }
 
-        sched_yield();
     }
 
-    if (ingest.history_fd) {
-        char *in_filename;
-        int in_filename_len;
-        char *home = getenv("HOME");
+    history_destroy(ingest.history);
 
-        /* do not chdir as other threads can still be running */
-        in_filename_len = snprintf(
-            NULL, 0,
-            "%s/.config/bytenuts/inbuf.log",
-            home
-        );
-        in_filename = calloc(1, in_filename_len + 1);
-        snprintf(
-            in_filename, in_filename_len + 1,
-            "%s/.config/bytenuts/inbuf.log",
-            home
-        );
+    if (ingest.history_filename) {
+        char *in_filename = paths_logfile("inbuf", ingest.config->session, 0);
 
         /* move this processes history to the path that can be loaded on resumption */
-        fclose(ingest.history_fd);
-        rename(ingest.history_filename, in_filename);
+        files_replace(ingest.history_filename, in_filename);
 
         free(in_filename);
         free(ingest.history_filename);
     }
 
     bstr_history_destroy(ingest.xmodem_hist);
+    gapbuf_destroy(ingest.inbuf);
+    gapbuf_destroy(ingest.search);
+    complete_clear();
+    free(ingest.tmp_history);
 
     pthread_exit(NULL);
     return NULL;
 }
 
-/* Add an item to the input history, doing nothing if the line is the same as
- * the previous, and re-arranging history if the line was seen previously. */
+/* Block until the UI thread hands us a key, returning ERR only when woken up
+ * to stop */
+static int
+get_key(void)
+{
+    while (ingest.running) {
+        int ch = ui_read_key();
+
+        if (ch != ERR)
+            return ch;
+    }
+
+    return ERR;
+}
+
+/* Publish what the input line should show and have the UI thread draw it. gb
+ * may be NULL for an empty line. */
 static void
-history_add(const char *line)
+show_line(const char *prepend, gapbuf_handle gb)
 {
-    ingest.history_pos = ingest.history_len;
+    size_t len = gb ? gapbuf_len(gb) : 0;
 
-    if (*line == '\0') {
-        /* Line is empty. */
-        return;
+    pthread_mutex_lock(&ingest.shown_lock);
+
+    if (!ingest.shown_prepend || !prepend || strcmp(ingest.shown_prepend, prepend)) {
+        free(ingest.shown_prepend);
+        ingest.shown_prepend = prepend ? strdup(prepend) : NULL;
     }
 
-    if (ingest.history_len != 0) {
-        if (!strcmp(ingest.history[ingest.history_len - 1], line)) {
-            /* Line is a repeat of the previous history item. */
-            return;
+    if (len > ingest.shown_cap) {
+        ingest.shown_cap = len;
+        ingest.shown_buf = realloc(ingest.shown_buf, ingest.shown_cap);
+    }
+    if (gb)
+        gapbuf_copy(gb, ingest.shown_buf);
+    ingest.shown_len = len;
+    ingest.shown_pos = gb ? gapbuf_pos(gb) : 0;
+
+    pthread_mutex_unlock(&ingest.shown_lock);
+
+    ui_post(UI_EV_INPUT);
+}
+
+/* Stash the line being edited while history is browsed */
+static void
+save_tmp_history(void)
+{
+    free(ingest.tmp_history);
+    ingest.tmp_history = strdup(gapbuf_str(ingest.inbuf));
+}
+
+/* Insert a bracketed paste in one go. Every newline in it sends the line so
+ * far like pressing enter, the text after the last one is left to edit. */
+static void
+paste(void)
+{
+    size_t len;
+    char *buf = ui_take_paste(&len);
+    char *p = buf;
+    char *end;
+    char *nl;
+
+    if (!buf)
+        return;
+    end = buf + len;
+
+    search_end();
+
+    /* a path being typed for xmodem only takes the first line */
+    while (
+        (ingest.mode == INGEST_MODE_NORMAL || ingest.mode == INGEST_MODE_HEX) &&
+        (nl = memchr(p, '\n', end - p))
+    ) {
+        gapbuf_insert(ingest.inbuf, p, nl - p);
+        p = nl + 1;
+
+        if (ingest.mode == INGEST_MODE_HEX) {
+            mode_hex('\n');
+        } else {
+            mode_normal('\n');
         }
+    }
 
-        for (unsigned i = 0; i < ingest.history_len - 1; i++) {
-            if (!strcmp(ingest.history[i], line)) {
-                /* Re-arrange history to move item to the front */
-                char *history_item = ingest.history[i];
-                memcpy(&ingest.history[i], &ingest.history[i+1],
-                       (ingest.history_len - (i + 1)) * sizeof(ingest.history[0]));
-                ingest.history[ingest.history_len - 1] = history_item;
-
-                if (ingest.history_fd) {
-                    fseek(ingest.history_fd, 0, SEEK_SET);
-                    for (unsigned i = 0; i < ingest.history_len; i++) {
-                        fwrite(ingest.history[i], 1, strlen(ingest.history[i]), ingest.history_fd);
-                        fwrite("\n", 1, 1, ingest.history_fd);
-                    }
-                }
+    nl = memchr(p, '\n', end - p);
+    gapbuf_insert(ingest.inbuf, p, (nl ? nl : end) - p);
+    ingest_refresh();
 
-                return;
-            }
+    free(buf);
+}
+
+/* Handle a key while searching history, returning 0 once the search is over
+ * and the key should be handled as usual */
+static int
+search_key(int ch)
+{
+    switch (ch) {
+    case CTRL('r'): /* next older match */
+        search_update(1);
+        return 1;
+    case KEY_BACKSPACE:
+        if (gapbuf_backspace(ingest.search)) {
+            /* matches of the shorter query may be newer than this one */
+            history_reset_pos(ingest.history);
+            search_update(0);
+        }
+        return 1;
+    case CTRL('c'):
+    case CTRL('g'): /* give up, back to the line being edited */
+        ingest.searching = 0;
+        history_reset_pos(ingest.history);
+        gapbuf_set(ingest.inbuf, ingest.tmp_history);
+        ingest_refresh();
+        return 1;
+    default:
+        if (ch >= ' ' && ch < 0x7f) {
+            char c = (char)ch;
+
+            gapbuf_insert(ingest.search, &c, 1);
+            search_update(0);
+            return 1;
         }
+
+        search_end();
+        return 0;
     }
+}
+
+/* Load the newest entry matching the query into the line, with the cursor on
+ * the match */
+static void
+search_update(int older)
+{
+    const char *query = gapbuf_str(ingest.search);
+    const char *entry = history_search(ingest.history, query, older);
 
-    ingest.history_len++;
-    ingest.history = realloc(ingest.history, ingest.history_len * sizeof(char *));
-    ingest.history[ingest.history_pos] = strdup(ingest.inbuf);
-    ingest.history_pos++;
-    if (ingest.history_fd) {
-        fwrite(line, 1, strlen(line), ingest.history_fd);
-        fwrite("\n", 1, 1, ingest.history_fd);
+    ingest.search_failed = !entry;
+    if (entry) {
+        gapbuf_set(ingest.inbuf, entry);
+        gapbuf_move(ingest.inbuf, strstr(entry, query) - entry);
     }
+
+    ingest_refresh();
+}
+
+/* Leave search mode keeping the match in the line. Up and down carry on from
+ * where it was found. */
+static void
+search_end(void)
+{
+    if (!ingest.searching)
+        return;
+
+    ingest.searching = 0;
+    ingest_refresh();
 }
 
 static int
 mode_normal(int ch)
 {
+    if (ingest.searching && search_key(ch))
+        return 0;
+
     if (handle_functions(ch))
         return 0;
 
     switch (ch) {
     case '\n': { /* send inputs */
-        size_t inlen = strlen(ingest.inbuf);
+        const char *line = gapbuf_str(ingest.inbuf);
+        size_t inlen = gapbuf_len(ingest.inbuf);
         const char *ending;
 
         if (ingest.config->no_crlf)
@@ -531,80 +685,71 @@ mode_normal(int ch)
         else
             ending = "\r\n";
 
-        inter_command_wait();
-        cheerios_input(ingest.inbuf, inlen);
+        /* the TX writer spaces commands out, never wait for it here */
+        cheerios_input(line, inlen);
         cheerios_input(ending, strlen(ending));
+        latency_cmd(line);
+        txq_end_cmd();
         if (ingest.config->echo) {
             cheerios_insert(">> ", 3);
-            cheerios_insert(ingest.inbuf, inlen);
+            cheerios_insert(line, inlen);
             cheerios_insert("\r\n", 2);
         }
 
         /* store in history */
-        history_add(ingest.inbuf);
+        history_add(ingest.history, line);
 
-        memset(ingest.inbuf, 0, sizeof(ingest.inbuf));
-        ingest.inpos = 0;
-        ingest.inlen = 0;
+        gapbuf_clear(ingest.inbuf);
         ingest_refresh();
 
         break;
     }
     case KEY_UP: /* load in history */
-        if (ingest.history_pos == 0) { /* top of history */
-            break;
-        } else if (ingest.history_pos == ingest.history_len) { /* we have not loaded any history */
-            strcpy(ingest.tmp_history, ingest.inbuf);
+    {
+        const char *entry;
+
+        if (!history_browsing(ingest.history)) { /* we have not loaded any history */
+            save_tmp_history();
         }
 
-        ingest.history_pos--;
-        memset(ingest.inbuf, 0, sizeof(ingest.inbuf));
-        strcpy(ingest.inbuf, ingest.history[ingest.history_pos]);
-        ingest.inlen = strlen(ingest.inbuf);
-        ingest.inpos = ingest.inlen;
+        entry = history_older(ingest.history);
+        if (!entry) /* top of history */
+            break;
+
+        gapbuf_set(ingest.inbuf, entry);
         ingest_refresh();
 
         break;
-    case KEY_DOWN: /* load in history */
-        if (ingest.history_pos == ingest.history_len) { /* no history loaded */
-            break;
-        } else if (ingest.history_pos == ingest.history_len - 1) { /* load back temp storage */
-            ingest.history_pos++;
-            memset(ingest.inbuf, 0, sizeof(ingest.inbuf));
-            strcpy(ingest.inbuf, ingest.tmp_history);
-            ingest.inlen = strlen(ingest.inbuf);
-            ingest.inpos = ingest.inlen;
-        } else {
-            ingest.history_pos++;
-            memset(ingest.inbuf, 0, sizeof(ingest.inbuf));
-            strcpy(ingest.inbuf, ingest.history[ingest.history_pos]);
-            ingest.inlen = strlen(ingest.inbuf);
-            ingest.inpos = ingest.inlen;
-        }
+    }
+    case CTRL('r'): /* search history */
+        if (!history_browsing(ingest.history))
+            save_tmp_history();
 
+        ingest.searching = 1;
+        ingest.search_failed = 0;
+        gapbuf_clear(ingest.search);
         ingest_refresh();
 
         break;
-    default:
+    case KEY_DOWN: /* load in history */
     {
-        char tmp[1024];
-        int tmp_len;
+        const char *entry;
 
-        if (ingest.inpos == sizeof(ingest.inbuf) - 1)
+        if (!history_browsing(ingest.history)) /* no history loaded */
             break;
 
-        tmp_len = ingest.inlen - ingest.inpos;
-        memcpy(tmp, &ingest.inbuf[ingest.inpos], tmp_len);
-        ingest.inbuf[ingest.inpos] = (char)ch;
-        ingest.inpos++;
-        ingest.inlen++;
-        memcpy(&ingest.inbuf[ingest.inpos], tmp, tmp_len);
+        entry = history_newer(ingest.history);
+        /* load back temp storage once we pass the newest */
+        gapbuf_set(ingest.inbuf, entry ? entry : ingest.tmp_history);
+        ingest_refresh();
 
-        if (ingest.inlen == sizeof(ingest.inbuf)) {
-            ingest.inbuf[ingest.inlen - 1] = '\0';
-            ingest.inlen--;
-        }
+        break;
+    }
+    default:
+    {
+        char c = (char)ch;
 
+        gapbuf_insert(ingest.inbuf, &c, 1);
         ingest_refresh();
 
         break;
@@ -614,47 +759,53 @@ mode_normal(int ch)
     return 0;
 }
 
+/* Read the path of a file to send with xmodem or line by line, or of a script
+ * to run, depending on the mode */
 static int
-mode_xmodem(int block_sz)
+mode_path(void)
 {
     int quit_flag = 0;
 
-    strcpy(ingest.tmp_history, ingest.inbuf);
-    memset(ingest.inbuf, 0, sizeof(ingest.inbuf));
-    ingest.inlen = 0;
-    ingest.inpos = 0;
+    save_tmp_history();
+    gapbuf_clear(ingest.inbuf);
     if (ingest.prepend)
         free(ingest.prepend);
     ingest.prepend = strdup("Give me a path (ctrl-c to stop): ");
     ingest_refresh();
 
     while (ingest.running) {
-        int ch;
+        int ch = get_key();
 
-        pthread_mutex_lock(ingest.term_lock);
-        ch = wgetch(ingest.input);
-        pthread_mutex_unlock(ingest.term_lock);
+        if (ch == ERR || handle_functions(ch))
+            continue;
 
-        if (ch == ERR || handle_functions(ch)) {
-            nanosleep(&(struct timespec){ 0, 100000 }, NULL);
+        if (ch == UI_KEY_PASTE) {
+            paste();
             continue;
         }
 
         switch (ch) {
         case '\n':
-            bstr_history_new_entry(ingest.xmodem_hist, ingest.inbuf);
+        {
+            const char *path = gapbuf_str(ingest.inbuf);
 
-            pthread_mutex_lock(ingest.term_lock);
-            werase(ingest.input);
-            wmove(ingest.input, 0, 0);
-            wprintw(ingest.input, "Sending...");
-            wrefresh(ingest.input);
-            pthread_mutex_unlock(ingest.term_lock);
+            bstr_history_new_entry(ingest.xmodem_hist, path);
 
             cheerios_gofwd(-1);
-            cheerios_xmodem(ingest.inbuf, block_sz);
+            if (ingest.mode == INGEST_MODE_SEND) {
+                /* goes on in the background, typing carries on as normal */
+                if (textsend_start(ingest.config, path))
+                    cheerios_info("Could not start the send, check send_prompt");
+            } else if (ingest.mode == INGEST_MODE_SCRIPT) {
+                /* load errors are shown by the runner */
+                runner_start(ingest.config, path);
+            } else {
+                show_line("Sending...", NULL);
+                cheerios_xmodem(path, ingest.mode == INGEST_MODE_XMODEM1K ? 1024 : 128);
+            }
             quit_flag = 1;
             break;
+        }
         case CTRL('c'):
             quit_flag = 1;
             break;
@@ -677,39 +828,20 @@ mode_xmodem(int block_sz)
 
                 filename = bstr_history_atpos(ingest.xmodem_hist);
                 if (!filename) {
-                    memset(ingest.inbuf, 0, sizeof(ingest.inbuf));
-                    ingest.inpos = 0;
-                    ingest.inlen = 0;
+                    gapbuf_clear(ingest.inbuf);
                     ingest_refresh();
                     break;
                 }
 
-                strncpy(ingest.inbuf, filename, sizeof(ingest.inbuf));
-                ingest.inpos = strlen(ingest.inbuf);
-                ingest.inlen = ingest.inpos;
+                gapbuf_set(ingest.inbuf, filename);
                 ingest_refresh();
                 break;
             }
         default:
             {
-                char tmp[1024];
-                int tmp_len;
-
-                if (ingest.inpos == sizeof(ingest.inbuf) - 1)
-                    break;
-
-                tmp_len = ingest.inlen - ingest.inpos;
-                memcpy(tmp, &ingest.inbuf[ingest.inpos], tmp_len);
-                ingest.inbuf[ingest.inpos] = (char)ch;
-                ingest.inpos++;
-                ingest.inlen++;
-                memcpy(&ingest.inbuf[ingest.inpos], tmp, tmp_len);
-
-                if (ingest.inlen == sizeof(ingest.inbuf)) {
-                    ingest.inbuf[ingest.inlen - 1] = '\0';
-                    ingest.inlen--;
-                }
+                char c = (char)ch;
 
+                gapbuf_insert(ingest.inbuf, &c, 1);
                 ingest_refresh();
 
                 break;
@@ -717,10 +849,7 @@ mode_xmodem(int block_sz)
         }
 
         if (quit_flag) {
-            memset(ingest.inbuf, 0, sizeof(ingest.inbuf));
-            strcpy(ingest.inbuf, ingest.tmp_history);
-            ingest.inlen = strlen(ingest.inbuf);
-            ingest.inpos = ingest.inlen;
+            gapbuf_set(ingest.inbuf, ingest.tmp_history);
             ingest.mode = INGEST_MODE_NORMAL;
             free(ingest.prepend);
             ingest.prepend = NULL;
@@ -744,35 +873,38 @@ mode_hex(int ch)
 
     switch (ch) {
     case '\n': { /* send inputs */
-        char hexbuf[sizeof(ingest.inbuf)/2];
-        size_t inbuflen = strlen(ingest.inbuf);
+        const char *line;
+        size_t inbuflen = gapbuf_len(ingest.inbuf);
+        char *hexbuf;
         size_t hexlen = 0;
+
         /* assume leading 0 on odd length buffers */
         if (inbuflen % 2 != 0) {
-            memmove(&ingest.inbuf[1], ingest.inbuf, inbuflen);
-            ingest.inbuf[0] = '0';
+            gapbuf_move(ingest.inbuf, 0);
+            gapbuf_insert(ingest.inbuf, "0", 1);
             inbuflen++;
         }
+        line = gapbuf_str(ingest.inbuf);
+        hexbuf = malloc(inbuflen / 2 + 1);
 
         for (int i = 0; i < inbuflen; i += 2) {
-            char tmp = ingest.inbuf[i+2];
+            char digits[3] = { line[i], line[i+1], '\0' };
             char *inval;
             long ch;
 
-            ingest.inbuf[i+2] = '\0';
-            ch = strtol(&ingest.inbuf[i], &inval, 16);
-            ingest.inbuf[i+2] = tmp;
+            ch = strtol(digits, &inval, 16);
 
             /* strtol could not parse a character */
-            if (inval != &ingest.inbuf[i+2])
+            if (inval != &digits[2])
                 break;
 
             hexbuf[i/2] = ch;
             hexlen++;
         }
 
-        inter_command_wait();
         cheerios_input(hexbuf, hexlen);
+        txq_end_cmd();
+        free(hexbuf);
         if (ingest.config->echo) {
             cheerios_insert(">> (hex)\r\n", 10);
             for (int i = 0; i < hexlen; i++) {
@@ -783,28 +915,16 @@ mode_hex(int ch)
                 ) {
                     cheerios_insert("\r\n", 2);
                 }
-                cheerios_insert(&ingest.inbuf[i*2], 2);
+                cheerios_insert(&line[i*2], 2);
                 cheerios_insert(" ", 1);
             }
             cheerios_insert("\r\n", 2);
         }
 
         /* store in history */
-        ingest.history_pos = ingest.history_len;
-        if (ingest.inlen > 0) {
-            ingest.history_len++;
-            ingest.history = realloc(ingest.history, ingest.history_len * sizeof(char *));
-            ingest.history[ingest.history_pos] = strdup(ingest.inbuf);
-            ingest.history_pos++;
-            if (ingest.history_fd) {
-                fwrite(ingest.inbuf, 1, strlen(ingest.inbuf), ingest.history_fd);
-                fwrite("\n", 1, 1, ingest.history_fd);
-            }
-        }
+        history_add(ingest.history, line);
 
-        memset(ingest.inbuf, 0, sizeof(ingest.inbuf));
-        ingest.inpos = 0;
-        ingest.inlen = 0;
+        gapbuf_clear(ingest.inbuf);
         ingest_refresh();
 
         break;
@@ -846,74 +966,32 @@ handle_functions(int ch)
     case 525: /* ctrl + down arrow */
         cheerios_gofwd(1);
         return 1;
-    case KEY_RESIZE:
-        bytenuts_update_screen_size();
-        return 1;
     case KEY_BACKSPACE:
-    {
-        if (ingest.inpos == 0) {
-            return 1;
-        } else if (ingest.inpos == ingest.inlen) {
-            ingest.inpos--;
-            ingest.inlen--;
-            ingest.inbuf[ingest.inlen] = '\0';
+        if (gapbuf_backspace(ingest.inbuf))
             ingest_refresh();
-            return 1;
-        }
-
-        char tmp[1024];
-        int tmp_len = ingest.inlen - ingest.inpos;
-
-        memcpy(tmp, &ingest.inbuf[ingest.inpos], ingest.inlen - ingest.inpos);
-        ingest.inpos--;
-        ingest.inlen--;
-        memcpy(&ingest.inbuf[ingest.inpos], tmp, tmp_len);
-        ingest.inbuf[ingest.inlen] = '\0';
-        ingest_refresh();
-
         return 1;
-    }
     case KEY_DC: /* delete key */
-    {
-        char tmp[1024];
-        int tmp_len;
-
-        if (ingest.inpos == ingest.inlen) {
-            return 1;
-        } else if (ingest.inpos == ingest.inlen - 1) {
-            ingest.inbuf[ingest.inpos] = '\0';
-            ingest.inlen--;
+        if (gapbuf_delete(ingest.inbuf))
             ingest_refresh();
-            return 1;
-        }
-
-        tmp_len = ingest.inlen - ingest.inpos - 1;
-        memcpy(tmp, &ingest.inbuf[ingest.inpos + 1], tmp_len);
-        ingest.inlen--;
-        memcpy(&ingest.inbuf[ingest.inpos], tmp, tmp_len);
-        ingest.inbuf[ingest.inlen] = '\0';
-        ingest_refresh();
-
         return 1;
-    }
     case KEY_LEFT:
-        if (ingest.inpos == 0)
+        if (gapbuf_pos(ingest.inbuf) == 0)
             return 1;
-        ingest.inpos--;
+        gapbuf_move(ingest.inbuf, gapbuf_pos(ingest.inbuf) - 1);
         ingest_refresh();
         return 1;
     case KEY_RIGHT:
-        if (ingest.inpos == ingest.inlen)
+        if (gapbuf_pos(ingest.inbuf) == gapbuf_len(ingest.inbuf))
             return 1;
-        ingest.inpos++;
+        gapbuf_move(ingest.inbuf, gapbuf_pos(ingest.inbuf) + 1);
         ingest_refresh();
         return 1;
     case KEY_END:
-        ingest.inpos = ingest.inlen;
+        gapbuf_move(ingest.inbuf, gapbuf_len(ingest.inbuf));
         ingest_refresh();
         return 1;
     case KEY_HOME:
-        ingest.inpos = 0;
+        gapbuf_move(ingest.inbuf, 0);
         ingest_refresh();
         return 1;
 #if 0
@@ -944,10 +1022,13 @@ print_stats()
 
     sprintf(st_line, "\r\nSTATS\r\n");
     cheerios_insert(st_line, strlen(st_line));
-    sprintf(st_line, "input line count: %d\r\n", ingest.history_len);
+    sprintf(st_line, "input line count: %d\r\n", history_len(ingest.history));
     cheerios_insert(st_line, strlen(st_line));
 
     cheerios_print_stats();
+    txq_print_stats();
+    periodic_print_stats();
+    latency_print_stats();
     bytenuts_print_stats();
 
     return 0;
@@ -956,113 +1037,22 @@ print_stats()
 static int
 auto_complete()
 {
-    char cmd[1024];
-    char line[1024];
-    char **matches = NULL;
-    int nmatches = 0;
-    FILE *sh = NULL;
-    char *inbuf_cpy = NULL;
-    char *inbuf_basename = NULL;
-    size_t inbuf_basename_len;
-
-    /* retrieve directory listing with ls */
-    inbuf_cpy = strdup(ingest.inbuf);
-    if (ingest.inlen > 0 && ingest.inbuf[ingest.inlen - 1] == '/') {
-        snprintf(
-            cmd, sizeof(cmd),
-            "cd %s 2> /dev/null && ls -1 2> /dev/null",
-            ingest.inbuf
-        );
-        inbuf_basename = "";
-    } else {
-        snprintf(
-            cmd, sizeof(cmd),
-            "cd $(dirname \"%s\") 2> /dev/null && ls -1 2> /dev/null",
-            ingest.inbuf
-        );
-        inbuf_basename = basename(inbuf_cpy);
-    }
-    inbuf_basename_len = strlen(inbuf_basename);
-
-    sh = popen(cmd, "r");
-    while (fgets(line, sizeof(line), sh)) {
-        size_t line_len = strlen(line);
-        while (line[line_len - 1] == '\n' || line[line_len - 1] == '\r') {
-            line[line_len - 1] = '\0';
-            line_len = strlen(line);
-        }
-
-        if (!memcmp(inbuf_basename, line, inbuf_basename_len)) {
-            nmatches++;
-            matches = realloc(matches, sizeof(char *) * nmatches);
-            matches[nmatches - 1] = strdup(line);
-        }
-    }
+    int unique;
+    int is_dir;
+    char *add = complete_path(gapbuf_str(ingest.inbuf), &unique, &is_dir);
 
-    /* the cd/ls just failed, ignore output */
-    int ret = pclose(sh);
-    if (ret)
-        goto auto_complete_cleanup;
-
-    if (nmatches == 0)
-        goto auto_complete_cleanup;
-
-    /* check if we can fill the inbuf */
-    int offset = inbuf_basename_len;
-
-    while (1) {
-        char add = matches[0][offset];
-
-        for (int i = 1; i < nmatches; i++) {
-            if (add != matches[i][offset]) {
-                add = '\0';
-                break;
-            }
-        }
-
-        if (add == '\0')
-            break;
-
-        offset++;
-    }
-
-    if (offset > inbuf_basename_len) {
-        size_t add_len = offset - inbuf_basename_len;
-
-        if (add_len + ingest.inlen >= sizeof(ingest.inbuf))
-            add_len = sizeof(ingest.inbuf) - ingest.inlen - 1;
+    if (!add)
+        return 0;
 
-        memcpy(&ingest.inbuf[ingest.inlen], &matches[0][inbuf_basename_len], add_len);
-        ingest.inlen += add_len;
-        ingest.inpos = ingest.inlen;
-    }
+    /* completions always go on the end */
+    gapbuf_move(ingest.inbuf, gapbuf_len(ingest.inbuf));
+    gapbuf_insert(ingest.inbuf, add, strlen(add));
 
     /* auto complete directory '/' */
-    if (nmatches == 1) {
-        struct stat st;
-
-        stat(ingest.inbuf, &st);
-        if (
-            S_ISDIR(st.st_mode) &&
-            ingest.inlen < sizeof(ingest.inbuf) - 1 &&
-            (ingest.inpos == 0 || ingest.inbuf[ingest.inpos - 1] != '/')
-        ) {
-            ingest.inbuf[ingest.inpos] = '/';
-            ingest.inpos++;
-            ingest.inlen++;
-        }
-    }
-
-auto_complete_cleanup:
-    if (matches) {
-        for (int i = 0; i < nmatches; i++) {
-            free(matches[i]);
-        }
-        free(matches);
-    }
+    if (unique && is_dir)
+        gapbuf_insert(ingest.inbuf, "/", 1);
 
-    if (inbuf_cpy)
-        free(inbuf_cpy);
+    free(add);
 
     return 0;
 }
@@ -1117,19 +1107,3 @@ update_cmd_pg_status()
         bytenuts_set_status(STATUS_CMDPAGE, "n/a");
     }
 }
-
-static void
-inter_command_wait()
-{
-    struct timespec target;
-    struct timespec now;
-
-    clock_gettime(CLOCK_REALTIME, &now);
-    memcpy(&target, &ingest.cmd_ts, sizeof(struct timespec));
-
-    timer_add_ms(&target, ingest.config->inter_cmd_to);
-    timer_sub(&target, &now);
-
-    nanosleep(&target, NULL);
-    clock_gettime(CLOCK_REALTIME, &ingest.cmd_ts);
-}
@@ -12,29 +12,31 @@
 
 #include "bstr.h"
 #include "bytenuts.h"
+#include "gapbuf.h"
+#include "history.h"
 
 enum ingest_mode_enum {
     INGEST_MODE_NORMAL = 0,
     INGEST_MODE_XMODEM,
     INGEST_MODE_XMODEM1K,
     INGEST_MODE_HEX,
+    INGEST_MODE_SEND, /* reading the path of a text file to send */
+    INGEST_MODE_SCRIPT, /* reading the path of a script to run */
 };
 
 typedef struct ingest_struct {
     WINDOW *input;
-    pthread_mutex_t *term_lock;
     pthread_t thr;
     volatile int running;
     char *prepend; /* string to be prepended in the prompt */
-    char inbuf[4096];
-    int inpos; /* cursor position within the inbuf itself */
-    int inlen; /* length of the input buffer */
-    char **history; /* array of strings representing the command history */
+    gapbuf_handle inbuf; /* the line being edited */
+    history_handle history; /* command history, journaled to history_filename */
     char *history_filename; /* realpath of inbuf.pid.log */
-    FILE *history_fd;
-    char tmp_history[4096]; /* copy of inbuf before we load in history */
-    int history_len;
-    int history_pos; /* where we currently reside in the history */
+    char *tmp_history; /* copy of inbuf before we load in history */
+    /* reverse incremental history search, started with ctrl-r */
+    int searching;
+    int search_failed; /* nothing matches the query */
+    gapbuf_handle search; /* the query */
     int mode;
     bytenuts_config_t *config;
 #define INGEST_COMMAND_PGSZ (10)
@@ -46,8 +48,14 @@ typedef struct ingest_struct {
     int cmd_pgs_n;
     /* what command page is currently selected */
     int cmd_pg_cur;
-    struct timespec cmd_ts; /* last command sent timestamp */
-    bstr_history_handle xmodem_hist; /* xmodem filename transfer history */
+    bstr_history_handle xmodem_hist; /* filename history for file transfers */
+    /* copy of the input line for the UI thread to draw */
+    pthread_mutex_t shown_lock;
+    char *shown_prepend;
+    char *shown_buf;
+    int shown_cap;
+    int shown_len;
+    int shown_pos;
 } ingest_t;
 
 /* startup the input window thread */
@@ -59,7 +67,11 @@ int ingest_stop();
 /* refresh the inbuf window */
 int ingest_refresh();
 
-/* Set the the command history directly. Values are copied */
+/* draw the input line into its window, UI thread only */
+void ingest_draw();
+
+/* Set the command history directly, oldest first. Takes ownership of the
+ * array and its strings, which must be malloc'd and have no line endings. */
 int ingest_set_history(char **history, int history_len);
 
 #endif /* _INGEST_H_ */
@@ -0,0 +1,372 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bstr.h"
+#include "cheerios.h"
+#include "latency.h"
+#include "timer_math.h"
+#include "txq.h"
+
+typedef struct latency_row_struct {
+    const char *text;
+    uint64_t sent;
+    uint64_t unanswered;
+    uint64_t first_n;
+    uint64_t first[4]; /* p50, p90, p99, max */
+    uint64_t prompt_n;
+    uint64_t prompt[4];
+} latency_row_t;
+
+static latency_t latency;
+
+static void tx_sent(const struct timespec *ts, void *arg);
+static void rx_tap(const char *buf, size_t len, void *arg);
+static int find_cmd(const char *line);
+static uint64_t since_tx_us(const struct timespec *now);
+static int snapshot(latency_row_t *rows);
+static void summarize(hist_handle hist, uint64_t *n, uint64_t *vals);
+
+int
+latency_start(bytenuts_t *bytenuts)
+{
+    memset(&latency, 0, sizeof(latency));
+
+    latency.config = &bytenuts->config;
+    if (latency.config->latency_prompt && *latency.config->latency_prompt) {
+#ifndef __MINGW32__
+        if (regcomp(
+                &latency.prompt, latency.config->latency_prompt,
+                REG_EXTENDED | REG_NOSUB
+        )) {
+            return -1;
+        }
+#endif
+        latency.use_prompt = 1;
+    }
+
+    pthread_mutex_init(&latency.lock, NULL);
+    latency.running = 1;
+    cheerios_tap_add(rx_tap, NULL);
+
+    return 0;
+}
+
+int
+latency_stop()
+{
+    if (!latency.running)
+        return 0;
+
+    cheerios_tap_remove(rx_tap, NULL);
+
+    pthread_mutex_lock(&latency.lock);
+    latency.running = 0;
+    /* a callback still queued on the TX thread now finds nothing to do */
+    latency.phase = LATENCY_IDLE;
+    latency.gen++;
+    pthread_mutex_unlock(&latency.lock);
+
+    for (int i = 0; i < latency.cmds_n; i++) {
+        free(latency.cmds[i].text);
+        hist_destroy(latency.cmds[i].first_rx);
+        hist_destroy(latency.cmds[i].prompt);
+    }
+    latency.cmds_n = 0;
+
+#ifndef __MINGW32__
+    if (latency.use_prompt)
+        regfree(&latency.prompt);
+#endif
+
+    return 0;
+}
+
+int
+latency_cmd(const char *line)
+{
+    uint64_t gen;
+    int idx;
+
+    if (!latency.running || *line == '\0')
+        return 0;
+
+    pthread_mutex_lock(&latency.lock);
+
+    if (latency.phase != LATENCY_IDLE && latency.use_prompt)
+        latency.cmds[latency.cur].unanswered++;
+
+    idx = find_cmd(line);
+    if (idx < 0) {
+        latency.untracked++;
+        latency.phase = LATENCY_IDLE;
+        latency.gen++;
+        pthread_mutex_unlock(&latency.lock);
+        return 0;
+    }
+
+    latency.cmds[idx].sent++;
+    latency.cur = idx;
+    latency.phase = LATENCY_WAIT_TX;
+    latency.rx_len = 0;
+    gen = ++latency.gen;
+
+    pthread_mutex_unlock(&latency.lock);
+
+    txq_on_sent(tx_sent, (void *)(uintptr_t)gen);
+
+    return 0;
+}
+
+int
+latency_print_stats()
+{
+    latency_row_t *rows;
+    uint64_t untracked;
+    int rows_n;
+
+    if (!latency.running)
+        return 0;
+
+    rows = calloc(LATENCY_CMDS_MAX, sizeof(latency_row_t));
+
+    pthread_mutex_lock(&latency.lock);
+    rows_n = snapshot(rows);
+    untracked = latency.untracked;
+    pthread_mutex_unlock(&latency.lock);
+
+    for (int i = 0; i < rows_n; i++) {
+        latency_row_t *row = &rows[i];
+        char v[4][16];
+
+        cheerios_print("latency %s: sent %llu\r\n", row->text, (unsigned long long)row->sent);
+        if (row->first_n > 0) {
+            cheerios_print(
+                "  first byte: p50 %s, p90 %s, p99 %s, max %s\r\n",
+                hist_fmt_us(v[0], 16, row->first[0]), hist_fmt_us(v[1], 16, row->first[1]),
+                hist_fmt_us(v[2], 16, row->first[2]), hist_fmt_us(v[3], 16, row->first[3])
+            );
+        }
+        if (row->prompt_n > 0) {
+            cheerios_print(
+                "  prompt: p50 %s, p90 %s, p99 %s, max %s\r\n",
+                hist_fmt_us(v[0], 16, row->prompt[0]), hist_fmt_us(v[1], 16, row->prompt[1]),
+                hist_fmt_us(v[2], 16, row->prompt[2]), hist_fmt_us(v[3], 16, row->prompt[3])
+            );
+        }
+        if (row->unanswered > 0) {
+            cheerios_print("  unanswered: %llu\r\n", (unsigned long long)row->unanswered);
+        }
+    }
+    if (untracked > 0) {
+        cheerios_print(
+            "latency: %llu commands past the first %d not timed\r\n",
+            (unsigned long long)untracked, LATENCY_CMDS_MAX
+        );
+    }
+
+    free(rows);
+
+    return 0;
+}
+
+char *
+latency_export()
+{
+    latency_row_t *rows;
+    int rows_n;
+    char tstr[32];
+    time_t now;
+    char *path;
+    FILE *out;
+
+    if (!latency.running)
+        return NULL;
+
+    time(&now);
+    strftime(tstr, sizeof(tstr), "%Y%m%d-%H%M%S", localtime(&now));
+    path = bstr_print(NULL, "latency.%s.csv", tstr);
+
+    out = fopen(path, "w");
+    if (!out) {
+        free(path);
+        return NULL;
+    }
+
+    rows = calloc(LATENCY_CMDS_MAX, sizeof(latency_row_t));
+
+    pthread_mutex_lock(&latency.lock);
+    rows_n = snapshot(rows);
+    pthread_mutex_unlock(&latency.lock);
+
+    fprintf(
+        out,
+        "command,sent,unanswered,"
+        "first_n,first_p50_us,first_p90_us,first_p99_us,first_max_us,"
+        "prompt_n,prompt_p50_us,prompt_p90_us,prompt_p99_us,prompt_max_us\n"
+    );
+    for (int i = 0; i < rows_n; i++) {
+        latency_row_t *row = &rows[i];
+
+        /* quoted, with quotes doubled */
+        fputc('"', out);
+        for (const char *c = row->text; *c; c++) {
+            if (*c == '"')
+                fputc('"', out);
+            fputc(*c, out);
+        }
+        fputc('"', out);
+
+        fprintf(
+            out, ",%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+            (unsigned long long)row->sent, (unsigned long long)row->unanswered,
+            (unsigned long long)row->first_n,
+            (unsigned long long)row->first[0], (unsigned long long)row->first[1],
+            (unsigned long long)row->first[2], (unsigned long long)row->first[3],
+            (unsigned long long)row->prompt_n,
+            (unsigned long long)row->prompt[0], (unsigned long long)row->prompt[1],
+            (unsigned long long)row->prompt[2], (unsigned long long)row->prompt[3]
+        );
+    }
+
+    fclose(out);
+    free(rows);
+
+    return path;
+}
+
+/* Runs on the TX thread once the command has been written */
+static void
+tx_sent(const struct timespec *ts, void *arg)
+{
+    pthread_mutex_lock(&latency.lock);
+
+    if (latency.gen == (uintptr_t)arg && latency.phase == LATENCY_WAIT_TX) {
+        latency.tx_done = *ts;
+        latency.phase = LATENCY_WAIT_RX;
+    }
+
+    pthread_mutex_unlock(&latency.lock);
+}
+
+/* Runs on the reader thread */
+static void
+rx_tap(const char *buf, size_t len, void *arg)
+{
+    struct timespec now;
+    latency_cmd_t *cmd;
+
+    pthread_mutex_lock(&latency.lock);
+
+    /* anything read while the command is still going out is not an answer */
+    if (latency.phase != LATENCY_WAIT_RX && latency.phase != LATENCY_WAIT_PROMPT) {
+        pthread_mutex_unlock(&latency.lock);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    cmd = &latency.cmds[latency.cur];
+
+    if (latency.phase == LATENCY_WAIT_RX) {
+        hist_add(cmd->first_rx, since_tx_us(&now));
+        latency.phase = latency.use_prompt ? LATENCY_WAIT_PROMPT : LATENCY_IDLE;
+    }
+
+    if (latency.phase != LATENCY_WAIT_PROMPT) {
+        pthread_mutex_unlock(&latency.lock);
+        return;
+    }
+
+    /* keep only the newest LATENCY_RX_MAX bytes */
+    if (len > LATENCY_RX_MAX) {
+        buf += len - LATENCY_RX_MAX;
+        len = LATENCY_RX_MAX;
+    }
+    if (latency.rx_len + len > LATENCY_RX_MAX) {
+        size_t drop = latency.rx_len + len - LATENCY_RX_MAX;
+
+        memmove(latency.rx, &latency.rx[drop], latency.rx_len - drop);
+        latency.rx_len -= drop;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        /* a NUL would end the string early */
+        latency.rx[latency.rx_len++] = buf[i] ? buf[i] : ' ';
+    }
+    latency.rx[latency.rx_len] = '\0';
+
+#ifdef __MINGW32__
+    /* no regex.h, the prompt is matched literally */
+    if (strstr(latency.rx, latency.config->latency_prompt)) {
+#else
+    if (!regexec(&latency.prompt, latency.rx, 0, NULL, 0)) {
+#endif
+        hist_add(cmd->prompt, since_tx_us(&now));
+        latency.phase = LATENCY_IDLE;
+    }
+
+    pthread_mutex_unlock(&latency.lock);
+}
+
+/* Index of the entry for line, added if new. -1 if there is no room.
+ * Called locked. */
+static int
+find_cmd(const char *line)
+{
+    latency_cmd_t *cmd;
+
+    for (int i = 0; i < latency.cmds_n; i++) {
+        if (!strcmp(latency.cmds[i].text, line))
+            return i;
+    }
+
+    if (latency.cmds_n == LATENCY_CMDS_MAX)
+        return -1;
+
+    cmd = &latency.cmds[latency.cmds_n];
+    cmd->text = strdup(line);
+    cmd->sent = 0;
+    cmd->unanswered = 0;
+    cmd->first_rx = hist_create();
+    cmd->prompt = hist_create();
+
+    return latency.cmds_n++;
+}
+
+static uint64_t
+since_tx_us(const struct timespec *now)
+{
+    int64_t ns = timer_diff_ns(now, &latency.tx_done);
+
+    return ns > 0 ? ns / 1000 : 0;
+}
+
+/* Copy out what the stats need, so nothing is printed while locked. The text
+ * stays put until latency_stop. Called locked. */
+static int
+snapshot(latency_row_t *rows)
+{
+    for (int i = 0; i < latency.cmds_n; i++) {
+        latency_cmd_t *cmd = &latency.cmds[i];
+
+        rows[i].text = cmd->text;
+        rows[i].sent = cmd->sent;
+        rows[i].unanswered = cmd->unanswered;
+        summarize(cmd->first_rx, &rows[i].first_n, rows[i].first);
+        summarize(cmd->prompt, &rows[i].prompt_n, rows[i].prompt);
+    }
+
+    return latency.cmds_n;
+}
+
+static void
+summarize(hist_handle hist, uint64_t *n, uint64_t *vals)
+{
+    *n = hist_count(hist);
+    vals[0] = hist_percentile(hist, 50);
+    vals[1] = hist_percentile(hist, 90);
+    vals[2] = hist_percentile(hist, 99);
+    vals[3] = hist_max(hist);
+}
@@ -0,0 +1,80 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#ifndef __MINGW32__
+#  include <regex.h>
+#endif
+
+#include "bytenuts.h"
+#include "hist.h"
+
+/* Times the device's response to each command entered at the input line.
+ * The clock starts when the last byte of the command has been written to the
+ * port and stops at the first byte read back, and again when the
+ * latency_prompt pattern shows up in the output. Both are kept in a histogram
+ * per distinct command. Only the latest command is timed, one entered before
+ * the previous was answered ends that measurement. */
+
+/* distinct commands kept, further ones are not timed */
+#define LATENCY_CMDS_MAX (64)
+
+/* output kept for matching the prompt, older output is dropped */
+#define LATENCY_RX_MAX (4096)
+
+typedef enum {
+    LATENCY_IDLE,
+    LATENCY_WAIT_TX, /* queued, not all written yet */
+    LATENCY_WAIT_RX, /* written, nothing read back yet */
+    LATENCY_WAIT_PROMPT,
+} latency_phase_t;
+
+typedef struct latency_cmd_struct {
+    char *text;
+    uint64_t sent;
+    uint64_t unanswered; /* superseded before the prompt was seen */
+    hist_handle first_rx; /* us to the first byte back */
+    hist_handle prompt; /* us to the prompt */
+} latency_cmd_t;
+
+typedef struct latency_struct {
+    /* the output tap takes it on the reader thread with cheerios locked, so
+     * never print while holding it */
+    pthread_mutex_t lock;
+    int running;
+    bytenuts_config_t *config;
+    int use_prompt;
+#ifndef __MINGW32__
+    regex_t prompt;
+#endif
+    latency_cmd_t cmds[LATENCY_CMDS_MAX];
+    int cmds_n;
+    uint64_t untracked; /* commands past LATENCY_CMDS_MAX */
+    /* the command being timed */
+    latency_phase_t phase;
+    int cur;
+    uint64_t gen; /* bumped per command, tells stale TX callbacks apart */
+    struct timespec tx_done;
+    char rx[LATENCY_RX_MAX + 1];
+    size_t rx_len;
+} latency_t;
+
+/* Start timing commands, the prompt is compiled from the config. Returns -1
+ * if it does not compile. */
+int latency_start(bytenuts_t *bytenuts);
+
+int latency_stop();
+
+/* Time the response to line, call once it and its line ending are queued */
+int latency_cmd(const char *line);
+
+int latency_print_stats();
+
+/* Write a CSV of the percentiles of every command to
+ * latency.<timestamp>.csv in the working directory. Returns the path, to be
+ * freed, or NULL. */
+char *latency_export();
+
+#endif /* _LATENCY_H_ */
@@ -11,6 +11,8 @@ static void sigint_handler(int s);
 int
 main(int argc, char **argv)
 {
+    int ret;
+
 #ifndef __MINGW32__
     struct sigaction act;
     act.sa_handler = sigint_handler;
@@ -19,12 +21,14 @@ main(int argc, char **argv)
     sigaction(SIGINT, &act, NULL);
 #endif
 
-    if (bytenuts_run(argc, argv)) {
+    ret = bytenuts_run(argc, argv);
+    if (ret < 0) {
         bytenuts_stop();
         exit(1);
     }
 
-    exit(0);
+    /* batch runs exit with the script's result */
+    exit(ret);
 }
 
 #ifndef __MINGW32__
@@ -24,8 +24,8 @@ paths_append(char *base, const char *suffix)
     baselen = strlen(base);
 
     if (
-        (baselen == 0) ||
-        ((base[baselen-1] != '/') && (base[baselen-1] == '\\'))
+        (baselen > 0) &&
+        ((base[baselen-1] != '/') && (base[baselen-1] != '\\'))
     ) {
         /* no separator at end of path */
 #if __MINGW32__
@@ -84,7 +84,7 @@ paths_command_file(int idx)
 }
 
 char *
-paths_logfile(const char *prefix, long long pid)
+paths_logfile(const char *prefix, const char *session, long long pid)
 {
     char *ret = paths_bnconf_dir();
 
@@ -92,8 +92,30 @@ paths_logfile(const char *prefix, long long pid)
         return NULL;
 
     if (pid > 0) {
-        return bstr_print(ret, "/%s." BSTR_LLD ".log", prefix, pid);
+        return bstr_print(ret, "/%s.%s." BSTR_LLD ".log", prefix, session, pid);
     } else {
-        return bstr_print(ret, "/%s.log", prefix);
+        return bstr_print(ret, "/%s.%s.log", prefix, session);
     }
 }
+
+char *
+paths_sessions_index()
+{
+    char *ret = paths_bnconf_dir();
+
+    if (!ret)
+        return NULL;
+
+    return paths_append(ret, "sessions");
+}
+
+char *
+paths_ctl_socket(const char *session)
+{
+    char *ret = paths_bnconf_dir();
+
+    if (!ret)
+        return NULL;
+
+    return bstr_print(ret, "/%s.sock", session);
+}
@@ -13,8 +13,15 @@ char *paths_bnconf_default();
 /* Generate the path to the command<idx> file */
 char *paths_command_file(int idx);
 
-/* Generate a logfile path of the form ~/.config/bytenuts/<prefix>[.<pid>].log
+/* Generate a logfile path of the form
+ * ~/.config/bytenuts/<prefix>.<session>[.<pid>].log
  * PID only inserted if >0 */
-char *paths_logfile(const char *prefix, long long pid);
+char *paths_logfile(const char *prefix, const char *session, long long pid);
+
+/* Get the path to the index of stored sessions */
+char *paths_sessions_index();
+
+/* Generate the control socket path ~/.config/bytenuts/<session>.sock */
+char *paths_ctl_socket(const char *session);
 
 #endif /* _PATHS_H_ */
@@ -0,0 +1,450 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bstr.h"
+#include "cheerios.h"
+#include "periodic.h"
+#include "timer_math.h"
+#include "txq.h"
+
+static periodic_t periodic;
+
+static void *periodic_thread(void *arg);
+static int parse_cmd(periodic_cmd_t *cmd, const char *spec, const char *ending);
+static int collect_due(const struct timespec *now, int held, int *fire);
+static void next_wake(struct timespec *wake);
+static void record_send(periodic_cmd_t *cmd, const struct timespec *now);
+static void reschedule(int idx, const struct timespec *now);
+static void wheel_insert(int idx);
+static void wheel_remove(int idx);
+static uint64_t tick_of(const struct timespec *ts);
+static void tick_time(uint64_t tick, struct timespec *ts);
+static void add_ns(struct timespec *ts, uint64_t ns);
+static void get_now(struct timespec *ts);
+
+int
+periodic_start(bytenuts_t *bytenuts)
+{
+    bytenuts_config_t *config = &bytenuts->config;
+    const char *ending = config->no_crlf ? "\n" : "\r\n";
+    struct timespec now;
+
+    memset(&periodic, 0, sizeof(periodic));
+    for (int i = 0; i < PERIODIC_SLOTS; i++) {
+        periodic.wheel[i] = -1;
+    }
+
+    for (int i = 0; i < config->periodic_n; i++) {
+        if (periodic.cmds_n == PERIODIC_MAX) {
+            cheerios_print("BYTENUTS: only %d periodic commands are kept\r\n", PERIODIC_MAX);
+            break;
+        }
+
+        if (parse_cmd(&periodic.cmds[periodic.cmds_n], config->periodic[i], ending)) {
+            cheerios_print("BYTENUTS: ignoring malformed periodic command \"%s\"\r\n", config->periodic[i]);
+            continue;
+        }
+        periodic.cmds_n++;
+    }
+
+    if (periodic.cmds_n == 0)
+        return 0;
+
+    get_now(&now);
+    periodic.base = now;
+
+    /* the first of each goes out one interval from now */
+    for (int i = 0; i < periodic.cmds_n; i++) {
+        periodic_cmd_t *cmd = &periodic.cmds[i];
+
+        cmd->enabled = 1;
+        cmd->due = now;
+        timer_add_ms(&cmd->due, cmd->interval_ms);
+        wheel_insert(i);
+    }
+
+    pthread_mutex_init(&periodic.lock, NULL);
+    {
+        pthread_condattr_t attr;
+
+        /* due times must not move when the wall clock is stepped */
+        pthread_condattr_init(&attr);
+#ifndef __MINGW32__
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+        pthread_cond_init(&periodic.cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    periodic.running = 1;
+    if (pthread_create(&periodic.thr, NULL, periodic_thread, NULL)) {
+        periodic.running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+periodic_stop()
+{
+    if (!periodic.running)
+        return 0;
+
+    pthread_mutex_lock(&periodic.lock);
+    periodic.running = 0;
+    pthread_cond_signal(&periodic.cond);
+    pthread_mutex_unlock(&periodic.lock);
+
+    pthread_join(periodic.thr, NULL);
+
+    for (int i = 0; i < periodic.cmds_n; i++) {
+        free(periodic.cmds[i].text);
+        free(periodic.cmds[i].out);
+    }
+    periodic.cmds_n = 0;
+
+    return 0;
+}
+
+int
+periodic_toggle(int idx)
+{
+    periodic_cmd_t *cmd;
+    int ret;
+
+    if (idx < 0 || idx >= periodic.cmds_n)
+        return -1;
+
+    pthread_mutex_lock(&periodic.lock);
+
+    cmd = &periodic.cmds[idx];
+    if (cmd->enabled) {
+        wheel_remove(idx);
+        cmd->enabled = 0;
+    } else {
+        get_now(&cmd->due);
+        timer_add_ms(&cmd->due, cmd->interval_ms);
+        /* the time spent disabled is no interval */
+        memset(&cmd->last, 0, sizeof(cmd->last));
+        cmd->enabled = 1;
+        wheel_insert(idx);
+        pthread_cond_signal(&periodic.cond);
+    }
+    ret = cmd->enabled;
+
+    pthread_mutex_unlock(&periodic.lock);
+
+    return ret;
+}
+
+int
+periodic_count()
+{
+    return periodic.cmds_n;
+}
+
+int
+periodic_list()
+{
+    if (periodic.cmds_n == 0) {
+        cheerios_info("No periodic commands configured");
+        return 0;
+    }
+
+    pthread_mutex_lock(&periodic.lock);
+    cheerios_print("Periodic commands:\r\n");
+    for (int i = 0; i < periodic.cmds_n; i++) {
+        cheerios_print(
+            "%4d: every %ums %s (%s)\r\n", i + 1,
+            periodic.cmds[i].interval_ms, periodic.cmds[i].text,
+            periodic.cmds[i].enabled ? "on" : "off"
+        );
+    }
+    pthread_mutex_unlock(&periodic.lock);
+
+    return 0;
+}
+
+int
+periodic_print_stats()
+{
+    if (periodic.cmds_n == 0)
+        return 0;
+
+    pthread_mutex_lock(&periodic.lock);
+    for (int i = 0; i < periodic.cmds_n; i++) {
+        periodic_cmd_t *cmd = &periodic.cmds[i];
+
+        cheerios_print(
+            "periodic %d: every %ums %s, %s, sent %llu, missed %llu, "
+            "jitter avg %lluus max %lluus, late max %lluus\r\n",
+            i + 1, cmd->interval_ms, cmd->text, cmd->enabled ? "on" : "off",
+            (unsigned long long)cmd->sent, (unsigned long long)cmd->missed,
+            (unsigned long long)(cmd->jitter_n ? cmd->jitter_sum_ns / cmd->jitter_n / 1000 : 0),
+            (unsigned long long)(cmd->jitter_max_ns / 1000),
+            (unsigned long long)(cmd->late_max_ns / 1000)
+        );
+    }
+    pthread_mutex_unlock(&periodic.lock);
+
+    return 0;
+}
+
+static void *
+periodic_thread(void *arg)
+{
+    int fire[PERIODIC_MAX];
+
+    pthread_mutex_lock(&periodic.lock);
+
+    while (periodic.running) {
+        struct timespec now;
+        struct timespec wake;
+        int fire_n;
+
+        get_now(&now);
+        fire_n = collect_due(&now, txq_held(), fire);
+
+        if (fire_n > 0) {
+            /* the queue may block, toggles must not wait on it */
+            pthread_mutex_unlock(&periodic.lock);
+            for (int i = 0; i < fire_n; i++) {
+                txq_write(periodic.cmds[fire[i]].out, periodic.cmds[fire[i]].out_len);
+                txq_end_cmd();
+            }
+            pthread_mutex_lock(&periodic.lock);
+            continue;
+        }
+
+        next_wake(&wake);
+        pthread_cond_timedwait(&periodic.cond, &periodic.lock, &wake);
+    }
+
+    pthread_mutex_unlock(&periodic.lock);
+
+    return NULL;
+}
+
+/* "<ms> <command>" */
+static int
+parse_cmd(periodic_cmd_t *cmd, const char *spec, const char *ending)
+{
+    char *end;
+    long ms = strtol(spec, &end, 10);
+    size_t ending_len = strlen(ending);
+
+    if (end == spec || *end != ' ' || end[1] == '\0' || ms <= 0)
+        return -1;
+    end++;
+
+    memset(cmd, 0, sizeof(periodic_cmd_t));
+    cmd->interval_ms = ms;
+    cmd->text = strdup(end);
+    cmd->out = bstr_unescape(end, strlen(end), &cmd->out_len);
+    cmd->out = realloc(cmd->out, cmd->out_len + ending_len);
+    memcpy(&cmd->out[cmd->out_len], ending, ending_len);
+    cmd->out_len += ending_len;
+    cmd->next = -1;
+
+    return 0;
+}
+
+/* Walk the wheel up to now, taking out the commands that are due and putting
+ * them back in for their next period. Returns how many were put in fire, none
+ * while another transfer holds the line, those periods count as missed.
+ * Called with the lock held. */
+static int
+collect_due(const struct timespec *now, int held, int *fire)
+{
+    uint64_t now_tick = tick_of(now);
+    uint64_t first = UINT64_MAX;
+    int fire_n = 0;
+
+    /* skip the stretch nothing is due in rather than stepping through it,
+     * it can be long once everything has been disabled for a while */
+    for (int i = 0; i < periodic.cmds_n; i++) {
+        if (periodic.cmds[i].enabled && periodic.cmds[i].due_tick < first)
+            first = periodic.cmds[i].due_tick;
+    }
+    if (first > now_tick)
+        first = now_tick;
+    if (first > periodic.tick)
+        periodic.tick = first;
+
+    while (periodic.tick <= now_tick) {
+        int slot = periodic.tick % PERIODIC_SLOTS;
+        int pending = 0;
+        int next;
+
+        for (int idx = periodic.wheel[slot]; idx >= 0; idx = next) {
+            periodic_cmd_t *cmd = &periodic.cmds[idx];
+
+            next = cmd->next;
+            if (cmd->due_tick != periodic.tick)
+                continue;
+
+            /* later in the tick that has just started */
+            if (timer_cmp(&cmd->due, now) > 0) {
+                pending = 1;
+                continue;
+            }
+
+            wheel_remove(idx);
+            if (held) {
+                cmd->missed++;
+                /* the next send is no interval after the last one */
+                memset(&cmd->last, 0, sizeof(cmd->last));
+            } else {
+                record_send(cmd, now);
+                fire[fire_n++] = idx;
+            }
+            reschedule(idx, now);
+        }
+
+        if (pending)
+            break;
+        periodic.tick++;
+    }
+
+    return fire_n;
+}
+
+/* When the next command is due, the earliest one in the first tick of the
+ * wheel that has any. Called with the lock held. */
+static void
+next_wake(struct timespec *wake)
+{
+    for (uint64_t t = periodic.tick; t < periodic.tick + PERIODIC_SLOTS; t++) {
+        const struct timespec *best = NULL;
+
+        for (int idx = periodic.wheel[t % PERIODIC_SLOTS]; idx >= 0; idx = periodic.cmds[idx].next) {
+            periodic_cmd_t *cmd = &periodic.cmds[idx];
+
+            if (cmd->due_tick == t && (!best || timer_cmp(&cmd->due, best) < 0))
+                best = &cmd->due;
+        }
+
+        if (best) {
+            *wake = *best;
+            return;
+        }
+    }
+
+    /* nothing within a turn of the wheel */
+    tick_time(periodic.tick + PERIODIC_SLOTS, wake);
+}
+
+static void
+record_send(periodic_cmd_t *cmd, const struct timespec *now)
+{
+    int64_t late = timer_diff_ns(now, &cmd->due);
+
+    if (cmd->last.tv_sec || cmd->last.tv_nsec) {
+        int64_t dev = timer_diff_ns(now, &cmd->last) - (int64_t)cmd->interval_ms * 1000000;
+
+        if (dev < 0)
+            dev = -dev;
+        cmd->jitter_n++;
+        cmd->jitter_sum_ns += dev;
+        if ((uint64_t)dev > cmd->jitter_max_ns)
+            cmd->jitter_max_ns = dev;
+    }
+
+    if (late > 0 && (uint64_t)late > cmd->late_max_ns)
+        cmd->late_max_ns = late;
+
+    cmd->last = *now;
+    cmd->sent++;
+}
+
+/* Move the due time on by one period from the previous due time, not from
+ * now, so lateness does not carry over */
+static void
+reschedule(int idx, const struct timespec *now)
+{
+    periodic_cmd_t *cmd = &periodic.cmds[idx];
+    uint64_t interval_ns = (uint64_t)cmd->interval_ms * 1000000;
+
+    add_ns(&cmd->due, interval_ns);
+
+    /* fell behind by whole periods, skip them rather than sending a burst */
+    if (timer_cmp(&cmd->due, now) <= 0) {
+        uint64_t behind = timer_diff_ns(now, &cmd->due) / interval_ns + 1;
+
+        cmd->missed += behind;
+        add_ns(&cmd->due, behind * interval_ns);
+    }
+
+    wheel_insert(idx);
+}
+
+static void
+wheel_insert(int idx)
+{
+    periodic_cmd_t *cmd = &periodic.cmds[idx];
+    int slot;
+
+    cmd->due_tick = tick_of(&cmd->due);
+    /* a tick already passed would not be looked at again */
+    if (cmd->due_tick < periodic.tick)
+        cmd->due_tick = periodic.tick;
+
+    slot = cmd->due_tick % PERIODIC_SLOTS;
+    cmd->next = periodic.wheel[slot];
+    periodic.wheel[slot] = idx;
+}
+
+static void
+wheel_remove(int idx)
+{
+    int *link = &periodic.wheel[periodic.cmds[idx].due_tick % PERIODIC_SLOTS];
+
+    while (*link >= 0) {
+        if (*link == idx) {
+            *link = periodic.cmds[idx].next;
+            break;
+        }
+        link = &periodic.cmds[*link].next;
+    }
+    periodic.cmds[idx].next = -1;
+}
+
+static uint64_t
+tick_of(const struct timespec *ts)
+{
+    int64_t ns = timer_diff_ns(ts, &periodic.base);
+
+    return ns > 0 ? ns / PERIODIC_TICK_NS : 0;
+}
+
+static void
+tick_time(uint64_t tick, struct timespec *ts)
+{
+    *ts = periodic.base;
+    add_ns(ts, tick * PERIODIC_TICK_NS);
+}
+
+static void
+add_ns(struct timespec *ts, uint64_t ns)
+{
+    struct timespec tmp = {
+        .tv_sec = ns / 1000000000,
+        .tv_nsec = ns % 1000000000,
+    };
+
+    timer_add(ts, &tmp);
+}
+
+static void
+get_now(struct timespec *ts)
+{
+#ifdef __MINGW32__
+    clock_gettime(CLOCK_REALTIME, ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#endif
+}
@@ -0,0 +1,75 @@
+#ifndef _PERIODIC_H_
+#define _PERIODIC_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bytenuts.h"
+
+/* Sends the configured periodic commands from its own thread. Due times are
+ * kept on CLOCK_MONOTONIC in a hashed timer wheel of 1ms ticks, and the
+ * thread sleeps until the exact due time of the next command. Each next due
+ * time follows from the previous one rather than from when the command went
+ * out, so lateness never adds up, and periods that were missed altogether are
+ * skipped and counted. So are those due while txq_hold keeps the line for a
+ * file send or the like. */
+
+/* each is toggled with a single digit */
+#define PERIODIC_MAX (9)
+
+/* slots in the wheel, each is one tick of PERIODIC_TICK_NS */
+#define PERIODIC_SLOTS (256)
+#define PERIODIC_TICK_NS (1000000)
+
+typedef struct periodic_cmd_struct {
+    char *text; /* as configured, for messages */
+    char *out; /* what is sent, escapes expanded and the line ending added */
+    size_t out_len;
+    uint32_t interval_ms;
+    int enabled;
+    struct timespec due;
+    uint64_t due_tick; /* tick of the wheel due falls in */
+    int next; /* next command in the same slot, -1 at the end */
+    struct timespec last; /* when it was last sent, zero if not since enabled */
+    uint64_t sent;
+    uint64_t missed; /* periods skipped because the sender fell behind */
+    /* difference of each achieved interval from interval_ms */
+    uint64_t jitter_n;
+    uint64_t jitter_sum_ns;
+    uint64_t jitter_max_ns;
+    uint64_t late_max_ns; /* latest a send started after its due time */
+} periodic_cmd_t;
+
+typedef struct periodic_struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signalled on toggles and stop */
+    volatile int running;
+    pthread_t thr;
+    periodic_cmd_t cmds[PERIODIC_MAX];
+    int cmds_n;
+    int wheel[PERIODIC_SLOTS]; /* first command in each slot, -1 if empty */
+    struct timespec base; /* start of tick 0 */
+    uint64_t tick; /* ticks before this are done with */
+} periodic_t;
+
+/* Start the scheduler thread with the periodic commands from the config, all
+ * of them enabled. Does nothing if there are none. */
+int periodic_start(bytenuts_t *bytenuts);
+
+/* stop the thread and release memory */
+int periodic_stop();
+
+/* Enable or disable command idx (from 0), returns the new state or -1 if
+ * there is no such command */
+int periodic_toggle(int idx);
+
+/* Number of periodic commands */
+int periodic_count();
+
+/* list the commands and whether they are enabled in the output */
+int periodic_list();
+
+int periodic_print_stats();
+
+#endif /* _PERIODIC_H_ */
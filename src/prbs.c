@@ -0,0 +1,452 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "prbs.h"
+#include "timer_math.h"
+
+static prbs_t prbs;
+
+static void *gen_thread(void *arg);
+static void *chk_thread(void *arg);
+static int build_table(prbs_table_t *table, int order);
+static uint8_t gen_byte(const prbs_table_t *table, uint32_t *state);
+static int wait_tick(void);
+static void print_status(int tty, uint64_t *tx_last, uint64_t *rx_last);
+static void print_report(void);
+static uint64_t overruns(void);
+static double elapsed_s(void);
+
+int
+prbs_run(bytenuts_config_t *config, int order, const char *tx_path, const char *rx_path, uint32_t secs)
+{
+    struct timespec deadline;
+    uint64_t tx_last = 0;
+    uint64_t rx_last = 0;
+    int tty = isatty(STDERR_FILENO);
+    int ret;
+#ifndef __MINGW32__
+    sigset_t sigs;
+    sigset_t old_sigs;
+#endif
+
+    memset(&prbs, 0, sizeof(prbs));
+
+    if (build_table(&prbs.table, order)) {
+        fprintf(stderr, "bytenuts: no PRBS-%d, only 7, 15 and 31\n", order);
+        return BATCH_EXIT_ERROR;
+    }
+
+    if (rx_path && !strcmp(rx_path, tx_path))
+        rx_path = NULL;
+    prbs.tx_path = tx_path;
+    prbs.rx_path = rx_path ? rx_path : tx_path;
+
+    prbs.tx_fd = serial_open(tx_path, config->baud);
+    if (prbs.tx_fd == SERIAL_INVALID) {
+        fprintf(stderr, "bytenuts: failed to open serial port \"%s\"\n", tx_path);
+        return BATCH_EXIT_ERROR;
+    }
+
+    prbs.rx_fd = prbs.tx_fd;
+    if (rx_path) {
+        prbs.rx_fd = serial_open(rx_path, config->baud);
+        if (prbs.rx_fd == SERIAL_INVALID) {
+            fprintf(stderr, "bytenuts: failed to open serial port \"%s\"\n", rx_path);
+            serial_close(prbs.tx_fd);
+            return BATCH_EXIT_ERROR;
+        }
+    }
+
+#ifndef __MINGW32__
+    /* loop the pty back from the other end to try it out */
+    if (!strcmp(tx_path, "/dev/ptmx")) {
+        grantpt(prbs.tx_fd);
+        unlockpt(prbs.tx_fd);
+        fprintf(stderr, "bytenuts: opened PTY port %s\n", ptsname(prbs.tx_fd));
+    }
+#endif
+
+    prbs.overruns_known = !serial_overruns(prbs.rx_fd, &prbs.overruns_base);
+
+    pthread_mutex_init(&prbs.lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &prbs.start);
+    prbs.running = 1;
+
+#ifndef __MINGW32__
+    /* ctrl+c ends the test through wait_tick, so the report still gets out,
+     * and the threads inherit the mask */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+#endif
+
+    if (pthread_create(&prbs.chk_thr, NULL, chk_thread, NULL)) {
+        prbs.running = 0;
+    } else if (pthread_create(&prbs.gen_thr, NULL, gen_thread, NULL)) {
+        prbs.running = 0;
+        pthread_join(prbs.chk_thr, NULL);
+    }
+
+    if (!prbs.running) {
+#ifndef __MINGW32__
+        pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+#endif
+        fprintf(stderr, "bytenuts: failed to start the PRBS threads\n");
+        if (prbs.rx_fd != prbs.tx_fd)
+            serial_close(prbs.rx_fd);
+        serial_close(prbs.tx_fd);
+        return BATCH_EXIT_ERROR;
+    }
+
+    fprintf(
+        stderr, "bytenuts: PRBS-%d out of %s, checked on %s\n",
+        order, prbs.tx_path, prbs.rx_path
+    );
+
+    deadline = prbs.start;
+    timer_add_ms(&deadline, secs * 1000);
+
+    while (prbs.running && !prbs.port_error) {
+        struct timespec now;
+
+        if (wait_tick())
+            break;
+
+        print_status(tty, &tx_last, &rx_last);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (secs > 0 && timer_cmp(&now, &deadline) >= 0)
+            break;
+    }
+
+    prbs.running = 0;
+    pthread_join(prbs.gen_thr, NULL);
+    pthread_join(prbs.chk_thr, NULL);
+
+#ifndef __MINGW32__
+    pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+#endif
+
+    if (tty)
+        fprintf(stderr, "\n");
+    print_report();
+
+    if (prbs.port_error)
+        ret = BATCH_EXIT_ERROR;
+    else if (prbs.rx_bytes == 0)
+        ret = BATCH_EXIT_TIMEOUT;
+    else if (prbs.checked_bits == 0 || prbs.err_bits > 0 || prbs.sync_losses > 0)
+        ret = BATCH_EXIT_FAILED;
+    else
+        ret = BATCH_EXIT_OK;
+
+    if (prbs.rx_fd != prbs.tx_fd)
+        serial_close(prbs.rx_fd);
+    serial_close(prbs.tx_fd);
+
+    return ret;
+}
+
+/* Keep the port's buffer full, so the stream goes at line rate */
+static void *
+gen_thread(void *arg)
+{
+    uint8_t chunk[PRBS_CHUNK];
+    uint32_t state = prbs.table.mask;
+
+    while (prbs.running) {
+        size_t p = 0;
+
+        for (int i = 0; i < PRBS_CHUNK; i++) {
+            chunk[i] = gen_byte(&prbs.table, &state);
+        }
+
+        while (p < PRBS_CHUNK && prbs.running) {
+            ssize_t ret;
+
+            /* wake up now and then to notice the end of the test */
+            if (serial_wait_write(prbs.tx_fd, 100) <= 0)
+                continue;
+
+            ret = serial_write(prbs.tx_fd, &chunk[p], PRBS_CHUNK - p);
+            if (ret < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    continue;
+                prbs.port_error = 1;
+                return NULL;
+            }
+
+            p += ret;
+
+            pthread_mutex_lock(&prbs.lock);
+            prbs.tx_bytes += ret;
+            pthread_mutex_unlock(&prbs.lock);
+        }
+    }
+
+    return NULL;
+}
+
+static void *
+chk_thread(void *arg)
+{
+    uint8_t buf[PRBS_CHUNK];
+    const prbs_table_t *table = &prbs.table;
+    uint32_t state = 0; /* fed from the received bits until locked */
+    uint32_t ref = 0; /* free running once locked */
+    int good = 0;
+    uint32_t recent = 0; /* a bit per byte, set if it had errors */
+    uint64_t off = 0;
+
+    while (prbs.running) {
+        ssize_t n = serial_read_to(prbs.rx_fd, buf, sizeof(buf), 100);
+        uint64_t checked = 0;
+        uint64_t errs = 0;
+        uint64_t losses = 0;
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            prbs.port_error = 1;
+            break;
+        }
+
+        pthread_mutex_lock(&prbs.lock);
+
+        for (ssize_t i = 0; i < n; i++, off++) {
+            uint8_t diff;
+
+            if (!prbs.locked) {
+                uint32_t next = state;
+
+                /* the all zero state predicts zeros forever, a line held in
+                 * break would lock on to it and show no errors */
+                good = state && gen_byte(table, &next) == buf[i] ? good + 1 : 0;
+                state = ((state << 8) | table->rev[buf[i]]) & table->mask;
+
+                if (good == PRBS_LOCK_BYTES) {
+                    prbs.locked = 1;
+                    ref = state;
+                    recent = 0;
+                }
+                continue;
+            }
+
+            diff = gen_byte(table, &ref) ^ buf[i];
+            checked += 8;
+            recent <<= 1;
+            if (!diff)
+                continue;
+
+            errs += __builtin_popcount(diff);
+            recent |= 1;
+            if (prbs.errs_n < PRBS_ERRS_KEPT)
+                prbs.errs[prbs.errs_n++] = off;
+
+            /* a lost or added byte, not noise, lock on again */
+            if (__builtin_popcount(recent) >= PRBS_SYNC_LOSS) {
+                prbs.locked = 0;
+                good = 0;
+                state = 0;
+                losses++;
+            }
+        }
+
+        prbs.rx_bytes += n;
+        prbs.checked_bits += checked;
+        prbs.err_bits += errs;
+        prbs.sync_losses += losses;
+
+        pthread_mutex_unlock(&prbs.lock);
+    }
+
+    return NULL;
+}
+
+/* ITU-T O.150 polynomials x^order + x^tap + 1 */
+static int
+build_table(prbs_table_t *table, int order)
+{
+    int tap;
+
+    switch (order) {
+    case 7:
+        tap = 6;
+        break;
+    case 15:
+        tap = 14;
+        break;
+    case 31:
+        tap = 28;
+        break;
+    default:
+        return -1;
+    }
+
+    table->order = order;
+    table->mask = (uint32_t)((1ULL << order) - 1);
+
+    /* step each byte of the state on its own the slow way */
+    for (int k = 0; k < PRBS_STATE_BYTES; k++) {
+        for (int v = 0; v < 256; v++) {
+            uint32_t s = ((uint32_t)v << (8 * k)) & table->mask;
+            uint8_t out = 0;
+
+            for (int i = 0; i < 8; i++) {
+                uint32_t bit = ((s >> (order - 1)) ^ (s >> (tap - 1))) & 1;
+
+                s = ((s << 1) | bit) & table->mask;
+                out |= bit << i;
+            }
+
+            table->next[k][v] = s;
+            table->out[k][v] = out;
+        }
+    }
+
+    for (int v = 0; v < 256; v++) {
+        uint8_t r = 0;
+
+        for (int i = 0; i < 8; i++) {
+            if (v & (1 << i))
+                r |= 0x80 >> i;
+        }
+        table->rev[v] = r;
+    }
+
+    return 0;
+}
+
+static uint8_t
+gen_byte(const prbs_table_t *table, uint32_t *state)
+{
+    uint32_t s = *state;
+    uint32_t next = 0;
+    uint8_t out = 0;
+
+    for (int k = 0; k * 8 < table->order; k++) {
+        next ^= table->next[k][(s >> (8 * k)) & 0xff];
+        out ^= table->out[k][(s >> (8 * k)) & 0xff];
+    }
+
+    *state = next;
+    return out;
+}
+
+/* Wait a second between reports. Returns -1 on ctrl+c. */
+static int
+wait_tick(void)
+{
+#ifdef __MINGW32__
+    sleep(1);
+    return 0;
+#else
+    sigset_t sigs;
+    struct timespec to = { 1, 0 };
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+
+    return sigtimedwait(&sigs, NULL, &to) == SIGINT ? -1 : 0;
+#endif
+}
+
+static void
+print_status(int tty, uint64_t *tx_last, uint64_t *rx_last)
+{
+    uint64_t tx, rx, checked, errs, losses;
+    int locked;
+    char extra[64] = "";
+
+    pthread_mutex_lock(&prbs.lock);
+    tx = prbs.tx_bytes;
+    rx = prbs.rx_bytes;
+    checked = prbs.checked_bits;
+    errs = prbs.err_bits;
+    losses = prbs.sync_losses;
+    locked = prbs.locked;
+    if (prbs.errs_n > 0)
+        snprintf(extra, sizeof(extra), ", first error at byte %llu", (unsigned long long)prbs.errs[0]);
+    pthread_mutex_unlock(&prbs.lock);
+
+    if (prbs.overruns_known) {
+        size_t len = strlen(extra);
+
+        snprintf(&extra[len], sizeof(extra) - len, ", %llu overruns", (unsigned long long)overruns());
+    }
+
+    fprintf(
+        stderr, "%s%.0fs: tx %lluB/s, rx %lluB/s, %s, %llu bits checked, "
+        "%llu errors, BER %.2e, %llu sync losses%s%s",
+        tty ? "\r" : "", elapsed_s(),
+        (unsigned long long)(tx - *tx_last), (unsigned long long)(rx - *rx_last),
+        locked ? "locked" : "not locked",
+        (unsigned long long)checked, (unsigned long long)errs,
+        checked ? (double)errs / checked : 0.0,
+        (unsigned long long)losses, extra,
+        tty ? "\x1b[K" : "\n"
+    );
+
+    *tx_last = tx;
+    *rx_last = rx;
+}
+
+static void
+print_report(void)
+{
+    double secs = elapsed_s();
+
+    printf("PRBS-%d out of %s, checked on %s for %.1fs\n", prbs.table.order, prbs.tx_path, prbs.rx_path, secs);
+    printf("sent: %lluB (%.0fB/s)\n", (unsigned long long)prbs.tx_bytes, prbs.tx_bytes / secs);
+    printf("received: %lluB (%.0fB/s)\n", (unsigned long long)prbs.rx_bytes, prbs.rx_bytes / secs);
+    printf("bits checked: %llu\n", (unsigned long long)prbs.checked_bits);
+    printf("bit errors: %llu\n", (unsigned long long)prbs.err_bits);
+    if (prbs.err_bits > 0) {
+        printf("BER: %.2e\n", (double)prbs.err_bits / prbs.checked_bits);
+    } else if (prbs.checked_bits > 0) {
+        /* rule of three */
+        printf("BER: 0 (below %.2e at 95%% confidence)\n", 3.0 / prbs.checked_bits);
+    }
+    printf("sync losses: %llu\n", (unsigned long long)prbs.sync_losses);
+    if (prbs.overruns_known) {
+        printf("overruns: %llu\n", (unsigned long long)overruns());
+    } else {
+        printf("overruns: not counted by the driver\n");
+    }
+    if (prbs.errs_n > 0) {
+        printf("first errors at byte:");
+        for (int i = 0; i < prbs.errs_n; i++) {
+            printf(" %llu", (unsigned long long)prbs.errs[i]);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static uint64_t
+overruns(void)
+{
+    uint64_t n;
+
+    if (serial_overruns(prbs.rx_fd, &n))
+        return 0;
+
+    return n - prbs.overruns_base;
+}
+
+static double
+elapsed_s(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return timer_diff_ns(&now, &prbs.start) / 1e9;
+}
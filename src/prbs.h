@@ -0,0 +1,82 @@
+#ifndef _PRBS_H_
+#define _PRBS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bytenuts.h"
+#include "serial.h"
+
+/* Loopback test: a PRBS-7, 15 or 31 (ITU-T O.150) stream is sent out of one
+ * port as fast as it will take it and checked as it comes back in on the same
+ * port, through a loopback plug, or on a second one. The generator and the
+ * checker each have a thread.
+ *
+ * Both step the LFSR a byte at a time through tables. A step is linear in the
+ * state, so the next state and the 8 bits put out are the XOR of what each
+ * byte of the state gives on its own, looked up per byte. Bits go out first
+ * bit first, which is LSB first, as the UART sends them.
+ *
+ * The checker locks on by loading its LFSR from the bits received until
+ * PRBS_LOCK_BYTES in a row are as predicted. From then on it runs its own
+ * LFSR, so each flipped bit counts once. Too many errored bytes in a row, as
+ * after a byte is lost, and it locks on again, counted as a sync loss. */
+
+/* bytes generated and written at once */
+#define PRBS_CHUNK (4096)
+
+/* bytes of LFSR state covered by the tables, enough for PRBS-31 */
+#define PRBS_STATE_BYTES (4)
+
+/* bytes in a row as predicted before the checker counts errors */
+#define PRBS_LOCK_BYTES (8)
+
+/* errored bytes out of the last 32 that mean sync was lost */
+#define PRBS_SYNC_LOSS (8)
+
+/* offsets of the first errors kept for the report */
+#define PRBS_ERRS_KEPT (8)
+
+typedef struct prbs_table_struct {
+    int order;
+    uint32_t mask;
+    uint32_t next[PRBS_STATE_BYTES][256]; /* state after 8 steps from each byte */
+    uint8_t out[PRBS_STATE_BYTES][256]; /* the 8 bits put out on the way */
+    uint8_t rev[256]; /* bits of a received byte in the order they went in */
+} prbs_table_t;
+
+typedef struct prbs_struct {
+    pthread_mutex_t lock; /* guards the counters for the reports */
+    volatile int running;
+    pthread_t gen_thr;
+    pthread_t chk_thr;
+    serial_t tx_fd;
+    serial_t rx_fd; /* the same as tx_fd when looped back on one port */
+    const char *tx_path;
+    const char *rx_path;
+    prbs_table_t table;
+    struct timespec start;
+    int port_error; /* a read or write failed, the test is over */
+    uint64_t tx_bytes;
+    uint64_t rx_bytes;
+    /* checker, only bits compared while locked count */
+    int locked;
+    uint64_t checked_bits;
+    uint64_t err_bits;
+    uint64_t sync_losses;
+    uint64_t errs[PRBS_ERRS_KEPT]; /* received byte offsets of the first errors */
+    int errs_n;
+    int overruns_known; /* the driver counts overruns */
+    uint64_t overruns_base;
+} prbs_t;
+
+/* Run the test with the PRBS of the given order (7, 15 or 31) out of tx_path
+ * and back in on rx_path, which may be NULL or the same for a loopback plug.
+ * Reports once a second on stderr and in full on stdout at the end, after secs
+ * seconds or, with 0, on ctrl+c. Returns one of the BATCH_EXIT_ codes: OK if
+ * everything came back as sent, FAILED on bit errors or sync losses, TIMEOUT
+ * if nothing came back at all, ERROR if a port could not be used. */
+int prbs_run(bytenuts_config_t *config, int order, const char *tx_path, const char *rx_path, uint32_t secs);
+
+#endif /* _PRBS_H_ */
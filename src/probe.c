@@ -0,0 +1,321 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cheerios.h"
+#include "hist.h"
+#include "probe.h"
+#include "timer_math.h"
+#include "txq.h"
+
+static probe_t probe = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static int cond_inited;
+
+static void *probe_thread(void *arg);
+static int wait_echo(uint32_t to_ms);
+static void tx_sent(const struct timespec *ts, void *arg);
+static void rx_tap(const char *buf, size_t len, void *arg);
+static void print_results(hist_handle hist, uint32_t lost);
+static uint64_t row_count(hist_handle hist, uint64_t first, uint64_t b);
+static void get_deadline(struct timespec *ts, uint32_t ms);
+
+int
+probe_start(bytenuts_config_t *config)
+{
+    /* reap the previous probe, it has finished */
+    if (probe.joinable && !probe.running) {
+        pthread_join(probe.thr, NULL);
+        probe.joinable = 0;
+    }
+
+    pthread_mutex_lock(&probe.lock);
+
+    if (probe.running) {
+        pthread_mutex_unlock(&probe.lock);
+        return -1;
+    }
+
+    if (!cond_inited) {
+        pthread_condattr_t attr;
+
+        /* the echo timeout must not move when the wall clock is stepped */
+        pthread_condattr_init(&attr);
+#ifndef __MINGW32__
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+        pthread_cond_init(&probe.cond, &attr);
+        pthread_condattr_destroy(&attr);
+        cond_inited = 1;
+    }
+
+    probe.config = config;
+    probe.frame_len = 0;
+
+    probe.running = 1;
+    if (pthread_create(&probe.thr, NULL, probe_thread, NULL)) {
+        probe.running = 0;
+        pthread_mutex_unlock(&probe.lock);
+        return -1;
+    }
+    probe.joinable = 1;
+
+    pthread_mutex_unlock(&probe.lock);
+
+    return 0;
+}
+
+int
+probe_cancel()
+{
+    pthread_mutex_lock(&probe.lock);
+    probe.running = 0;
+    if (cond_inited)
+        pthread_cond_broadcast(&probe.cond);
+    pthread_mutex_unlock(&probe.lock);
+
+    return 0;
+}
+
+int
+probe_active()
+{
+    return probe.running;
+}
+
+int
+probe_stop()
+{
+    probe_cancel();
+
+    if (probe.joinable) {
+        pthread_join(probe.thr, NULL);
+        probe.joinable = 0;
+    }
+
+    return 0;
+}
+
+static void *
+probe_thread(void *arg)
+{
+    hist_handle hist = hist_create();
+    uint32_t count = probe.config->probe_count;
+    uint32_t lost = 0;
+    uint32_t i;
+
+    cheerios_print(
+        "Probing round trip latency with %u frames, %ums timeout\r\n",
+        count, probe.config->probe_to
+    );
+
+    cheerios_tap_add(rx_tap, NULL);
+    /* a periodic command would delay the echoes */
+    txq_hold();
+
+    for (i = 0; i < count && probe.running; i++) {
+        char frame[PROBE_FRAME_MAX];
+        size_t frame_len;
+        uint64_t gen;
+
+        bytenuts_set_status(STATUS_JOB, "probe %u/%u", i + 1, count);
+
+        frame_len = snprintf(frame, sizeof(frame), "[bnp %05u]", i % 100000);
+
+        pthread_mutex_lock(&probe.lock);
+        memcpy(probe.frame, frame, frame_len);
+        probe.frame_len = frame_len;
+        probe.matched = 0;
+        probe.sent = 0;
+        probe.echoed = 0;
+        gen = ++probe.gen;
+        pthread_mutex_unlock(&probe.lock);
+
+        if (txq_write(frame, frame_len))
+            break;
+        txq_on_sent(tx_sent, (void *)(uintptr_t)gen);
+
+        if (wait_echo(probe.config->probe_to)) {
+            if (probe.running)
+                lost++;
+            continue;
+        }
+
+        pthread_mutex_lock(&probe.lock);
+        {
+            int64_t ns = timer_diff_ns(&probe.echo_ts, &probe.sent_ts);
+
+            /* the echo can beat the TX thread to its clock */
+            hist_add(hist, ns > 0 ? ns / 1000 : 0);
+        }
+        pthread_mutex_unlock(&probe.lock);
+
+        /* let anything else the device sends go by */
+        nanosleep(&(struct timespec){ 0, PROBE_GAP_MS * 1000000 }, NULL);
+    }
+
+    txq_release();
+    cheerios_tap_remove(rx_tap, NULL);
+
+    pthread_mutex_lock(&probe.lock);
+    probe.frame_len = 0;
+    pthread_mutex_unlock(&probe.lock);
+
+    if (i < count)
+        cheerios_print("\r\nStopped probing after %u frames\r\n", i);
+    print_results(hist, lost);
+    hist_destroy(hist);
+
+    bytenuts_set_status(STATUS_JOB, "%s", "");
+
+    pthread_mutex_lock(&probe.lock);
+    probe.running = 0;
+    pthread_mutex_unlock(&probe.lock);
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+/* Wait for the frame to be written and echoed. Returns 0 once it has, -1 on
+ * timeout or cancel. */
+static int
+wait_echo(uint32_t to_ms)
+{
+    struct timespec deadline;
+    int ret = 0;
+
+    get_deadline(&deadline, to_ms);
+
+    pthread_mutex_lock(&probe.lock);
+
+    while (probe.running && !(probe.sent && probe.echoed)) {
+        if (
+            pthread_cond_timedwait(&probe.cond, &probe.lock, &deadline) ==
+            ETIMEDOUT
+        ) {
+            break;
+        }
+    }
+
+    if (!probe.running || !probe.sent || !probe.echoed)
+        ret = -1;
+
+    /* a late echo must not count for the next frame */
+    probe.frame_len = 0;
+
+    pthread_mutex_unlock(&probe.lock);
+
+    return ret;
+}
+
+/* Runs on the TX thread once the frame has been written */
+static void
+tx_sent(const struct timespec *ts, void *arg)
+{
+    pthread_mutex_lock(&probe.lock);
+
+    if (probe.gen == (uintptr_t)arg) {
+        probe.sent_ts = *ts;
+        probe.sent = 1;
+        pthread_cond_broadcast(&probe.cond);
+    }
+
+    pthread_mutex_unlock(&probe.lock);
+}
+
+/* Runs on the reader thread, looks for the frame coming back. The frame only
+ * starts with '[', so a mismatch can only restart the match there. */
+static void
+rx_tap(const char *buf, size_t len, void *arg)
+{
+    pthread_mutex_lock(&probe.lock);
+
+    for (size_t i = 0; i < len && probe.frame_len && !probe.echoed; i++) {
+        if (buf[i] == probe.frame[probe.matched]) {
+            probe.matched++;
+        } else {
+            probe.matched = buf[i] == probe.frame[0];
+        }
+
+        if (probe.matched == probe.frame_len) {
+            clock_gettime(CLOCK_MONOTONIC, &probe.echo_ts);
+            probe.echoed = 1;
+            pthread_cond_broadcast(&probe.cond);
+        }
+    }
+
+    pthread_mutex_unlock(&probe.lock);
+}
+
+static void
+print_results(hist_handle hist, uint32_t lost)
+{
+    uint64_t n = hist_count(hist);
+    uint64_t most = 0;
+    uint64_t lo;
+    uint64_t hi;
+    char v[6][16];
+
+    cheerios_print("\r\nRound trip latency, %llu echoed, %u lost\r\n", (unsigned long long)n, lost);
+    if (n == 0)
+        return;
+
+    cheerios_print(
+        "  min %s, median %s, p90 %s, p99 %s, max %s, mean %s\r\n",
+        hist_fmt_us(v[0], 16, hist_min(hist)),
+        hist_fmt_us(v[1], 16, hist_percentile(hist, 50)),
+        hist_fmt_us(v[2], 16, hist_percentile(hist, 90)),
+        hist_fmt_us(v[3], 16, hist_percentile(hist, 99)),
+        hist_fmt_us(v[4], 16, hist_max(hist)),
+        hist_fmt_us(v[5], 16, (uint64_t)hist_mean(hist))
+    );
+
+    /* a row per power of 2 from the fastest to the slowest */
+    for (lo = 1; lo * 2 <= hist_min(hist); lo *= 2)
+        ;
+    for (hi = lo; hi <= hist_max(hist); hi *= 2) {
+        uint64_t rows = row_count(hist, lo, hi);
+
+        if (rows > most)
+            most = rows;
+    }
+
+    for (uint64_t b = lo; b <= hist_max(hist); b *= 2) {
+        uint64_t rows = row_count(hist, lo, b);
+        char bar[PROBE_BAR_MAX + 1];
+        int width = (rows * PROBE_BAR_MAX + most - 1) / most;
+
+        memset(bar, '#', width);
+        bar[width] = '\0';
+
+        cheerios_print(
+            "  %8s - %-8s |%-*s %llu\r\n",
+            hist_fmt_us(v[0], 16, b), hist_fmt_us(v[1], 16, b * 2),
+            PROBE_BAR_MAX, bar, (unsigned long long)rows
+        );
+    }
+}
+
+/* Values in [b, 2b), the first row also has any 0s */
+static uint64_t
+row_count(hist_handle hist, uint64_t first, uint64_t b)
+{
+    uint64_t below = b == first ? 0 : hist_count_below(hist, b);
+
+    return hist_count_below(hist, b * 2) - below;
+}
+
+static void
+get_deadline(struct timespec *ts, uint32_t ms)
+{
+#ifdef __MINGW32__
+    clock_gettime(CLOCK_REALTIME, ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#endif
+    timer_add_ms(ts, ms);
+}
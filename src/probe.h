@@ -0,0 +1,57 @@
+#ifndef _PROBE_H_
+#define _PROBE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bytenuts.h"
+
+/* Round trip latency probe. Small numbered frames are sent one at a time to a
+ * device that echoes them, or through a loopback plug, and each is timed from
+ * when the TX thread has written its last byte to when the reader sees its
+ * last byte come back, so the time includes the adapter, the driver and
+ * bytenuts' own reader. The next frame goes out PROBE_GAP_MS after the reply,
+ * or after probe_to if none came. The distribution is printed at the end. */
+
+/* "[bnp 00001]", no line ending so a shell does not run it */
+#define PROBE_FRAME_MAX (16)
+
+/* quiet time after each reply, so stray bytes do not overlap the next probe */
+#define PROBE_GAP_MS (10)
+
+/* width of the longest bar of the histogram */
+#define PROBE_BAR_MAX (40)
+
+typedef struct probe_struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signalled on an echo, the TX time and cancel */
+    pthread_t thr;
+    volatile int running;
+    int joinable; /* thr has not been joined yet */
+    bytenuts_config_t *config;
+    /* the frame out, matched as the output comes in */
+    char frame[PROBE_FRAME_MAX];
+    size_t frame_len;
+    size_t matched;
+    uint64_t gen; /* bumped per frame, tells stale TX callbacks apart */
+    int sent;
+    struct timespec sent_ts;
+    int echoed;
+    struct timespec echo_ts;
+} probe_t;
+
+/* Start sending probe_count probes from the config. Returns -1 if a probe is
+ * already running. */
+int probe_start(bytenuts_config_t *config);
+
+/* Stop after the current probe, the results so far are still printed */
+int probe_cancel();
+
+/* Whether a probe is running */
+int probe_active();
+
+/* cancel any probe and wait for it to finish */
+int probe_stop();
+
+#endif /* _PROBE_H_ */
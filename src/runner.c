@@ -0,0 +1,162 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cheerios.h"
+#include "runner.h"
+#include "txq.h"
+
+static runner_t runner = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *runner_thread(void *arg);
+static void rx_tap(const char *buf, size_t len, void *arg);
+static int op_send(const char *buf, size_t len, void *arg);
+static void op_log(const char *msg, void *arg);
+static void op_status(const char *state, void *arg);
+
+static const script_ops_t ops = {
+    .send = op_send,
+    .log = op_log,
+    .status = op_status,
+};
+
+int
+runner_start(bytenuts_config_t *config, const char *path)
+{
+    script_handle script;
+    char *err;
+
+    /* reap the previous script, it has finished */
+    if (runner.joinable && !runner.running) {
+        pthread_join(runner.thr, NULL);
+        runner.joinable = 0;
+    }
+
+    if (runner.running)
+        return -1;
+
+    script = script_load(path, &err);
+    if (!script) {
+        cheerios_print("Could not run %s, %s\r\n", path, err);
+        free(err);
+        return -1;
+    }
+
+    pthread_mutex_lock(&runner.lock);
+
+    runner.config = config;
+    free(runner.path);
+    runner.path = strdup(path);
+    runner.script = script;
+
+    /* output from here on is what the script gets to expect */
+    cheerios_tap_add(rx_tap, NULL);
+
+    runner.running = 1;
+    if (pthread_create(&runner.thr, NULL, runner_thread, NULL)) {
+        cheerios_tap_remove(rx_tap, NULL);
+        runner.running = 0;
+        runner.script = NULL;
+        pthread_mutex_unlock(&runner.lock);
+        script_destroy(script);
+        return -1;
+    }
+    runner.joinable = 1;
+
+    pthread_mutex_unlock(&runner.lock);
+
+    return 0;
+}
+
+int
+runner_cancel()
+{
+    pthread_mutex_lock(&runner.lock);
+    if (runner.running && runner.script)
+        script_cancel(runner.script);
+    pthread_mutex_unlock(&runner.lock);
+
+    return 0;
+}
+
+int
+runner_active()
+{
+    return runner.running;
+}
+
+int
+runner_stop()
+{
+    runner_cancel();
+
+    if (runner.joinable) {
+        pthread_join(runner.thr, NULL);
+        runner.joinable = 0;
+    }
+
+    return 0;
+}
+
+static void *
+runner_thread(void *arg)
+{
+    const char *ending = runner.config->no_crlf ? "\n" : "\r\n";
+    int ret;
+
+    cheerios_print("Running script %s\r\n", runner.path);
+
+    ret = script_run(runner.script, &ops, ending);
+
+    cheerios_tap_remove(rx_tap, NULL);
+
+    cheerios_print(
+        "Script %s %s\r\n", runner.path,
+        ret == SCRIPT_OK ? "finished" : script_result_str(ret)
+    );
+
+    pthread_mutex_lock(&runner.lock);
+    script_destroy(runner.script);
+    runner.script = NULL;
+    runner.running = 0;
+    pthread_mutex_unlock(&runner.lock);
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+/* Runs on the reader thread with the output locked */
+static void
+rx_tap(const char *buf, size_t len, void *arg)
+{
+    script_feed(runner.script, buf, len);
+}
+
+static int
+op_send(const char *buf, size_t len, void *arg)
+{
+    if (txq_write(buf, len))
+        return -1;
+
+    /* a script send paces like a typed command */
+    txq_end_cmd();
+    return 0;
+}
+
+static void
+op_log(const char *msg, void *arg)
+{
+    cheerios_print("script: %s\r\n", msg);
+}
+
+static void
+op_status(const char *state, void *arg)
+{
+    if (*state) {
+        bytenuts_set_status(STATUS_JOB, "script: %s", state);
+    } else {
+        bytenuts_set_status(STATUS_JOB, "%s", "");
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef _RUNNER_H_
+#define _RUNNER_H_
+
+#include <pthread.h>
+
+#include "bytenuts.h"
+#include "script.h"
+
+/* Runs a send/expect script in the background of an interactive session,
+ * reading the output through a cheerios tap and sending through the TX
+ * queue */
+
+typedef struct runner_struct {
+    pthread_mutex_t lock;
+    pthread_t thr;
+    volatile int running; /* a script is being run */
+    int joinable; /* thr has not been joined yet */
+    bytenuts_config_t *config;
+    char *path;
+    script_handle script;
+} runner_t;
+
+/* Start running the script at path. Returns -1 if a script is already
+ * running or the script can not be loaded, the reason is shown in the
+ * output. */
+int runner_start(bytenuts_config_t *config, const char *path);
+
+/* Stop the script at the next command, or during an expect or sleep */
+int runner_cancel();
+
+/* Whether a script is running */
+int runner_active();
+
+/* cancel any script and wait for it to finish */
+int runner_stop();
+
+#endif /* _RUNNER_H_ */
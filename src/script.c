@@ -0,0 +1,647 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef __MINGW32__
+#  include <regex.h>
+#endif
+
+#include "bstr.h"
+#include "script.h"
+#include "timer_math.h"
+
+/* output kept for expect, the oldest is dropped beyond this */
+#define SCRIPT_RX_MAX (16 * 1024)
+
+#define SCRIPT_EXPECT_MS (5000)
+
+enum script_op_enum {
+    SCRIPT_SEND = 0,
+    SCRIPT_EXPECT,
+    SCRIPT_SLEEP,
+    SCRIPT_LOOP,
+    SCRIPT_END,
+    SCRIPT_LOG,
+    SCRIPT_FAIL,
+};
+
+typedef struct script_cmd_struct {
+    int op;
+    int line; /* in the file, for messages */
+    char *text; /* send data, log message, expect or fail pattern */
+    size_t text_len;
+#ifndef __MINGW32__
+    regex_t re;
+#endif
+    uint32_t ms; /* sleep or expect timeout */
+    uint32_t count; /* loop count, 0 for ever */
+    int other; /* index of the matching loop or end */
+    uint32_t left; /* on an end, passes left through its loop */
+} script_cmd_t;
+
+typedef struct script_struct {
+    script_cmd_t *cmds;
+    int cmds_n;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signalled on new output and on cancel */
+    volatile int cancelled;
+    int fed; /* output came in since the last check */
+    int pc; /* next command to run */
+    script_cmd_t *wait; /* the expect or sleep being waited on */
+    struct timespec deadline; /* when the wait ends */
+    int result; /* SCRIPT_RUNNING until the script is done */
+    char rx[SCRIPT_RX_MAX + 1]; /* output not consumed by an expect yet */
+    size_t rx_len;
+    size_t scanned; /* rx before this is whole lines already checked */
+    script_cmd_t **fails; /* fail patterns seen so far */
+    int fails_n;
+    size_t fail_scanned; /* like scanned, for the fail patterns */
+    script_cmd_t *failed; /* the fail pattern that matched */
+} script_t;
+
+static int parse_line(script_t *scr, char *line, int line_no, int *stack, int *depth, char **err);
+static script_cmd_t *new_cmd(script_t *scr, int op, int line_no);
+static int check_wait(script_t *scr, uint32_t *wait_ms);
+static int find_new(script_t *scr, script_cmd_t *cmd, size_t *scanned, size_t *match_end);
+static int check_fails(script_t *scr);
+static void consume(script_t *scr, size_t len);
+static void deadline_in(struct timespec *ts, uint32_t ms);
+static void set_status(const script_ops_t *ops, const char *fmt, ...);
+static void say(const script_ops_t *ops, const char *fmt, ...);
+
+script_handle
+script_load(const char *path, char **err)
+{
+    script_t *scr;
+    FILE *fd;
+    char *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    size_t n;
+    char *line;
+    int line_no = 0;
+    int stack[32]; /* open loops */
+    int depth = 0;
+
+    *err = NULL;
+
+    fd = fopen(path, "r");
+    if (!fd) {
+        *err = bstr_print(NULL, "could not open %s", path);
+        return NULL;
+    }
+
+    do {
+        if (cap - len < 4096) {
+            cap = cap ? cap * 2 : 8192;
+            buf = realloc(buf, cap);
+        }
+        n = fread(&buf[len], 1, cap - len - 1, fd);
+        len += n;
+    } while (n > 0);
+    fclose(fd);
+    buf[len] = '\0';
+
+    scr = calloc(1, sizeof(script_t));
+    scr->result = SCRIPT_RUNNING;
+    pthread_mutex_init(&scr->lock, NULL);
+    {
+        pthread_condattr_t attr;
+
+        /* timeouts must not move when the wall clock is stepped */
+        pthread_condattr_init(&attr);
+#ifndef __MINGW32__
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+        pthread_cond_init(&scr->cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    line = buf;
+    while (line && *line) {
+        char *nl = strchr(line, '\n');
+        size_t l;
+
+        if (nl)
+            *nl = '\0';
+        line_no++;
+
+        l = strlen(line);
+        if (l > 0 && line[l - 1] == '\r')
+            line[l - 1] = '\0';
+
+        if (parse_line(scr, line, line_no, stack, &depth, err))
+            goto script_load_fail;
+
+        line = nl ? nl + 1 : NULL;
+    }
+
+    if (depth > 0) {
+        *err = bstr_print(
+            NULL, "line %d: loop without an end", scr->cmds[stack[depth - 1]].line
+        );
+        goto script_load_fail;
+    }
+
+    free(buf);
+    return scr;
+
+script_load_fail:
+    free(buf);
+    script_destroy(scr);
+    return NULL;
+}
+
+int
+script_step(script_handle scr, const script_ops_t *ops, const char *ending, uint32_t *wait_ms)
+{
+    int ret = SCRIPT_OK;
+
+    if (scr->result != SCRIPT_RUNNING)
+        return scr->result;
+
+    while (ret == SCRIPT_OK) {
+        script_cmd_t *cmd;
+
+        if (scr->cancelled) {
+            ret = SCRIPT_CANCELLED;
+            break;
+        }
+
+        if (scr->wait) {
+            ret = check_wait(scr, wait_ms);
+            if (ret == SCRIPT_RUNNING)
+                return SCRIPT_RUNNING;
+
+            if (ret == SCRIPT_TIMEOUT) {
+                say(
+                    ops, "line %d: no '%s' within %ums",
+                    scr->wait->line, scr->wait->text, scr->wait->ms
+                );
+            }
+            scr->wait = NULL;
+            continue;
+        }
+
+        if (scr->pc == scr->cmds_n) {
+            /* catch a fail pattern in the output received since the last
+             * wait */
+            pthread_mutex_lock(&scr->lock);
+            ret = check_fails(scr);
+            pthread_mutex_unlock(&scr->lock);
+            break;
+        }
+
+        cmd = &scr->cmds[scr->pc++];
+
+        switch (cmd->op) {
+        case SCRIPT_SEND:
+        {
+            size_t ending_len = strlen(ending);
+            char *out = malloc(cmd->text_len + ending_len);
+
+            /* in one go, so it is paced as a single command */
+            memcpy(out, cmd->text, cmd->text_len);
+            memcpy(&out[cmd->text_len], ending, ending_len);
+
+            set_status(ops, "send");
+            if (ops->send(out, cmd->text_len + ending_len, ops->arg)) {
+                say(ops, "line %d: send failed", cmd->line);
+                ret = SCRIPT_IO_ERROR;
+            }
+
+            free(out);
+            break;
+        }
+        case SCRIPT_EXPECT:
+            set_status(ops, "expect %s", cmd->text);
+            /* whatever was left by the previous expect is new to this
+             * pattern */
+            pthread_mutex_lock(&scr->lock);
+            scr->scanned = 0;
+            pthread_mutex_unlock(&scr->lock);
+            deadline_in(&scr->deadline, cmd->ms);
+            scr->wait = cmd;
+            break;
+        case SCRIPT_SLEEP:
+            set_status(ops, "sleep %ums", cmd->ms);
+            deadline_in(&scr->deadline, cmd->ms);
+            scr->wait = cmd;
+            break;
+        case SCRIPT_LOOP:
+            scr->cmds[cmd->other].left = cmd->count;
+            break;
+        case SCRIPT_END:
+            if (cmd->left == 0 || --cmd->left > 0)
+                scr->pc = cmd->other + 1;
+            break;
+        case SCRIPT_LOG:
+            say(ops, "%s", cmd->text);
+            break;
+        case SCRIPT_FAIL:
+            pthread_mutex_lock(&scr->lock);
+            scr->fails = realloc(scr->fails, sizeof(script_cmd_t *) * (scr->fails_n + 1));
+            scr->fails[scr->fails_n++] = cmd;
+            /* output already received counts too */
+            scr->fail_scanned = 0;
+            pthread_mutex_unlock(&scr->lock);
+            break;
+        }
+    }
+
+    if (ret == SCRIPT_FAILED) {
+        say(
+            ops, "line %d: fail pattern '%s' seen",
+            scr->failed->line, scr->failed->text
+        );
+    }
+
+    if (ops->status)
+        ops->status("", ops->arg);
+
+    scr->result = ret;
+
+    return ret;
+}
+
+int
+script_run(script_handle scr, const script_ops_t *ops, const char *ending)
+{
+    uint32_t wait_ms;
+    int ret;
+
+    while ((ret = script_step(scr, ops, ending, &wait_ms)) == SCRIPT_RUNNING) {
+        struct timespec deadline;
+
+        deadline_in(&deadline, wait_ms);
+
+        pthread_mutex_lock(&scr->lock);
+        /* output or a cancel since the step looked is picked up right away */
+        if (!scr->fed && !scr->cancelled)
+            pthread_cond_timedwait(&scr->cond, &scr->lock, &deadline);
+        pthread_mutex_unlock(&scr->lock);
+    }
+
+    return ret;
+}
+
+void
+script_feed(script_handle scr, const char *buf, size_t len)
+{
+    pthread_mutex_lock(&scr->lock);
+
+    /* keep only the newest SCRIPT_RX_MAX bytes */
+    if (len > SCRIPT_RX_MAX) {
+        buf += len - SCRIPT_RX_MAX;
+        len = SCRIPT_RX_MAX;
+    }
+    if (scr->rx_len + len > SCRIPT_RX_MAX) {
+        size_t drop = scr->rx_len + len - SCRIPT_RX_MAX;
+
+        memmove(scr->rx, &scr->rx[drop], scr->rx_len - drop);
+        scr->rx_len -= drop;
+        scr->scanned = scr->scanned > drop ? scr->scanned - drop : 0;
+        scr->fail_scanned = scr->fail_scanned > drop ? scr->fail_scanned - drop : 0;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        /* a NUL would end the line early */
+        scr->rx[scr->rx_len++] = buf[i] ? buf[i] : ' ';
+    }
+    scr->fed = 1;
+
+    pthread_cond_broadcast(&scr->cond);
+    pthread_mutex_unlock(&scr->lock);
+}
+
+void
+script_cancel(script_handle scr)
+{
+    pthread_mutex_lock(&scr->lock);
+    scr->cancelled = 1;
+    pthread_cond_broadcast(&scr->cond);
+    pthread_mutex_unlock(&scr->lock);
+}
+
+const char *
+script_result_str(int result)
+{
+    switch (result) {
+    case SCRIPT_OK:
+        return "ok";
+    case SCRIPT_TIMEOUT:
+        return "timed out";
+    case SCRIPT_FAILED:
+        return "failed";
+    case SCRIPT_CANCELLED:
+        return "cancelled";
+    case SCRIPT_IO_ERROR:
+        return "send failed";
+    default:
+        return "unknown";
+    }
+}
+
+void
+script_destroy(script_handle scr)
+{
+    if (!scr)
+        return;
+
+    for (int i = 0; i < scr->cmds_n; i++) {
+#ifndef __MINGW32__
+        if (scr->cmds[i].op == SCRIPT_EXPECT || scr->cmds[i].op == SCRIPT_FAIL)
+            regfree(&scr->cmds[i].re);
+#endif
+        free(scr->cmds[i].text);
+    }
+    free(scr->cmds);
+    free(scr->fails);
+
+    pthread_cond_destroy(&scr->cond);
+    pthread_mutex_destroy(&scr->lock);
+    free(scr);
+}
+
+static int
+parse_line(script_t *scr, char *line, int line_no, int *stack, int *depth, char **err)
+{
+    char *arg;
+    script_cmd_t *cmd;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+
+    if (*line == '\0' || *line == '#')
+        return 0;
+
+    arg = line + strcspn(line, " \t");
+    if (*arg) {
+        *arg = '\0';
+        arg++;
+    }
+
+    if (!strcmp(line, "send")) {
+        cmd = new_cmd(scr, SCRIPT_SEND, line_no);
+        cmd->text = bstr_unescape(arg, strlen(arg), &cmd->text_len);
+    }
+    else if (!strcmp(line, "expect") || !strcmp(line, "fail")) {
+        char *last = strrchr(arg, ' ');
+        int expect = line[0] == 'e';
+
+        cmd = new_cmd(scr, expect ? SCRIPT_EXPECT : SCRIPT_FAIL, line_no);
+        cmd->ms = SCRIPT_EXPECT_MS;
+
+        /* a trailing number is the timeout */
+        if (
+            expect && last && last[1] &&
+            strspn(&last[1], "0123456789") == strlen(&last[1])
+        ) {
+            cmd->ms = strtoul(&last[1], NULL, 10);
+            *last = '\0';
+        }
+
+        if (*arg == '\0') {
+            *err = bstr_print(NULL, "line %d: %s needs a pattern", line_no, line);
+            scr->cmds_n--;
+            return -1;
+        }
+        cmd->text = strdup(arg);
+#ifndef __MINGW32__
+        if (regcomp(&cmd->re, arg, REG_EXTENDED)) {
+            *err = bstr_print(NULL, "line %d: bad regex '%s'", line_no, arg);
+            free(cmd->text);
+            scr->cmds_n--;
+            return -1;
+        }
+#endif
+    }
+    else if (!strcmp(line, "sleep")) {
+        cmd = new_cmd(scr, SCRIPT_SLEEP, line_no);
+        cmd->ms = strtoul(arg, NULL, 10);
+    }
+    else if (!strcmp(line, "loop")) {
+        if (*depth == 32) {
+            *err = bstr_print(NULL, "line %d: loops nested too deep", line_no);
+            return -1;
+        }
+
+        cmd = new_cmd(scr, SCRIPT_LOOP, line_no);
+        cmd->count = strtoul(arg, NULL, 10);
+        stack[(*depth)++] = scr->cmds_n - 1;
+    }
+    else if (!strcmp(line, "end")) {
+        int loop;
+
+        if (*depth == 0) {
+            *err = bstr_print(NULL, "line %d: end without a loop", line_no);
+            return -1;
+        }
+
+        loop = stack[--(*depth)];
+        cmd = new_cmd(scr, SCRIPT_END, line_no);
+        cmd->other = loop;
+        scr->cmds[loop].other = scr->cmds_n - 1;
+    }
+    else if (!strcmp(line, "log")) {
+        cmd = new_cmd(scr, SCRIPT_LOG, line_no);
+        cmd->text = strdup(arg);
+    }
+    else {
+        *err = bstr_print(NULL, "line %d: unknown command '%s'", line_no, line);
+        return -1;
+    }
+
+    return 0;
+}
+
+static script_cmd_t *
+new_cmd(script_t *scr, int op, int line_no)
+{
+    script_cmd_t *cmd;
+
+    scr->cmds_n++;
+    scr->cmds = realloc(scr->cmds, sizeof(script_cmd_t) * scr->cmds_n);
+
+    cmd = &scr->cmds[scr->cmds_n - 1];
+    memset(cmd, 0, sizeof(script_cmd_t));
+    cmd->op = op;
+    cmd->line = line_no;
+
+    return cmd;
+}
+
+/* See if the command being waited on is done, a match or fail pattern in new
+ * output or its deadline passing. Returns SCRIPT_RUNNING with the time left
+ * in *wait_ms if it is not. */
+static int
+check_wait(script_t *scr, uint32_t *wait_ms)
+{
+    script_cmd_t *cmd = scr->wait;
+    struct timespec now;
+    size_t match_end;
+    int ret = SCRIPT_RUNNING;
+
+    pthread_mutex_lock(&scr->lock);
+
+    scr->fed = 0;
+
+    /* fail patterns go first, the output they catch may be consumed */
+    if (check_fails(scr)) {
+        ret = SCRIPT_FAILED;
+    } else if (cmd->op == SCRIPT_EXPECT && find_new(scr, cmd, &scr->scanned, &match_end)) {
+        consume(scr, match_end);
+        ret = SCRIPT_OK;
+    }
+
+    pthread_mutex_unlock(&scr->lock);
+
+    if (ret != SCRIPT_RUNNING)
+        return ret;
+
+#ifdef __MINGW32__
+    clock_gettime(CLOCK_REALTIME, &now);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    if (timer_cmp(&now, &scr->deadline) >= 0)
+        return cmd->op == SCRIPT_EXPECT ? SCRIPT_TIMEOUT : SCRIPT_OK;
+
+    {
+        struct timespec left = scr->deadline;
+
+        timer_sub(&left, &now);
+        /* rounded up, waking early would only find nothing to do */
+        *wait_ms = left.tv_sec * 1000 + (left.tv_nsec + 999999) / 1000000;
+    }
+
+    return SCRIPT_RUNNING;
+}
+
+/* Check the lines that arrived since *scanned, and the line still being
+ * received, for the pattern of cmd. *scanned is moved past the whole lines
+ * checked, and on a match *match_end is set to the offset after it. Called
+ * with the lock held. */
+static int
+find_new(script_t *scr, script_cmd_t *cmd, size_t *scanned, size_t *match_end)
+{
+    while (1) {
+        char *start = &scr->rx[*scanned];
+        char *nl = memchr(start, '\n', scr->rx_len - *scanned);
+        char *end = nl ? nl : &scr->rx[scr->rx_len];
+        char saved = *end;
+        int hit;
+
+        *end = '\0';
+#ifdef __MINGW32__
+        /* no regex.h, the pattern is matched literally */
+        {
+            char *found = strstr(start, cmd->text);
+
+            hit = found != NULL;
+            if (hit)
+                *match_end = found - scr->rx + strlen(cmd->text);
+        }
+#else
+        {
+            regmatch_t m;
+
+            hit = !regexec(&cmd->re, start, 1, &m, 0);
+            if (hit)
+                *match_end = *scanned + m.rm_eo;
+        }
+#endif
+        *end = saved;
+
+        if (hit)
+            return 1;
+
+        /* the line being received is checked again once more of it is in */
+        if (!nl)
+            return 0;
+
+        *scanned = nl - scr->rx + 1;
+    }
+}
+
+/* Look for any fail pattern in the new output. Returns SCRIPT_FAILED if one
+ * matched. Called with the lock held. */
+static int
+check_fails(script_t *scr)
+{
+    size_t from = scr->fail_scanned;
+
+    for (int i = 0; i < scr->fails_n; i++) {
+        size_t scanned = from;
+        size_t match_end;
+
+        if (find_new(scr, scr->fails[i], &scanned, &match_end)) {
+            scr->failed = scr->fails[i];
+            return SCRIPT_FAILED;
+        }
+
+        scr->fail_scanned = scanned;
+    }
+
+    return SCRIPT_OK;
+}
+
+/* Drop the output up to len, an expect has matched it */
+static void
+consume(script_t *scr, size_t len)
+{
+    memmove(scr->rx, &scr->rx[len], scr->rx_len - len);
+    scr->rx_len -= len;
+    scr->scanned = 0;
+    scr->fail_scanned = scr->fail_scanned > len ? scr->fail_scanned - len : 0;
+}
+
+static void
+deadline_in(struct timespec *ts, uint32_t ms)
+{
+#ifdef __MINGW32__
+    clock_gettime(CLOCK_REALTIME, ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#endif
+    timer_add_ms(ts, ms);
+}
+
+static void
+set_status(const script_ops_t *ops, const char *fmt, ...)
+{
+    char state[64];
+    va_list ap;
+
+    if (!ops->status)
+        return;
+
+    va_start(ap, fmt);
+    vsnprintf(state, sizeof(state), fmt, ap);
+    va_end(ap);
+
+    ops->status(state, ops->arg);
+}
+
+static void
+say(const script_ops_t *ops, const char *fmt, ...)
+{
+    char *msg;
+    int len;
+    va_list ap;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    msg = calloc(1, len + 1);
+    va_start(ap, fmt);
+    vsnprintf(msg, len + 1, fmt, ap);
+    va_end(ap);
+
+    ops->log(msg, ops->arg);
+    free(msg);
+}
@@ -0,0 +1,71 @@
+#ifndef _SCRIPT_H_
+#define _SCRIPT_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Send/expect scripts, one command per line:
+ *
+ *   send <text>            send text and the line ending (escapes as in bstr_unescape)
+ *   expect <regex> [<ms>]  wait for the regex in the output (default 5000ms)
+ *   sleep <ms>             wait
+ *   loop <n>               repeat up to the matching end n times, 0 for ever
+ *   end
+ *   log <text>             show a message
+ *   fail <regex>           fail the script if the regex shows up from here on
+ *
+ * Blank lines and lines starting with # are skipped. The output is fed in
+ * with script_feed from any thread. expect checks it a line at a time and
+ * only looks at bytes that arrived since its last check, the line being
+ * received excepted, so a match can not span lines. The output up to the end
+ * of a match is consumed, later expects only see what came after it. */
+
+typedef struct script_struct * script_handle;
+
+enum script_result_enum {
+    SCRIPT_RUNNING = -1, /* from script_step, still waiting */
+    SCRIPT_OK = 0,
+    SCRIPT_TIMEOUT, /* an expect gave up */
+    SCRIPT_FAILED, /* a fail pattern was seen */
+    SCRIPT_CANCELLED,
+    SCRIPT_IO_ERROR, /* a send failed */
+};
+
+typedef struct script_ops_struct {
+    /* queue bytes for the device, returns non-zero if they can not be sent */
+    int (*send)(const char *buf, size_t len, void *arg);
+    /* a message for the user, without a line ending */
+    void (*log)(const char *msg, void *arg);
+    /* what the script is doing now, may be NULL */
+    void (*status)(const char *state, void *arg);
+    void *arg;
+} script_ops_t;
+
+/* Parse the script at path. Returns NULL on failure with a malloc'd reason in
+ * *err. */
+script_handle script_load(const char *path, char **err);
+
+/* Run the script to the end on the calling thread, ending each send with
+ * ending. Failures are reported through ops->log. A script can only be run
+ * once. */
+int script_run(script_handle scr, const script_ops_t *ops, const char *ending);
+
+/* Run the script as far as it can go without blocking. Returns SCRIPT_RUNNING
+ * with the time until the current wait runs out in *wait_ms, it should be
+ * called again by then or once more output has been fed. Returns the result
+ * once the script is done. For driving many scripts from one thread, use
+ * either this or script_run. */
+int script_step(script_handle scr, const script_ops_t *ops, const char *ending, uint32_t *wait_ms);
+
+/* Hand output from the device to the script, safe from any thread */
+void script_feed(script_handle scr, const char *buf, size_t len);
+
+/* Make script_run return SCRIPT_CANCELLED as soon as possible */
+void script_cancel(script_handle scr);
+
+/* Name of a result for messages */
+const char *script_result_str(int result);
+
+void script_destroy(script_handle scr);
+
+#endif /* _SCRIPT_H_ */
@@ -129,6 +129,20 @@ serial_write(serial_t serial, const void *buf, size_t len)
     return ret;
 }
 
+int
+serial_wait_write(serial_t serial, unsigned int to_ms)
+{
+    /* WriteFile blocks until the data is out */
+    return 1;
+}
+
+int
+serial_overruns(serial_t serial, uint64_t *n)
+{
+    /* ClearCommError only has flags, not counts */
+    return -1;
+}
+
 int
 serial_close(serial_t serial)
 {
@@ -140,6 +154,10 @@ serial_close(serial_t serial)
 
 #  include <termios.h>
 #  include <poll.h>
+#  include <sys/ioctl.h>
+#  ifdef __linux__
+#    include <linux/serial.h>
+#  endif
 
 static speed_t long_to_speed(long bps);
 
@@ -225,6 +243,33 @@ serial_write(serial_t serial, const void *buf, size_t len)
     return write(serial, buf, len);
 }
 
+int
+serial_wait_write(serial_t serial, unsigned int to_ms)
+{
+    struct pollfd fds;
+    fds.fd = serial;
+    fds.events = POLLOUT;
+    fds.revents = 0;
+
+    return poll(&fds, 1, to_ms);
+}
+
+int
+serial_overruns(serial_t serial, uint64_t *n)
+{
+#ifdef TIOCGICOUNT
+    struct serial_icounter_struct icount;
+
+    if (ioctl(serial, TIOCGICOUNT, &icount))
+        return -1;
+
+    *n = (uint64_t)icount.overrun + icount.buf_overrun;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 int
 serial_close(serial_t serial)
 {
@@ -1,6 +1,9 @@
 #ifndef _SERIAL_H_
 #define _SERIAL_H_
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #ifdef __MINGW32__
 #  include <windows.h>
 typedef HANDLE serial_t;
@@ -25,6 +28,15 @@ ssize_t serial_read_to(serial_t serial, void *buf, size_t len, unsigned int to_m
  * returned */
 ssize_t serial_write(serial_t serial, const void *buf, size_t len);
 
+/* Wait up to to_ms milliseconds for the serial port to accept more data.
+ * Returns >0 if it is writable, 0 on timeout */
+int serial_wait_write(serial_t serial, unsigned int to_ms);
+
+/* Set *n to the receive overruns the driver has counted since it was loaded,
+ * in the UART and in its buffer. Returns -1 if the driver does not count
+ * them, as with ptys and on Windows. */
+int serial_overruns(serial_t serial, uint64_t *n);
+
 /* Close the serial file */
 int serial_close(serial_t serial);
 
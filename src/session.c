@@ -0,0 +1,323 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef __MINGW32__
+#  include <sys/file.h>
+#endif
+
+#include "bstr.h"
+#include "files.h"
+#include "paths.h"
+#include "session.h"
+
+typedef struct session_entry_struct {
+    char *key;
+    long long out_sz;
+    long long in_sz;
+    long long last_used;
+    char *serial_path;
+} session_entry_t;
+
+static int read_index(const char *path, session_entry_t **ents);
+static void free_index(session_entry_t *ents, int n);
+static int entry_cmp(const void *a, const void *b);
+
+char *
+session_key(const char *name, const char *serial_path)
+{
+    const char *src = name;
+    char *ret;
+
+    if (!src) {
+        if (!serial_path)
+            return NULL;
+
+        src = serial_path;
+        if (!strncmp(src, "/dev/", 5))
+            src += 5;
+    }
+
+    /* no '.', it separates the key from the pid in the log names, so
+     * "fw.2024" would read as the pid 2024 of "fw" */
+    ret = strdup(src);
+    for (char *p = ret; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '-' && *p != '_')
+            *p = '_';
+    }
+
+    return ret;
+}
+
+void
+session_recover(const char *key)
+{
+    char *dir_path = paths_bnconf_dir();
+    char *out_path = paths_logfile("outbuf", key, 0);
+    char *prefix = bstr_print(NULL, "outbuf.%s.", key);
+    size_t prefix_len = strlen(prefix);
+    DIR *dir;
+    struct dirent *ent;
+    struct stat st;
+    time_t newest = 0;
+    long long newest_pid = -1;
+
+    if (!dir_path || !out_path)
+        goto session_recover_cleanup;
+
+    if (!stat(out_path, &st)) {
+        newest = st.st_mtime;
+    }
+
+    dir = opendir(dir_path);
+    if (!dir)
+        goto session_recover_cleanup;
+
+    while ((ent = readdir(dir))) {
+        char *path;
+        char *end;
+        long long pid;
+
+        if (strncmp(ent->d_name, prefix, prefix_len))
+            continue;
+
+        /* only <prefix><pid>.log, not the logs of a longer key */
+        pid = strtoll(&ent->d_name[prefix_len], &end, 10);
+        if (
+            end == &ent->d_name[prefix_len] ||
+            strcmp(end, ".log") ||
+            pid <= 0
+        ) {
+            continue;
+        }
+
+#ifndef __MINGW32__
+        /* still owned by a running instance */
+        if (pid == getpid() || !kill((pid_t)pid, 0) || errno != ESRCH)
+            continue;
+#endif
+
+        path = paths_logfile("outbuf", key, pid);
+        if (!stat(path, &st) && st.st_mtime >= newest) {
+            newest = st.st_mtime;
+            newest_pid = pid;
+        }
+        free(path);
+    }
+
+    closedir(dir);
+
+    if (newest_pid > 0) {
+        char *from;
+        char *to;
+
+        from = paths_logfile("outbuf", key, newest_pid);
+        files_replace(from, out_path);
+        free(from);
+
+        from = paths_logfile("inbuf", key, newest_pid);
+        to = paths_logfile("inbuf", key, 0);
+        files_replace(from, to);
+        free(from);
+        free(to);
+    }
+
+session_recover_cleanup:
+    free(dir_path);
+    free(out_path);
+    free(prefix);
+}
+
+int
+session_touch(const char *key, const char *serial_path)
+{
+    char *index_path = paths_sessions_index();
+    char *tmp_path;
+    char *log_path;
+    session_entry_t *ents = NULL;
+    int n;
+    struct stat st;
+    FILE *fd;
+    int ret = -1;
+#ifndef __MINGW32__
+    char *lock_path;
+    int lock_fd;
+#endif
+
+    if (!index_path)
+        return -1;
+
+#ifndef __MINGW32__
+    /* serialize instances exiting at the same time */
+    lock_path = bstr_print(NULL, "%s.lock", index_path);
+    lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    free(lock_path);
+    if (lock_fd >= 0)
+        flock(lock_fd, LOCK_EX);
+#endif
+
+    n = read_index(index_path, &ents);
+
+    tmp_path = bstr_print(NULL, "%s.%lld.tmp", index_path, (long long)getpid());
+    fd = fopen(tmp_path, "w");
+    if (!fd)
+        goto session_touch_cleanup;
+
+    fprintf(fd, "# key output_bytes history_bytes last_used serial_path\n");
+
+    for (int i = 0; i < n; i++) {
+        if (!strcmp(ents[i].key, key))
+            continue;
+
+        fprintf(
+            fd, "%s %lld %lld %lld %s\n",
+            ents[i].key, ents[i].out_sz, ents[i].in_sz, ents[i].last_used,
+            ents[i].serial_path
+        );
+    }
+
+    {
+        long long out_sz = 0;
+        long long in_sz = 0;
+
+        log_path = paths_logfile("outbuf", key, 0);
+        if (!stat(log_path, &st))
+            out_sz = st.st_size;
+        free(log_path);
+
+        log_path = paths_logfile("inbuf", key, 0);
+        if (!stat(log_path, &st))
+            in_sz = st.st_size;
+        free(log_path);
+
+        fprintf(
+            fd, "%s %lld %lld %lld %s\n",
+            key, out_sz, in_sz, (long long)time(NULL), serial_path
+        );
+    }
+
+    if (fclose(fd) == 0 && files_replace(tmp_path, index_path) == 0) {
+        ret = 0;
+    } else {
+        remove(tmp_path);
+    }
+
+session_touch_cleanup:
+#ifndef __MINGW32__
+    if (lock_fd >= 0)
+        close(lock_fd);
+#endif
+    free_index(ents, n);
+    free(tmp_path);
+    free(index_path);
+
+    return ret;
+}
+
+int
+session_list(FILE *out)
+{
+    char *index_path = paths_sessions_index();
+    session_entry_t *ents = NULL;
+    int n;
+
+    if (!index_path)
+        return -1;
+
+    n = read_index(index_path, &ents);
+    free(index_path);
+
+    qsort(ents, n, sizeof(session_entry_t), entry_cmp);
+
+    fprintf(out, "%-24s %-20s %12s %12s  %s\n", "SESSION", "LAST USED", "OUTPUT", "HISTORY", "PORT");
+    for (int i = 0; i < n; i++) {
+        char tstr[32];
+        time_t t = (time_t)ents[i].last_used;
+
+        strftime(tstr, sizeof(tstr), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        fprintf(
+            out, "%-24s %-20s %12lld %12lld  %s\n",
+            ents[i].key, tstr, ents[i].out_sz, ents[i].in_sz, ents[i].serial_path
+        );
+    }
+
+    free_index(ents, n);
+    return 0;
+}
+
+static int
+read_index(const char *path, session_entry_t **ents)
+{
+    FILE *fd = fopen(path, "r");
+    char line[1024];
+    int n = 0;
+
+    *ents = NULL;
+    if (!fd)
+        return 0;
+
+    while (fgets(line, sizeof(line), fd)) {
+        char key[256];
+        session_entry_t ent;
+        int serial_pos = 0;
+        size_t len = strlen(line);
+
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+            len--;
+            line[len] = '\0';
+        }
+
+        if (line[0] == '#')
+            continue;
+
+        if (
+            sscanf(
+                line, "%255s %lld %lld %lld %n",
+                key, &ent.out_sz, &ent.in_sz, &ent.last_used, &serial_pos
+            ) != 4 ||
+            serial_pos == 0
+        ) {
+            continue;
+        }
+
+        ent.key = strdup(key);
+        ent.serial_path = strdup(&line[serial_pos]);
+
+        n++;
+        *ents = realloc(*ents, sizeof(session_entry_t) * n);
+        (*ents)[n-1] = ent;
+    }
+
+    fclose(fd);
+    return n;
+}
+
+static void
+free_index(session_entry_t *ents, int n)
+{
+    for (int i = 0; i < n; i++) {
+        free(ents[i].key);
+        free(ents[i].serial_path);
+    }
+    free(ents);
+}
+
+/* newest first */
+static int
+entry_cmp(const void *a, const void *b)
+{
+    const session_entry_t *ea = a;
+    const session_entry_t *eb = b;
+
+    if (ea->last_used > eb->last_used)
+        return -1;
+    else if (ea->last_used < eb->last_used)
+        return 1;
+    return 0;
+}
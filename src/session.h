@@ -0,0 +1,27 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <stdio.h>
+
+/* Sessions key the resume logs, so instances on different ports do not
+ * overwrite each other. Each session's logs live at
+ * ~/.config/bytenuts/{outbuf,inbuf}.<key>.log, and ~/.config/bytenuts/sessions
+ * indexes them. */
+
+/* Generate the session key from the user given name, or from the serial path
+ * if name is NULL. Anything but letters, digits, '-' and '_' is replaced with
+ * '_'. Returns NULL if both are NULL. */
+char *session_key(const char *name, const char *serial_path);
+
+/* If an instance of this session crashed, its per-pid logs never got renamed.
+ * Promote the newest such pair if it is newer than the session's logs. */
+void session_recover(const char *key);
+
+/* Record the session in the index with the current sizes of its logs and the
+ * current time. The index is replaced atomically. */
+int session_touch(const char *key, const char *serial_path);
+
+/* Print the session index, most recently used first */
+int session_list(FILE *out);
+
+#endif /* _SESSION_H_ */
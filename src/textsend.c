@@ -0,0 +1,340 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cheerios.h"
+#include "files.h"
+#include "textsend.h"
+#include "timer_math.h"
+#include "txq.h"
+
+static textsend_t textsend = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static int cond_inited;
+
+static void *textsend_thread(void *arg);
+static int wait_prompt(void);
+static void wait_sent(void);
+static void tx_sent(const struct timespec *ts, void *arg);
+static void rx_tap(const char *buf, size_t len, void *arg);
+
+int
+textsend_start(bytenuts_config_t *config, const char *path)
+{
+    /* reap the previous send, it has finished */
+    if (textsend.joinable && !textsend.running) {
+        pthread_join(textsend.thr, NULL);
+        textsend.joinable = 0;
+    }
+
+    pthread_mutex_lock(&textsend.lock);
+
+    if (textsend.running) {
+        pthread_mutex_unlock(&textsend.lock);
+        return -1;
+    }
+
+    if (!cond_inited) {
+        pthread_condattr_t attr;
+
+        /* the prompt timeout must not move when the wall clock is stepped */
+        pthread_condattr_init(&attr);
+#ifndef __MINGW32__
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+        pthread_cond_init(&textsend.cond, &attr);
+        pthread_condattr_destroy(&attr);
+        cond_inited = 1;
+    }
+
+    if (textsend.use_prompt) {
+#ifndef __MINGW32__
+        regfree(&textsend.prompt);
+#endif
+        textsend.use_prompt = 0;
+    }
+
+    textsend.config = config;
+    if (textsend.config->send_prompt && *textsend.config->send_prompt) {
+#ifndef __MINGW32__
+        if (regcomp(
+                &textsend.prompt, textsend.config->send_prompt,
+                REG_EXTENDED | REG_NOSUB
+        )) {
+            pthread_mutex_unlock(&textsend.lock);
+            return -1;
+        }
+#endif
+        textsend.use_prompt = 1;
+    }
+
+    free(textsend.path);
+    textsend.path = strdup(path);
+    textsend.rx_len = 0;
+    textsend.prompt_seen = 0;
+
+    textsend.running = 1;
+    if (pthread_create(&textsend.thr, NULL, textsend_thread, NULL)) {
+        textsend.running = 0;
+        pthread_mutex_unlock(&textsend.lock);
+        return -1;
+    }
+    textsend.joinable = 1;
+
+    pthread_mutex_unlock(&textsend.lock);
+
+    return 0;
+}
+
+int
+textsend_cancel()
+{
+    pthread_mutex_lock(&textsend.lock);
+    textsend.running = 0;
+    if (cond_inited)
+        pthread_cond_broadcast(&textsend.cond);
+    pthread_mutex_unlock(&textsend.lock);
+
+    return 0;
+}
+
+int
+textsend_active()
+{
+    return textsend.running;
+}
+
+int
+textsend_stop()
+{
+    textsend_cancel();
+
+    if (textsend.joinable) {
+        pthread_join(textsend.thr, NULL);
+        textsend.joinable = 0;
+    }
+
+    return 0;
+}
+
+static void *
+textsend_thread(void *arg)
+{
+    struct stat st;
+    const char *buf = NULL;
+    size_t len = 0;
+    size_t off = 0;
+    int fd;
+    int lines = 0;
+    int shown_pct = -1;
+    int timed_out = 0;
+    uint64_t gen;
+    const char *ending = textsend.config->no_crlf ? "\n" : "\r\n";
+
+    fd = open(textsend.path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        cheerios_print("Failed to open %s\r\n", textsend.path);
+        goto textsend_thread_cleanup;
+    }
+
+    len = st.st_size;
+    if (len > 0) {
+        buf = files_map(fd, len);
+        if (!buf) {
+            cheerios_print("Failed to read %s\r\n", textsend.path);
+            goto textsend_thread_cleanup;
+        }
+    }
+
+    cheerios_print("Sending %s (%zuB) line by line\r\n", textsend.path, len);
+
+    /* periodic commands would land in the middle of the file */
+    txq_hold();
+
+    if (textsend.use_prompt)
+        cheerios_tap_add(rx_tap, NULL);
+
+    while (off < len && textsend.running) {
+        const char *nl = memchr(&buf[off], '\n', len - off);
+        size_t end = nl ? (size_t)(nl - buf) : len;
+        size_t line_end = end;
+        int pct;
+
+        if (line_end > off && buf[line_end - 1] == '\r')
+            line_end--;
+
+        /* only output after this line counts towards its prompt */
+        pthread_mutex_lock(&textsend.lock);
+        textsend.rx_len = 0;
+        textsend.prompt_seen = 0;
+        textsend.sent = 0;
+        gen = ++textsend.gen;
+        pthread_mutex_unlock(&textsend.lock);
+
+        if (
+            txq_write(&buf[off], line_end - off) ||
+            txq_write(ending, strlen(ending))
+        ) {
+            break;
+        }
+        txq_end_cmd();
+
+        /* one line in flight at a time, so the progress is what has gone out
+         * and a cancel leaves nothing more queued */
+        if (!txq_on_sent(tx_sent, (void *)(uintptr_t)gen))
+            wait_sent();
+
+        lines++;
+        off = end + 1;
+
+        pct = off >= len ? 100 : (int)(off * 100 / len);
+        if (pct != shown_pct) {
+            shown_pct = pct;
+            bytenuts_set_status(STATUS_JOB, "send %d%%", pct);
+        }
+
+        if (textsend.use_prompt && off < len && wait_prompt()) {
+            timed_out = textsend.running;
+            break;
+        }
+    }
+
+    txq_release();
+
+    if (textsend.use_prompt)
+        cheerios_tap_remove(rx_tap, NULL);
+
+    if (timed_out) {
+        cheerios_print(
+            "Gave up on %s, no prompt within %ums of line %d\r\n",
+            textsend.path, textsend.config->send_prompt_to, lines
+        );
+    } else if (off < len) {
+        cheerios_print("Stopped sending %s after %d lines\r\n", textsend.path, lines);
+    } else {
+        cheerios_print("Sent %d lines of %s\r\n", lines, textsend.path);
+    }
+
+textsend_thread_cleanup:
+    if (buf)
+        files_unmap((void *)buf, len);
+    if (fd >= 0)
+        close(fd);
+
+    bytenuts_set_status(STATUS_JOB, "%s", "");
+
+    pthread_mutex_lock(&textsend.lock);
+    textsend.running = 0;
+    pthread_mutex_unlock(&textsend.lock);
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+/* Wait for the prompt to show up in the output. Returns 0 once it has, -1 on
+ * timeout or cancel. */
+static int
+wait_prompt(void)
+{
+    struct timespec deadline;
+    int ret = 0;
+
+#ifdef __MINGW32__
+    clock_gettime(CLOCK_REALTIME, &deadline);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+#endif
+    timer_add_ms(&deadline, textsend.config->send_prompt_to);
+
+    pthread_mutex_lock(&textsend.lock);
+
+    while (textsend.running && !textsend.prompt_seen) {
+        if (
+            pthread_cond_timedwait(&textsend.cond, &textsend.lock, &deadline) ==
+            ETIMEDOUT
+        ) {
+            break;
+        }
+    }
+
+    if (!textsend.running || !textsend.prompt_seen)
+        ret = -1;
+
+    pthread_mutex_unlock(&textsend.lock);
+
+    return ret;
+}
+
+/* Wait for the TX thread to have written the line, or a cancel */
+static void
+wait_sent(void)
+{
+    pthread_mutex_lock(&textsend.lock);
+    while (textsend.running && !textsend.sent) {
+        pthread_cond_wait(&textsend.cond, &textsend.lock);
+    }
+    pthread_mutex_unlock(&textsend.lock);
+}
+
+/* Runs on the TX thread once the line has been written */
+static void
+tx_sent(const struct timespec *ts, void *arg)
+{
+    pthread_mutex_lock(&textsend.lock);
+
+    if (textsend.gen == (uintptr_t)arg) {
+        textsend.sent = 1;
+        pthread_cond_broadcast(&textsend.cond);
+    }
+
+    pthread_mutex_unlock(&textsend.lock);
+}
+
+/* Runs on the reader thread, keeps the latest output and checks it for the
+ * prompt */
+static void
+rx_tap(const char *buf, size_t len, void *arg)
+{
+    pthread_mutex_lock(&textsend.lock);
+
+    if (textsend.prompt_seen) {
+        pthread_mutex_unlock(&textsend.lock);
+        return;
+    }
+
+    /* keep only the newest TEXTSEND_RX_MAX bytes */
+    if (len > TEXTSEND_RX_MAX) {
+        buf += len - TEXTSEND_RX_MAX;
+        len = TEXTSEND_RX_MAX;
+    }
+    if (textsend.rx_len + len > TEXTSEND_RX_MAX) {
+        size_t drop = textsend.rx_len + len - TEXTSEND_RX_MAX;
+
+        memmove(textsend.rx, &textsend.rx[drop], textsend.rx_len - drop);
+        textsend.rx_len -= drop;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        /* a NUL would end the string early */
+        textsend.rx[textsend.rx_len++] = buf[i] ? buf[i] : ' ';
+    }
+    textsend.rx[textsend.rx_len] = '\0';
+
+#ifdef __MINGW32__
+    /* no regex.h, the prompt is matched literally */
+    textsend.prompt_seen = strstr(textsend.rx, textsend.config->send_prompt) != NULL;
+#else
+    textsend.prompt_seen = !regexec(&textsend.prompt, textsend.rx, 0, NULL, 0);
+#endif
+
+    if (textsend.prompt_seen)
+        pthread_cond_broadcast(&textsend.cond);
+
+    pthread_mutex_unlock(&textsend.lock);
+}
@@ -0,0 +1,52 @@
+#ifndef _TEXTSEND_H_
+#define _TEXTSEND_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#ifndef __MINGW32__
+#  include <regex.h>
+#endif
+
+#include "bytenuts.h"
+
+/* output kept for matching the prompt, older output is dropped */
+#define TEXTSEND_RX_MAX (4096)
+
+typedef struct textsend_struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signalled when the line is sent, the prompt is
+                          * seen or on cancel */
+    pthread_t thr;
+    volatile int running; /* a file is being sent */
+    int joinable; /* thr has not been joined yet */
+    bytenuts_config_t *config;
+    char *path;
+    /* prompt to wait for between lines, matched against the output received
+     * since the previous line was sent */
+    int use_prompt;
+#ifndef __MINGW32__
+    regex_t prompt;
+#endif
+    char rx[TEXTSEND_RX_MAX + 1];
+    size_t rx_len;
+    int prompt_seen;
+    uint64_t gen; /* bumped per line, tells stale TX callbacks apart */
+    int sent; /* the current line has been written */
+} textsend_t;
+
+/* Start streaming the text file at path to the device line by line, each line
+ * sent like a typed command. Returns -1 if a file is already being sent or
+ * the prompt regex does not compile. */
+int textsend_start(bytenuts_config_t *config, const char *path);
+
+/* Stop sending after the current line */
+int textsend_cancel();
+
+/* Whether a file is being sent */
+int textsend_active();
+
+/* cancel any send and wait for it to finish */
+int textsend_stop();
+
+#endif /* _TEXTSEND_H_ */
@@ -26,7 +26,7 @@ timer_add(struct timespec *a, const struct timespec *b)
     a->tv_sec += b->tv_sec;
     a->tv_nsec += b->tv_nsec;
 
-    if (a->tv_nsec > 1000000000) {
+    if (a->tv_nsec >= 1000000000) {
         a->tv_sec += 1;
         a->tv_nsec -= 1000000000;
     }
@@ -42,6 +42,16 @@ timer_add_ms(struct timespec *ts, uint32_t ms)
     timer_add(ts, &tmp);
 }
 
+void
+timer_add_us(struct timespec *ts, uint32_t us)
+{
+    struct timespec tmp = {
+        .tv_sec = us / 1000000,
+        .tv_nsec = (us % 1000000) * 1000
+    };
+    timer_add(ts, &tmp);
+}
+
 void
 timer_sub(struct timespec *a, const struct timespec *b)
 {
@@ -69,3 +79,9 @@ timer_sub_ms(struct timespec *ts, uint32_t ms)
     };
     timer_sub(ts, &tmp);
 }
+
+int64_t
+timer_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000 + (a->tv_nsec - b->tv_nsec);
+}
@@ -18,10 +18,16 @@ void timer_add(struct timespec *a, const struct timespec *b);
 /* Add ms milliseconds to the timespec*/
 void timer_add_ms(struct timespec *ts, uint32_t ms);
 
+/* Add us microseconds to the timespec */
+void timer_add_us(struct timespec *ts, uint32_t us);
+
 /* Subtract time b from a. If b > a, then a is set to 0 */
 void timer_sub(struct timespec *a, const struct timespec *b);
 
 /* Subtract ms milliseconds from ts. If ts would become negative, it is set to 0 */
 void timer_sub_ms(struct timespec *ts, uint32_t ms);
 
+/* Nanoseconds from b to a, negative if b > a */
+int64_t timer_diff_ns(const struct timespec *a, const struct timespec *b);
+
 #endif /* _TIMER_MATH_H_ */
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "acmatch.h"
+#include "bstr.h"
+#include "trigger.h"
+
+typedef struct trigger_struct {
+    trigger_rule_t *rules; /* rule i is pattern i of the automaton */
+    int rules_n;
+    acmatch_handle ac;
+} trigger_t;
+
+typedef struct trigger_feed_struct {
+    trigger_t *trig;
+    trigger_fn fn;
+    void *arg;
+} trigger_feed_t;
+
+static const char *action_names[] = {
+    [TRIGGER_HIGHLIGHT] = "highlight",
+    [TRIGGER_BEEP] = "beep",
+    [TRIGGER_LOG] = "log",
+    [TRIGGER_SEND] = "send",
+    [TRIGGER_CAPTURE] = "capture",
+};
+
+static trigger_rule_t *new_rule(trigger_t *trig, int action, const char *pattern);
+static void on_match(int id, size_t end, void *arg);
+
+trigger_handle
+trigger_create(void)
+{
+    return calloc(1, sizeof(trigger_t));
+}
+
+int
+trigger_add(trigger_handle trig, const char *spec)
+{
+    const char *space = strchr(spec, ' ');
+    size_t word_len;
+    trigger_rule_t *rule;
+
+    if (!space || space[1] == '\0')
+        return -1;
+    word_len = space - spec;
+
+    if (word_len > 5 && !memcmp(spec, "send=", 5)) {
+        rule = new_rule(trig, TRIGGER_SEND, space + 1);
+        rule->resp = bstr_unescape(&spec[5], word_len - 5, &rule->resp_len);
+        return 0;
+    }
+
+    for (int i = 0; i < (int)(sizeof(action_names) / sizeof(action_names[0])); i++) {
+        if (
+            i != TRIGGER_SEND &&
+            strlen(action_names[i]) == word_len &&
+            !memcmp(spec, action_names[i], word_len)
+        ) {
+            new_rule(trig, i, space + 1);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int
+trigger_add_rule(trigger_handle trig, int action, const char *pattern)
+{
+    if (*pattern == '\0')
+        return -1;
+
+    new_rule(trig, action, pattern);
+    return 0;
+}
+
+int
+trigger_build(trigger_handle trig)
+{
+    char **patterns;
+
+    acmatch_destroy(trig->ac);
+    trig->ac = NULL;
+
+    if (trig->rules_n == 0)
+        return 0;
+
+    patterns = malloc(sizeof(char *) * trig->rules_n);
+    for (int i = 0; i < trig->rules_n; i++) {
+        patterns[i] = trig->rules[i].pattern;
+    }
+
+    trig->ac = acmatch_create(patterns, trig->rules_n);
+    free(patterns);
+
+    return trig->ac ? 0 : -1;
+}
+
+int
+trigger_feed(trigger_handle trig, const char *buf, size_t len, trigger_fn fn, void *arg)
+{
+    trigger_feed_t feed = { trig, fn, arg };
+
+    if (!trig->ac)
+        return 0;
+
+    return acmatch_feed(trig->ac, buf, len, on_match, &feed);
+}
+
+int
+trigger_count(trigger_handle trig)
+{
+    return trig->rules_n;
+}
+
+const trigger_rule_t *
+trigger_get(trigger_handle trig, int idx)
+{
+    return &trig->rules[idx];
+}
+
+int
+trigger_states(trigger_handle trig)
+{
+    return trig->ac ? acmatch_states(trig->ac) : 0;
+}
+
+const char *
+trigger_action_name(int action)
+{
+    return action_names[action];
+}
+
+void
+trigger_destroy(trigger_handle trig)
+{
+    if (!trig)
+        return;
+
+    for (int i = 0; i < trig->rules_n; i++) {
+        free(trig->rules[i].pattern);
+        free(trig->rules[i].resp);
+    }
+    free(trig->rules);
+    acmatch_destroy(trig->ac);
+    free(trig);
+}
+
+static trigger_rule_t *
+new_rule(trigger_t *trig, int action, const char *pattern)
+{
+    trigger_rule_t *rule;
+
+    trig->rules_n++;
+    trig->rules = realloc(trig->rules, sizeof(trigger_rule_t) * trig->rules_n);
+
+    rule = &trig->rules[trig->rules_n - 1];
+    memset(rule, 0, sizeof(trigger_rule_t));
+    rule->action = action;
+    rule->pattern = strdup(pattern);
+
+    return rule;
+}
+
+static void
+on_match(int id, size_t end, void *arg)
+{
+    trigger_feed_t *feed = arg;
+    trigger_rule_t *rule = &feed->trig->rules[id];
+
+    rule->hits++;
+    feed->fn(rule, end, feed->arg);
+}
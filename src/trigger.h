@@ -0,0 +1,61 @@
+#ifndef _TRIGGER_H_
+#define _TRIGGER_H_
+
+#include <stdio.h>
+
+/* Actions taken when a pattern shows up in the device output. Every pattern,
+ * capture patterns included, goes into one Aho-Corasick automaton so each byte
+ * read is looked at once however many triggers there are. */
+
+enum trigger_action_enum {
+    TRIGGER_HIGHLIGHT = 0, /* show the line in reverse video */
+    TRIGGER_BEEP, /* ring the terminal bell */
+    TRIGGER_LOG, /* put a marker line in the output and logs */
+    TRIGGER_SEND, /* send a response to the device */
+    TRIGGER_CAPTURE, /* start a pre-trigger capture */
+};
+
+typedef struct trigger_rule_struct {
+    int action;
+    char *pattern;
+    char *resp; /* response for TRIGGER_SEND, escapes already expanded */
+    size_t resp_len;
+    unsigned long hits;
+} trigger_rule_t;
+
+typedef struct trigger_struct * trigger_handle;
+
+/* called for each rule that fires, end is the offset of the last byte of the
+ * match in the buffer being fed */
+typedef void (*trigger_fn)(const trigger_rule_t *rule, size_t end, void *arg);
+
+trigger_handle trigger_create(void);
+
+/* Add a rule from its config form, "<action> <pattern>" where the action is
+ * one of highlight, beep, log, capture or send=<response>. The response may use
+ * \r, \n, \t, \e, \\ and \xHH. Returns -1 if spec is malformed. */
+int trigger_add(trigger_handle trig, const char *spec);
+
+/* Add a rule with the action already known */
+int trigger_add_rule(trigger_handle trig, int action, const char *pattern);
+
+/* Compile the rules added so far, must be called before trigger_feed */
+int trigger_build(trigger_handle trig);
+
+/* Run output through the automaton, calling fn for every rule that fires.
+ * Returns the number of rules that fired. */
+int trigger_feed(trigger_handle trig, const char *buf, size_t len, trigger_fn fn, void *arg);
+
+int trigger_count(trigger_handle trig);
+
+const trigger_rule_t *trigger_get(trigger_handle trig, int idx);
+
+/* Number of states in the compiled automaton */
+int trigger_states(trigger_handle trig);
+
+/* Name of an action as used in the config */
+const char *trigger_action_name(int action);
+
+void trigger_destroy(trigger_handle trig);
+
+#endif /* _TRIGGER_H_ */
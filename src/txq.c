@@ -0,0 +1,688 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cheerios.h"
+#include "timer_math.h"
+#include "txq.h"
+
+/* how often the queued byte count in the status bar may change */
+#define TXQ_STATUS_MS (100)
+
+static txq_t txq;
+
+static void *txq_thread(void *arg);
+static void ring_put(const char *buf, size_t n);
+static void mark_end(void);
+static size_t take_chunk(char *chunk, size_t max, int *ends_cmd);
+static void wait_until(const struct timespec *deadline);
+static void update_status(int force);
+
+int
+txq_start(bytenuts_t *bytenuts)
+{
+    memset(&txq, 0, sizeof(txq));
+
+    txq.ser_fd = bytenuts->serial_fd;
+    txq.cap = (size_t)bytenuts->config.tx_queue_kb * 1024;
+    if (txq.cap == 0)
+        txq.cap = 1024;
+    txq.buf = malloc(txq.cap);
+
+    txq.inter_char_us = bytenuts->config.inter_char_us;
+    txq.inter_line_ms = bytenuts->config.inter_line_ms;
+    txq.inter_cmd_ms = bytenuts->config.inter_cmd_to;
+
+    pthread_mutex_init(&txq.lock, NULL);
+    {
+        pthread_condattr_t attr;
+
+        /* pacing deadlines must not move when the wall clock is stepped */
+        pthread_condattr_init(&attr);
+#ifndef __MINGW32__
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+        pthread_cond_init(&txq.cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    update_status(1);
+
+    txq.running = 1;
+    if (pthread_create(&txq.thr, NULL, txq_thread, NULL)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+txq_stop()
+{
+    pthread_mutex_lock(&txq.lock);
+    txq.running = 0;
+    pthread_cond_broadcast(&txq.cond);
+    pthread_mutex_unlock(&txq.lock);
+
+    pthread_join(txq.thr, NULL);
+    free(txq.buf);
+    txq.buf = NULL;
+
+    return 0;
+}
+
+int
+txq_write(const char *buf, size_t len)
+{
+    size_t p = 0;
+
+    pthread_mutex_lock(&txq.lock);
+
+    while (p < len) {
+        size_t n;
+
+        while (txq.running && txq.len == txq.cap) {
+            pthread_cond_wait(&txq.cond, &txq.lock);
+        }
+
+        if (!txq.running) {
+            pthread_mutex_unlock(&txq.lock);
+            return -1;
+        }
+
+        n = txq.cap - txq.len;
+        if (n > len - p)
+            n = len - p;
+
+        ring_put(&buf[p], n);
+        p += n;
+    }
+
+    pthread_mutex_unlock(&txq.lock);
+
+    update_status(0);
+
+    return 0;
+}
+
+int
+txq_try_cmd(const char *buf, size_t len)
+{
+    pthread_mutex_lock(&txq.lock);
+
+    if (
+        !txq.running ||
+        txq.cap - txq.len < len ||
+        (txq.inter_cmd_ms > 0 && txq.cmds_n == TXQ_CMDS_MAX)
+    ) {
+        pthread_mutex_unlock(&txq.lock);
+        return -1;
+    }
+
+    ring_put(buf, len);
+    if (txq.inter_cmd_ms > 0)
+        mark_end();
+
+    pthread_mutex_unlock(&txq.lock);
+
+    update_status(0);
+
+    return 0;
+}
+
+size_t
+txq_write_some(const char *buf, size_t len)
+{
+    size_t n;
+
+    pthread_mutex_lock(&txq.lock);
+
+    n = txq.running ? txq.cap - txq.len : 0;
+    if (n > len)
+        n = len;
+    if (n > 0)
+        ring_put(buf, n);
+
+    pthread_mutex_unlock(&txq.lock);
+
+    if (n > 0)
+        update_status(0);
+
+    return n;
+}
+
+int
+txq_try_end_cmd()
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&txq.lock);
+
+    if (txq.inter_cmd_ms > 0 && txq.running) {
+        if (txq.cmds_n == TXQ_CMDS_MAX)
+            ret = -1;
+        else
+            mark_end();
+    }
+
+    pthread_mutex_unlock(&txq.lock);
+
+    return ret;
+}
+
+int
+txq_end_cmd()
+{
+    pthread_mutex_lock(&txq.lock);
+
+    if (txq.inter_cmd_ms == 0) {
+        pthread_mutex_unlock(&txq.lock);
+        return 0;
+    }
+
+    while (txq.running && txq.cmds_n == TXQ_CMDS_MAX) {
+        pthread_cond_wait(&txq.cond, &txq.lock);
+    }
+
+    if (txq.running)
+        mark_end();
+
+    pthread_mutex_unlock(&txq.lock);
+
+    return 0;
+}
+
+int
+txq_on_sent(txq_sent_fn fn, void *arg)
+{
+    struct timespec done;
+    int slot = -1;
+
+    pthread_mutex_lock(&txq.lock);
+
+    for (int i = 0; i < TXQ_SENT_MAX; i++) {
+        if (txq.sent[i].fn == fn) {
+            slot = i;
+            break;
+        }
+        if (!txq.sent[i].fn && slot < 0)
+            slot = i;
+    }
+
+    if (txq.taken < txq.queued || txq.sending > 0) {
+        if (slot < 0) {
+            pthread_mutex_unlock(&txq.lock);
+            return -1;
+        }
+        txq.sent[slot].fn = fn;
+        txq.sent[slot].arg = arg;
+        txq.sent[slot].at = txq.queued;
+        pthread_mutex_unlock(&txq.lock);
+        return 0;
+    }
+
+    /* beaten to it, the end of the last write is when it went out */
+    if (slot >= 0 && txq.sent[slot].fn == fn)
+        txq.sent[slot].fn = NULL;
+    done = txq.burst_end;
+    pthread_mutex_unlock(&txq.lock);
+
+    fn(&done, arg);
+
+    return 0;
+}
+
+int
+txq_hold()
+{
+    pthread_mutex_lock(&txq.lock);
+    txq.holds++;
+    pthread_mutex_unlock(&txq.lock);
+
+    return 0;
+}
+
+int
+txq_release()
+{
+    pthread_mutex_lock(&txq.lock);
+    if (txq.holds > 0)
+        txq.holds--;
+    pthread_mutex_unlock(&txq.lock);
+
+    return 0;
+}
+
+int
+txq_held()
+{
+    int ret;
+
+    pthread_mutex_lock(&txq.lock);
+    ret = txq.holds > 0;
+    pthread_mutex_unlock(&txq.lock);
+
+    return ret;
+}
+
+int
+txq_pause()
+{
+    pthread_mutex_lock(&txq.lock);
+    txq.pauses++;
+    while (txq.running && txq.sending > 0) {
+        pthread_cond_wait(&txq.cond, &txq.lock);
+    }
+    pthread_mutex_unlock(&txq.lock);
+
+    return 0;
+}
+
+int
+txq_resume()
+{
+    pthread_mutex_lock(&txq.lock);
+    if (txq.pauses > 0)
+        txq.pauses--;
+    pthread_cond_broadcast(&txq.cond);
+    pthread_mutex_unlock(&txq.lock);
+
+    return 0;
+}
+
+int
+txq_drain()
+{
+    pthread_mutex_lock(&txq.lock);
+    while (txq.running && ((txq.len > 0 && !txq.pauses) || txq.sending > 0)) {
+        pthread_cond_wait(&txq.cond, &txq.lock);
+    }
+    pthread_mutex_unlock(&txq.lock);
+
+    return 0;
+}
+
+size_t
+txq_pending()
+{
+    size_t ret;
+
+    pthread_mutex_lock(&txq.lock);
+    ret = txq.len + txq.sending;
+    pthread_mutex_unlock(&txq.lock);
+
+    return ret;
+}
+
+size_t
+txq_written()
+{
+    size_t ret;
+
+    pthread_mutex_lock(&txq.lock);
+    ret = txq.total;
+    pthread_mutex_unlock(&txq.lock);
+
+    return ret;
+}
+
+int
+txq_print_stats()
+{
+    size_t pending;
+    size_t total;
+    struct timespec burst;
+    uint64_t burst_bytes;
+    uint64_t late_n;
+    uint64_t late_sum_ns;
+    uint64_t late_max_ns;
+    double burst_s;
+
+    pthread_mutex_lock(&txq.lock);
+    pending = txq.len + txq.sending;
+    total = txq.total;
+    burst = txq.burst_end;
+    timer_sub(&burst, &txq.burst_start);
+    burst_bytes = txq.burst_bytes;
+    late_n = txq.late_n;
+    late_sum_ns = txq.late_sum_ns;
+    late_max_ns = txq.late_max_ns;
+    pthread_mutex_unlock(&txq.lock);
+
+    burst_s = burst.tv_sec + burst.tv_nsec / 1e9;
+
+    cheerios_print("tx queued: %zu/%zuB\r\n", pending, txq.cap);
+    cheerios_print("tx sent: %zuB\r\n", total);
+    cheerios_print(
+        "tx pacing: char %uus, line %ums, cmd %ums\r\n",
+        txq.inter_char_us, txq.inter_line_ms, txq.inter_cmd_ms
+    );
+    if (burst_s > 0) {
+        cheerios_print(
+            "tx rate: %.0fB/s (%lluB in last burst)\r\n",
+            burst_bytes / burst_s, (unsigned long long)burst_bytes
+        );
+    }
+    if (late_n > 0) {
+        cheerios_print(
+            "tx pacing jitter: avg %lluus, max %lluus over %llu waits\r\n",
+            (unsigned long long)(late_sum_ns / late_n / 1000),
+            (unsigned long long)(late_max_ns / 1000),
+            (unsigned long long)late_n
+        );
+    }
+
+    return 0;
+}
+
+static void *
+txq_thread(void *arg)
+{
+    char chunk[1024];
+    int idle = 1;
+
+    while (1) {
+        struct timespec now;
+        size_t n;
+        size_t p = 0;
+        int ends_cmd;
+        uint32_t gap_us;
+        txq_sent_fn sent_fn[TXQ_SENT_MAX];
+        void *sent_arg[TXQ_SENT_MAX];
+        int sent_n = 0;
+
+        pthread_mutex_lock(&txq.lock);
+
+        while (txq.running && (txq.len == 0 || txq.pauses)) {
+            idle = 1;
+            pthread_cond_wait(&txq.cond, &txq.lock);
+        }
+
+        if (!txq.running) {
+            pthread_mutex_unlock(&txq.lock);
+            break;
+        }
+
+        /* data arriving inside the previous gap carries on the same burst */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (idle && timer_cmp(&now, &txq.next_ts) >= 0) {
+            txq.burst_start = now;
+            txq.burst_end = now;
+            txq.burst_bytes = 0;
+        }
+        idle = 0;
+
+        /* hold off until the gap after the previous write has passed */
+        wait_until(&txq.next_ts);
+        if (!txq.running) {
+            pthread_mutex_unlock(&txq.lock);
+            break;
+        }
+
+        /* a transfer took the port while we waited */
+        if (txq.pauses) {
+            pthread_mutex_unlock(&txq.lock);
+            continue;
+        }
+
+        /* take a chunk off the ring so writers can refill it while we wait on
+         * the port */
+        n = take_chunk(chunk, sizeof(chunk), &ends_cmd);
+
+        pthread_mutex_unlock(&txq.lock);
+
+        while (p < n && txq.running) {
+            ssize_t ret;
+
+            /* wake up now and then to notice a stop request */
+            if (serial_wait_write(txq.ser_fd, 100) <= 0)
+                continue;
+
+            ret = serial_write(txq.ser_fd, &chunk[p], n - p);
+            if (ret < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    continue;
+                /* the port is gone, drop the rest of the chunk */
+                break;
+            }
+
+            p += ret;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        pthread_mutex_lock(&txq.lock);
+
+        /* the longest gap that applies to where this chunk ended */
+        if (txq.cmd_sending)
+            ends_cmd = 1;
+        txq.cmd_sending = 0;
+        gap_us = txq.inter_char_us;
+        if (n > 0 && chunk[n - 1] == '\n' && txq.inter_line_ms * 1000 > gap_us)
+            gap_us = txq.inter_line_ms * 1000;
+        if (ends_cmd && txq.inter_cmd_ms * 1000 > gap_us)
+            gap_us = txq.inter_cmd_ms * 1000;
+
+        txq.sending = 0;
+        txq.total += p;
+        txq.burst_bytes += p;
+        txq.burst_end = now;
+        txq.next_ts = now;
+        timer_add_us(&txq.next_ts, gap_us);
+        for (int i = 0; i < TXQ_SENT_MAX; i++) {
+            if (txq.sent[i].fn && txq.taken >= txq.sent[i].at) {
+                sent_fn[sent_n] = txq.sent[i].fn;
+                sent_arg[sent_n++] = txq.sent[i].arg;
+                txq.sent[i].fn = NULL;
+            }
+        }
+        pthread_cond_broadcast(&txq.cond);
+        pthread_mutex_unlock(&txq.lock);
+
+        for (int i = 0; i < sent_n; i++) {
+            sent_fn[i](&now, sent_arg[i]);
+        }
+
+        update_status(0);
+    }
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+/* Append n bytes that are known to fit to the ring. Called locked. */
+static void
+ring_put(const char *buf, size_t n)
+{
+    size_t tail = (txq.head + txq.len) % txq.cap;
+    size_t first = txq.cap - tail;
+
+    if (first > n)
+        first = n;
+
+    memcpy(&txq.buf[tail], buf, first);
+    memcpy(txq.buf, &buf[first], n - first);
+
+    txq.len += n;
+    txq.queued += n;
+    pthread_cond_broadcast(&txq.cond);
+}
+
+/* End the command at everything queued so far, a boundary slot must be free.
+ * Called locked. */
+static void
+mark_end(void)
+{
+    /* nothing new since the last mark */
+    if (txq.queued == txq.marked)
+        return;
+    txq.marked = txq.queued;
+
+    if (txq.taken < txq.queued) {
+        txq.cmd_ends[(txq.cmds_head + txq.cmds_n) % TXQ_CMDS_MAX] = txq.queued;
+        txq.cmds_n++;
+    } else if (txq.sending > 0) {
+        /* the writer already has the end of it */
+        txq.cmd_sending = 1;
+    } else {
+        /* already written, the gap runs from the end of that write */
+        struct timespec next = txq.burst_end;
+
+        timer_add_ms(&next, txq.inter_cmd_ms);
+        if (timer_cmp(&next, &txq.next_ts) > 0)
+            txq.next_ts = next;
+    }
+}
+
+/* Move the next chunk off the ring, cut short where pacing wants a gap: after
+ * every byte, every newline or the end of a command. Called locked. */
+static size_t
+take_chunk(char *chunk, size_t max, int *ends_cmd)
+{
+    size_t n = txq.len;
+    size_t first;
+
+    if (n > max)
+        n = max;
+    if (txq.inter_char_us > 0)
+        n = 1;
+
+    /* a boundary with nothing left before it would make an empty chunk */
+    while (txq.cmds_n > 0 && txq.cmd_ends[txq.cmds_head] <= txq.taken) {
+        txq.cmds_head = (txq.cmds_head + 1) % TXQ_CMDS_MAX;
+        txq.cmds_n--;
+    }
+
+    if (txq.cmds_n > 0) {
+        uint64_t left = txq.cmd_ends[txq.cmds_head] - txq.taken;
+
+        if (left < n)
+            n = left;
+    }
+
+    first = txq.cap - txq.head;
+    if (first > n)
+        first = n;
+
+    memcpy(chunk, &txq.buf[txq.head], first);
+    memcpy(&chunk[first], txq.buf, n - first);
+
+    if (txq.inter_line_ms > 0) {
+        char *nl = memchr(chunk, '\n', n);
+
+        if (nl)
+            n = nl - chunk + 1;
+    }
+
+    txq.head = (txq.head + n) % txq.cap;
+    txq.len -= n;
+    txq.taken += n;
+    txq.sending = n;
+
+    *ends_cmd = 0;
+    if (txq.cmds_n > 0 && txq.cmd_ends[txq.cmds_head] == txq.taken) {
+        txq.cmds_head = (txq.cmds_head + 1) % TXQ_CMDS_MAX;
+        txq.cmds_n--;
+        *ends_cmd = 1;
+    }
+
+    pthread_cond_broadcast(&txq.cond);
+
+    return n;
+}
+
+/* Sleep on the condition until the monotonic deadline or a stop request,
+ * recording how late we woke. Called locked. */
+static void
+wait_until(const struct timespec *deadline)
+{
+    struct timespec now;
+    uint64_t late_ns;
+    int waited = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while (txq.running && timer_cmp(&now, deadline) < 0) {
+#ifdef __MINGW32__
+        /* the condition only waits on the wall clock here */
+        struct timespec left = *deadline;
+        struct timespec abs;
+
+        timer_sub(&left, &now);
+        clock_gettime(CLOCK_REALTIME, &abs);
+        timer_add(&abs, &left);
+        pthread_cond_timedwait(&txq.cond, &txq.lock, &abs);
+#else
+        pthread_cond_timedwait(&txq.cond, &txq.lock, deadline);
+#endif
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waited = 1;
+    }
+
+    if (!waited || !txq.running)
+        return;
+
+    timer_sub(&now, deadline);
+    late_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    txq.late_n++;
+    txq.late_sum_ns += late_ns;
+    if (late_ns > txq.late_max_ns)
+        txq.late_max_ns = late_ns;
+}
+
+static void
+update_status(int force)
+{
+    struct timespec now;
+    struct timespec next;
+    size_t pending;
+    double rate = 0;
+    int show = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&txq.lock);
+
+    pending = txq.len + txq.sending;
+    next = txq.status_ts;
+    timer_add_ms(&next, TXQ_STATUS_MS);
+
+    /* always show when the queue fills or empties, otherwise rate limit */
+    if (
+        force ||
+        (
+            pending != txq.status_shown &&
+            (
+                pending == 0 ||
+                txq.status_shown == 0 ||
+                timer_cmp(&now, &next) >= 0
+            )
+        )
+    ) {
+        struct timespec burst = txq.burst_end;
+
+        show = 1;
+        txq.status_ts = now;
+        txq.status_shown = pending;
+
+        timer_sub(&burst, &txq.burst_start);
+        if (burst.tv_sec > 0 || burst.tv_nsec > 0)
+            rate = txq.burst_bytes / (burst.tv_sec + burst.tv_nsec / 1e9);
+    }
+
+    pthread_mutex_unlock(&txq.lock);
+
+    if (!show)
+        return;
+
+    if (pending == 0) {
+        bytenuts_set_status(STATUS_TX, "tx idle");
+    } else if (rate > 0) {
+        bytenuts_set_status(STATUS_TX, "tx %zuB %.0fB/s", pending, rate);
+    } else {
+        bytenuts_set_status(STATUS_TX, "tx %zuB", pending);
+    }
+}
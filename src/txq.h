@@ -0,0 +1,122 @@
+#ifndef _TXQ_H_
+#define _TXQ_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bytenuts.h"
+
+/* called on the TX thread with the time the last byte went out */
+typedef void (*txq_sent_fn)(const struct timespec *ts, void *arg);
+
+/* txq_on_sent callbacks waiting at once, one per fn */
+#define TXQ_SENT_MAX (4)
+
+/* command boundaries remembered at once, txq_end_cmd blocks beyond this */
+#define TXQ_CMDS_MAX (256)
+
+typedef struct txq_struct {
+    pthread_mutex_t lock; /* never held while touching the serial port */
+    pthread_cond_t cond; /* signalled when data is queued or space frees up */
+    volatile int running;
+    pthread_t thr;
+    serial_t ser_fd;
+    char *buf; /* ring of bytes waiting to be written */
+    size_t cap;
+    size_t head; /* next byte to write out */
+    size_t len; /* bytes in the ring */
+    size_t sending; /* bytes taken off the ring but not yet written */
+    size_t total; /* bytes written since startup */
+    /* pacing, all gaps are measured on CLOCK_MONOTONIC from the end of one
+     * write to the start of the next */
+    uint32_t inter_char_us;
+    uint32_t inter_line_ms;
+    uint32_t inter_cmd_ms;
+    uint64_t queued; /* bytes ever queued */
+    uint64_t taken; /* bytes ever taken off the ring */
+    uint64_t cmd_ends[TXQ_CMDS_MAX]; /* ring of queued offsets ending a command */
+    int cmds_head;
+    int cmds_n;
+    uint64_t marked; /* queued at the last txq_end_cmd */
+    int cmd_sending; /* the chunk being written ends a command */
+    int holds; /* txq_hold calls not yet released */
+    int pauses; /* txq_pause calls not yet resumed, nothing is written */
+    struct timespec next_ts; /* earliest the next write may start */
+    /* achieved rate over the latest burst, a burst starting when data is
+     * queued to an idle writer */
+    struct timespec burst_start;
+    struct timespec burst_end;
+    uint64_t burst_bytes;
+    /* how late paced writes started compared to their schedule */
+    uint64_t late_n;
+    uint64_t late_sum_ns;
+    uint64_t late_max_ns;
+    /* each called once taken reaches its at and that chunk has been written */
+    struct {
+        txq_sent_fn fn; /* NULL if free */
+        void *arg;
+        uint64_t at;
+    } sent[TXQ_SENT_MAX];
+    struct timespec status_ts; /* last time the status was updated */
+    size_t status_shown; /* queued byte count in the status bar */
+} txq_t;
+
+/* startup the TX writer thread */
+int txq_start(bytenuts_t *bytenuts);
+
+/* stop the TX writer thread, dropping anything still queued */
+int txq_stop();
+
+/* Queue a buffer for transmission. Blocks while the queue is full, so callers
+ * are held back to the rate of the port. */
+int txq_write(const char *buf, size_t len);
+
+/* Queue buf and end the command there, only if both fit without waiting.
+ * Returns -1 and queues nothing otherwise. */
+int txq_try_cmd(const char *buf, size_t len);
+
+/* Queue as much of buf as fits without waiting, returns how much that was */
+size_t txq_write_some(const char *buf, size_t len);
+
+/* txq_end_cmd, but returns -1 rather than waiting when TXQ_CMDS_MAX commands
+ * are already pending */
+int txq_try_end_cmd();
+
+/* Mark everything queued so far as one command, so the next byte waits for
+ * the inter command gap */
+int txq_end_cmd();
+
+/* Call fn once everything queued so far has been written, replacing the same
+ * fn if it is still waiting. Called straight away if it already has been.
+ * Returns -1 if TXQ_SENT_MAX others are waiting. */
+int txq_on_sent(txq_sent_fn fn, void *arg);
+
+/* Claim the line for a transfer that must not be interleaved with commands
+ * from the periodic scheduler, which skips its sends while any claim is held.
+ * Claims nest, each txq_hold needs a txq_release. */
+int txq_hold();
+int txq_release();
+
+/* whether any txq_hold is in effect */
+int txq_held();
+
+/* Stop writing for a transfer that uses the port directly, returning once the
+ * chunk being written is out. Anything queued meanwhile waits for the
+ * matching txq_resume. Pauses nest like holds. */
+int txq_pause();
+int txq_resume();
+
+/* block until everything queued has been written, or while paused only what
+ * is being written */
+int txq_drain();
+
+/* number of bytes queued but not yet written */
+size_t txq_pending();
+
+/* number of bytes written since startup */
+size_t txq_written();
+
+int txq_print_stats();
+
+#endif /* _TXQ_H_ */
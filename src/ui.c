@@ -0,0 +1,450 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __MINGW32__
+#  include <io.h>
+#else
+#  include <poll.h>
+#endif
+
+#include "cheerios.h"
+#include "ingest.h"
+#include "timer_math.h"
+#include "ui.h"
+
+/* shortest time between two frames, events arriving sooner are batched */
+#define UI_FRAME_MS (10)
+
+/* every event that redraws something */
+#define UI_EV_ALL (((1u << UI_EV_MAX) - 1) & ~(1u << UI_EV_BELL))
+
+/* key codes for the bracketed paste markers */
+#define UI_KEY_PASTE_BEGIN (KEY_MAX + 2)
+#define UI_KEY_PASTE_END   (KEY_MAX + 3)
+
+static ui_t ui = {
+    .head = &ui.stub,
+    .tail = &ui.stub,
+    .wake_fds = { -1, -1 },
+    .key_fds = { -1, -1 },
+    .paste_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *ui_thread(void *arg);
+static void handle_key(int ch);
+static void paste_append(char ch);
+static void paste_finish(void);
+static void queue_push(ui_event_t *ev);
+static ui_event_t *queue_pop(void);
+static void draw(unsigned int dirty);
+static void wait_ready(int to_ms);
+static void wake(void);
+static int make_pipe(int fds[2]);
+#ifndef __MINGW32__
+static void winch_handler(int sig);
+#endif
+
+int
+ui_start(bytenuts_t *bytenuts)
+{
+    ui.status_win = bytenuts->status_win;
+    ui.out_win = bytenuts->out_win;
+    ui.in_win = bytenuts->in_win;
+
+    if (make_pipe(ui.key_fds) || make_pipe(ui.wake_fds))
+        return -1;
+
+#ifndef __MINGW32__
+    /* have the terminal mark pastes so they can be taken in one go */
+    define_key("\033[200~", UI_KEY_PASTE_BEGIN);
+    define_key("\033[201~", UI_KEY_PASTE_END);
+    fputs("\033[?2004h", stdout);
+    fflush(stdout);
+
+    /* the UI thread must never block handing off keys or waking itself */
+    fcntl(ui.key_fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(ui.wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(ui.wake_fds[1], F_SETFL, O_NONBLOCK);
+
+    {
+        struct sigaction sa;
+
+        /* ncurses queues KEY_RESIZE from its own handler, chain onto it so a
+         * resize also wakes the UI thread */
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = winch_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGWINCH, &sa, &ui.winch_prev);
+    }
+#endif
+
+    ui.running = 1;
+    if (pthread_create(&ui.thr, NULL, ui_thread, NULL)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+ui_stop()
+{
+    ui.running = 0;
+    wake();
+    pthread_join(ui.thr, NULL);
+
+#ifndef __MINGW32__
+    sigaction(SIGWINCH, &ui.winch_prev, NULL);
+    fputs("\033[?2004l", stdout);
+    fflush(stdout);
+#endif
+
+    free(ui.paste_buf);
+    while (ui.pastes) {
+        ui_paste_t *next = ui.pastes->next;
+
+        free(ui.pastes->buf);
+        free(ui.pastes);
+        ui.pastes = next;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        close(ui.wake_fds[i]);
+        close(ui.key_fds[i]);
+        ui.wake_fds[i] = -1;
+        ui.key_fds[i] = -1;
+    }
+
+    return 0;
+}
+
+void
+ui_post(int type)
+{
+    unsigned int bit = 1u << type;
+
+    /* already queued, the UI thread has not drawn it yet */
+    if (atomic_fetch_or(&ui.pending, bit) & bit)
+        return;
+
+    queue_push(&ui.events[type]);
+    wake();
+}
+
+int
+ui_read_key()
+{
+    int ch;
+
+    while (1) {
+        ssize_t ret = read(ui.key_fds[0], &ch, sizeof(ch));
+
+        if (ret == sizeof(ch))
+            return ch;
+        if (ret < 0 && errno == EINTR)
+            continue;
+        return ERR;
+    }
+}
+
+void
+ui_wake_reader()
+{
+    int ch = ERR;
+    ssize_t ret = write(ui.key_fds[1], &ch, sizeof(ch));
+    (void)ret;
+}
+
+char *
+ui_take_paste(size_t *len)
+{
+    ui_paste_t *paste;
+    char *buf = NULL;
+
+    pthread_mutex_lock(&ui.paste_lock);
+
+    paste = ui.pastes;
+    if (paste) {
+        ui.pastes = paste->next;
+        buf = paste->buf;
+        *len = paste->len;
+        free(paste);
+    }
+
+    pthread_mutex_unlock(&ui.paste_lock);
+
+    return buf;
+}
+
+static void *
+ui_thread(void *arg)
+{
+    unsigned int dirty = UI_EV_ALL;
+    struct timespec next_frame = { 0 };
+
+    while (ui.running) {
+        struct timespec now;
+        ui_event_t *ev;
+        int ch;
+        int to_ms = -1;
+
+        /* hand off every key ncurses has for us */
+        while ((ch = wgetch(ui.in_win)) != ERR) {
+            if (ch == KEY_RESIZE) {
+                dirty |= 1u << UI_EV_RESIZE;
+                continue;
+            }
+
+            handle_key(ch);
+        }
+
+        while ((ev = queue_pop())) {
+            unsigned int bit = 1u << (ev - ui.events);
+
+            /* clear before drawing so later changes queue a new frame */
+            atomic_fetch_and(&ui.pending, ~bit);
+            dirty |= bit;
+        }
+
+        if (dirty) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+
+            if (timer_cmp(&now, &next_frame) >= 0) {
+                draw(dirty);
+                dirty = 0;
+
+                next_frame = now;
+                timer_add_ms(&next_frame, UI_FRAME_MS);
+            } else {
+                struct timespec left = next_frame;
+
+                timer_sub(&left, &now);
+                to_ms = left.tv_nsec / 1000000 + 1;
+            }
+        }
+
+        wait_ready(to_ms);
+    }
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+static void
+handle_key(int ch)
+{
+    ssize_t ret;
+
+    if (ch == UI_KEY_PASTE_BEGIN) {
+        ui.pasting = 1;
+        ui.paste_len = 0;
+        return;
+    } else if (ch == UI_KEY_PASTE_END) {
+        paste_finish();
+        return;
+    } else if (ui.pasting) {
+        if (ch == '\r' || ch == KEY_ENTER)
+            ch = '\n';
+        if (ch < 256)
+            paste_append((char)ch);
+        return;
+    }
+
+    /* ingest is busy (e.g. an xmodem transfer), drop the key rather than
+     * stall the screen */
+    ret = write(ui.key_fds[1], &ch, sizeof(ch));
+    (void)ret;
+}
+
+static void
+paste_append(char ch)
+{
+    if (ui.paste_len == ui.paste_cap) {
+        ui.paste_cap = ui.paste_cap ? ui.paste_cap * 2 : 4096;
+        ui.paste_buf = realloc(ui.paste_buf, ui.paste_cap);
+    }
+
+    ui.paste_buf[ui.paste_len++] = ch;
+}
+
+/* Queue the finished paste and tell ingest about it with a single key */
+static void
+paste_finish(void)
+{
+    ui_paste_t *paste;
+    ui_paste_t **tail;
+    int ch = UI_KEY_PASTE;
+    ssize_t ret;
+
+    if (!ui.pasting)
+        return;
+    ui.pasting = 0;
+
+    if (ui.paste_len == 0)
+        return;
+
+    paste = malloc(sizeof(ui_paste_t));
+    paste->buf = ui.paste_buf;
+    paste->len = ui.paste_len;
+    paste->next = NULL;
+
+    ui.paste_buf = NULL;
+    ui.paste_len = 0;
+    ui.paste_cap = 0;
+
+    pthread_mutex_lock(&ui.paste_lock);
+    tail = &ui.pastes;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = paste;
+    pthread_mutex_unlock(&ui.paste_lock);
+
+    ret = write(ui.key_fds[1], &ch, sizeof(ch));
+    (void)ret;
+}
+
+/* Vyukov's intrusive MPSC queue, safe for any number of pushing threads */
+static void
+queue_push(ui_event_t *ev)
+{
+    ui_event_t *prev;
+
+    atomic_store(&ev->next, NULL);
+    prev = atomic_exchange(&ui.head, ev);
+    atomic_store(&prev->next, ev);
+}
+
+/* Only called from the UI thread */
+static ui_event_t *
+queue_pop(void)
+{
+    ui_event_t *tail = ui.tail;
+    ui_event_t *next = atomic_load(&tail->next);
+
+    if (tail == &ui.stub) {
+        if (!next)
+            return NULL;
+        ui.tail = next;
+        tail = next;
+        next = atomic_load(&next->next);
+    }
+
+    if (next) {
+        ui.tail = next;
+        return tail;
+    }
+
+    /* a producer is between its exchange and its store, it wakes us once
+     * the push is complete */
+    if (tail != atomic_load(&ui.head))
+        return NULL;
+
+    queue_push(&ui.stub);
+
+    next = atomic_load(&tail->next);
+    if (next) {
+        ui.tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+static void
+draw(unsigned int dirty)
+{
+    if (dirty & (1u << UI_EV_BELL)) {
+        beep();
+    }
+
+    if (dirty & (1u << UI_EV_RESIZE)) {
+        bytenuts_update_screen_size();
+        clearok(curscr, TRUE);
+        dirty = UI_EV_ALL;
+    }
+
+    if (dirty & (1u << UI_EV_OUTPUT)) {
+        cheerios_draw();
+        wnoutrefresh(ui.out_win);
+    }
+
+    if (dirty & (1u << UI_EV_STATUS)) {
+        bytenuts_draw_status();
+        wnoutrefresh(ui.status_win);
+    }
+
+    if (dirty & (1u << UI_EV_INPUT)) {
+        ingest_draw();
+    }
+
+    /* the input window goes last so the cursor ends up in it */
+    wnoutrefresh(ui.in_win);
+    doupdate();
+}
+
+/* Wait for a key, a posted event or to_ms milliseconds */
+static void
+wait_ready(int to_ms)
+{
+#ifdef __MINGW32__
+    /* no pollable console handle, fall back to a short sleep */
+    nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+#else
+    struct pollfd fds[2];
+    char drain[64];
+
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = ui.wake_fds[0];
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    if (poll(fds, 2, to_ms) > 0 && (fds[1].revents & POLLIN)) {
+        while (read(ui.wake_fds[0], drain, sizeof(drain)) > 0);
+    }
+#endif
+}
+
+static void
+wake(void)
+{
+    if (ui.wake_fds[1] >= 0) {
+        ssize_t ret = write(ui.wake_fds[1], "", 1);
+        (void)ret;
+    }
+}
+
+static int
+make_pipe(int fds[2])
+{
+#ifdef __MINGW32__
+    return _pipe(fds, 4096, _O_BINARY);
+#else
+    return pipe(fds);
+#endif
+}
+
+#ifndef __MINGW32__
+static void
+winch_handler(int sig)
+{
+    int saved_errno = errno;
+
+    if (
+        ui.winch_prev.sa_handler != SIG_DFL &&
+        ui.winch_prev.sa_handler != SIG_IGN
+    ) {
+        ui.winch_prev.sa_handler(sig);
+    }
+
+    wake();
+    errno = saved_errno;
+}
+#endif
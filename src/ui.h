@@ -0,0 +1,87 @@
+#ifndef _UI_H_
+#define _UI_H_
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "bytenuts.h"
+
+/* Only the UI thread touches ncurses. Other threads post events saying what
+ * needs to be redrawn, and the UI thread draws every dirty window with
+ * wnoutrefresh before a single doupdate. It also reads the keyboard and hands
+ * keys to ingest through ui_read_key. */
+
+enum ui_event_enum {
+    UI_EV_OUTPUT = 0, /* output window contents changed */
+    UI_EV_STATUS, /* status bar changed */
+    UI_EV_INPUT, /* input line changed */
+    UI_EV_RESIZE, /* terminal was resized */
+    UI_EV_BELL, /* ring the terminal bell, not a redraw */
+    UI_EV_MAX,
+};
+
+/* returned by ui_read_key when a bracketed paste is ready in ui_take_paste */
+#define UI_KEY_PASTE (KEY_MAX + 1)
+
+typedef struct ui_event_struct {
+    struct ui_event_struct *_Atomic next;
+} ui_event_t;
+
+typedef struct ui_paste_struct {
+    char *buf;
+    size_t len;
+    struct ui_paste_struct *next;
+} ui_paste_t;
+
+typedef struct ui_struct {
+    /* intrusive MPSC queue: producers swap themselves in at head, the UI
+     * thread pops from tail */
+    ui_event_t *_Atomic head;
+    ui_event_t *tail;
+    ui_event_t stub;
+    /* one node per event type, it is in the queue while its bit is set, so
+     * repeated posts coalesce into one redraw */
+    ui_event_t events[UI_EV_MAX];
+    atomic_uint pending;
+    pthread_t thr;
+    volatile int running;
+    int wake_fds[2]; /* wakes the UI thread when an event is posted */
+    int key_fds[2]; /* keys read by the UI thread, as ints */
+    WINDOW *status_win;
+    WINDOW *out_win;
+    WINDOW *in_win;
+    /* paste being read between the ESC[200~ and ESC[201~ markers */
+    int pasting;
+    char *paste_buf;
+    size_t paste_len;
+    size_t paste_cap;
+    /* finished pastes waiting for ui_take_paste, oldest first */
+    pthread_mutex_t paste_lock;
+    ui_paste_t *pastes;
+#ifndef __MINGW32__
+    struct sigaction winch_prev; /* SIGWINCH handler installed by ncurses */
+#endif
+} ui_t;
+
+/* Start the UI thread, ncurses must already be initialized */
+int ui_start(bytenuts_t *bytenuts);
+
+/* Stop the UI thread, after which ncurses may be used directly again */
+int ui_stop();
+
+/* Ask the UI thread to redraw, safe to call from any thread at any time */
+void ui_post(int type);
+
+/* Block until the next key is pressed. Returns ERR if woken by
+ * ui_wake_reader. */
+int ui_read_key();
+
+/* Make a ui_read_key call return ERR */
+void ui_wake_reader();
+
+/* Take the oldest finished paste after ui_read_key returned UI_KEY_PASTE. The
+ * caller frees the returned buffer, NULL if there is none. */
+char *ui_take_paste(size_t *len);
+
+#endif /* _UI_H_ */